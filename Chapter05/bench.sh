@@ -0,0 +1,176 @@
+#!/bin/bash
+#
+# bench.sh - compare the Chapter 5 server models on loopback
+#
+# Every model is started on its own, driven by ./client with the same
+# workloads, and stopped again.  Server CPU time and resident memory are
+# summed over the whole process group, so forked and preforked children
+# are counted along with the parent.
+#
+# Tunables (environment): DURATION seconds per run, WARMUP seconds the
+# client runs first without counting (connection setup and cold starts),
+# CONNS connections, THREADS client threads, WORKERS for the pooled models.
+
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNS=${CONNS:-100}
+THREADS=${THREADS:-1}
+WORKERS=${WORKERS:-4}
+PORT=1972
+
+# name|command|persistent (keeps a connection open for many messages)
+# The -line models are the one-shot servers in newline-framed persistent
+# mode; the pooled ones get a worker per connection.
+MODELS=(
+    "select|./server1|yes"
+    "epoll|./server1 -e|yes"
+    "io_uring|./server1 -u|yes"
+    "fork|./server2|no"
+    "handoff|./server2 -w $WORKERS|no"
+    "prefork|./server3 $WORKERS|no"
+    "adaptive|./server3 -m 2 -M 8 -x 64 $WORKERS|no"
+    "prefork-ex|./server3 -e $WORKERS|no"
+    "thread|./server4|no"
+    "workpool|./server4 -w $WORKERS|no"
+    "prethread|./server5 $WORKERS|no"
+    "shared|./server5 -s $WORKERS|yes"
+    "exclusive|./server5 -e $WORKERS|yes"
+    "reuseport|./server5 -r $WORKERS|yes"
+    "fork-line|./server2 -p line|yes"
+    "prefork-line|./server3 -p line $CONNS|yes"
+    "thread-line|./server4 -p line|yes"
+    "prethrd-line|./server5 -p line $CONNS|yes"
+)
+
+# name|client arguments|needs a persistent server
+# Payloads stay within the 25 bytes the one-shot servers read.
+WORKLOADS=(
+    "storm|-n 1 -s 25|no"
+    "longlived|-s 25|yes"
+    "pipelined|-p 16 -s 25|yes"
+    "mixed|-n 1 -s 1,8,16,25|no"
+)
+
+CLK_TCK=$(getconf CLK_TCK)
+
+# Sum of user+system ticks, including reaped children, for a process group
+group_cpu() {
+    cat /proc/[0-9]*/stat 2>/dev/null |
+        awk -v pg="$1" '$5 == pg { t += $14 + $15 + $16 + $17 } END { print t + 0 }'
+}
+
+group_rss() {
+    local pid
+    local total=0
+    local rss
+    for pid in $(cat /proc/[0-9]*/stat 2>/dev/null | awk -v pg="$1" '$5 == pg { print $1 }'); do
+        rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status 2>/dev/null)
+        total=$((total + ${rss:-0}))
+    done
+    echo $total
+}
+
+wait_for_port() {
+    local x
+    for x in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+run_one() {
+    local name=$1
+    local cmd=$2
+    local wname=$3
+    local wargs=$4
+    local pid
+    local client
+    local sampler
+    local peakfile
+    local outfile
+    local cpu0
+    local cpu1
+    local peak
+    local out
+
+    setsid $cmd >/dev/null 2>&1 &
+    pid=$!
+    if ! wait_for_port || ! kill -0 $pid 2>/dev/null; then
+        printf "%-12s %-10s failed to start\n" "$name" "$wname"
+        kill -- -$pid 2>/dev/null
+        return
+    fi
+
+    peakfile=$(mktemp)
+    (
+        peak=0
+        while kill -0 $pid 2>/dev/null; do
+            rss=$(group_rss $pid)
+            if [ $rss -gt $peak ]; then
+                peak=$rss
+                echo $peak > $peakfile
+            fi
+            sleep 0.2
+        done
+    ) &
+    sampler=$!
+
+    # Setup is left out of the client's figures by its warmup, and out of the CPU time here
+    outfile=$(mktemp)
+    ./client -t $THREADS -w $WARMUP -d $DURATION $wargs $CONNS > $outfile &
+    client=$!
+    sleep $WARMUP
+    cpu0=$(group_cpu $pid)
+    wait $client
+    cpu1=$(group_cpu $pid)
+    out=$(cat $outfile)
+    rm -f $outfile
+
+    kill -- -$pid 2>/dev/null
+    wait $pid 2>/dev/null
+    wait $sampler 2>/dev/null
+    peak=$(cat $peakfile)
+    rm -f $peakfile
+
+    echo "$out" | awk -v name="$name" -v wname="$wname" -v ticks=$((cpu1 - cpu0)) \
+                      -v hz=$CLK_TCK -v peak="${peak:-0}" '
+        /^requests/    { reqs = $2; errs = $4 }
+        /^throughput/  { rps = $2 }
+        /^latency_us/  { for (i = 2; i < NF; i += 2) lat[$i] = $(i + 1) }
+        END {
+            cpu = (reqs > 0) ? ticks / hz * 1e6 / reqs : 0
+            printf "%-12s %-10s %12.1f %9.1f %9.1f %9.1f %10.2f %9d %7d\n",
+                   name, wname, rps, lat["p50"], lat["p99"], lat["p999"], cpu, peak, errs
+        }'
+    sleep 0.5
+}
+
+if [ ! -x ./client ]; then
+    echo "bench.sh: build first (make)" >&2
+    exit 1
+fi
+
+if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+    echo "bench.sh: port $PORT is already in use" >&2
+    exit 1
+fi
+
+echo "# kernel $(uname -r), $(nproc) cpus, duration ${DURATION}s, warmup ${WARMUP}s," \
+     "$CONNS connections, $THREADS client threads, $WORKERS workers"
+printf "%-12s %-10s %12s %9s %9s %9s %10s %9s %7s\n" \
+       model workload req/s p50_us p99_us p999_us cpu_us/req rss_kb errors
+
+for model in "${MODELS[@]}"; do
+    IFS='|' read -r name cmd persistent <<< "$model"
+    for workload in "${WORKLOADS[@]}"; do
+        IFS='|' read -r wname wargs needs <<< "$workload"
+        if [ "$needs" = yes ] && [ "$persistent" != yes ]; then
+            printf "%-12s %-10s %12s\n" "$name" "$wname" "n/a"
+            continue
+        fi
+        run_one "$name" "$cmd" "$wname" "$wargs"
+    done
+done
@@ -1,61 +1,676 @@
+/* client.c - load generator for the echo servers */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
-#include <string.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-void child_func(int childnum);
+#define MAX_SIZES       16
+#define MAX_EVENTS      256
+#define BACKLOG_MAX     (1 << 20)
 
-int main(int argc, char *argv[])
+/*
+ * Latency histogram in the style of HdrHistogram: values below 2048 ns
+ * are exact, larger ones fall in power-of-two buckets split into 1024
+ * linear sub-buckets, which keeps three significant digits everywhere.
+ */
+#define HIST_SUB_BITS   11
+#define HIST_HALF       (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS    35
+#define HIST_COUNTS     ((HIST_BUCKETS + 1) * HIST_HALF)
+#define HIST_MAX        ((1LL << (HIST_BUCKETS + HIST_SUB_BITS - 1)) - 1)
+
+#define CONN_CONNECTING 0
+#define CONN_READY      1
+
+struct hist {
+    long long counts[HIST_COUNTS];
+    long long total;
+    long long min;
+    long long max;
+    double sum;
+};
+
+struct request {
+    long long start;
+    int size;
+};
+
+struct conn {
+    int fd;
+    int state;
+    char *obuf;
+    int olen;
+    int ooff;
+    int ocap;
+    struct request *reqs;   /* outstanding, oldest first, ring of depth */
+    int rhead;
+    int rcount;
+    int rgot;               /* bytes of the oldest response received */
+    long nsent;
+    long long opened;
+    int stacked;
+};
+
+struct thread_ctx {
+    pthread_t tid;
+    int epfd;
+    int timerfd;
+    struct conn *conns;
+    int nconns;
+    struct conn **ready;    /* open loop: connections with a free slot */
+    int nready;
+    long long *backlog;     /* open loop: scheduled start times not yet sent */
+    int bhead;
+    int bcount;
+    long long next_send;
+    long long interval;
+    int sizeidx;
+    struct hist hist;
+    long long requests;
+    long long errors;
+    long long connects;
+    long long dropped;
+    long long bytes;
+};
+
+/* Options */
+struct sockaddr_in server_addr;
+int nthreads = 1;
+int nconns = 1;
+double rate = 0;
+double duration = 10;
+double warmup = 0;
+int sizes[MAX_SIZES] = { 25 };
+int nsizes = 1;
+int maxsize = 25;
+int depth = 1;
+long lifetime = 0;
+int length_framed = 0;
+
+long long measure_start;
+long long run_end;
+char *payload;
+
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hist_index(long long value)
+{
+    int bucket;
+    int sub;
+
+    if (value < 0) {
+        value = 0;
+    }
+    if (value > HIST_MAX) {
+        value = HIST_MAX;
+    }
+    bucket = 63 - __builtin_clzll(value | ((1 << HIST_SUB_BITS) - 1)) - (HIST_SUB_BITS - 1);
+    sub = value >> bucket;
+
+    return ((bucket + 1) << (HIST_SUB_BITS - 1)) + sub - HIST_HALF;
+}
+
+/* Highest value that maps to the same slot as index */
+long long hist_value(int index)
+{
+    int bucket = (index >> (HIST_SUB_BITS - 1)) - 1;
+    long long sub = (index & (HIST_HALF - 1)) + HIST_HALF;
+
+    if (bucket < 0) {
+        bucket = 0;
+        sub -= HIST_HALF;
+    }
+    return ((sub + 1) << bucket) - 1;
+}
+
+void hist_record(struct hist *h, long long value)
+{
+    h->counts[hist_index(value)]++;
+    if (h->total == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->total++;
+    h->sum += value;
+}
+
+void hist_merge(struct hist *to, const struct hist *from)
 {
-    int nchildren = 1;
-    int pid;
     int x;
 
-    if (argc > 1) {
-        nchildren = atoi(argv[1]);
+    if (from->total == 0) {
+        return;
+    }
+    for (x = 0; x < HIST_COUNTS; x++) {
+        to->counts[x] += from->counts[x];
+    }
+    if (to->total == 0 || from->min < to->min) {
+        to->min = from->min;
+    }
+    if (from->max > to->max) {
+        to->max = from->max;
     }
-    
-    for (x = 0; x < nchildren; x++) {
-        if ((pid = fork()) == 0) {
-            child_func(x + 1);
-            exit(0);
+    to->total += from->total;
+    to->sum += from->sum;
+}
+
+long long hist_percentile(const struct hist *h, double pct)
+{
+    long long target;
+    long long seen = 0;
+    int x;
+
+    target = (long long) (pct / 100.0 * h->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    for (x = 0; x < HIST_COUNTS; x++) {
+        seen += h->counts[x];
+        if (seen >= target) {
+            return (hist_value(x) < h->max) ? hist_value(x) : h->max;
+        }
+    }
+    return h->max;
+}
+
+void conn_open(struct thread_ctx *t, struct conn *c);
+
+void conn_reset(struct thread_ctx *t, struct conn *c, int failed)
+{
+    close(c->fd);
+    if (failed) {
+        t->errors += c->rcount;
+        if (c->rcount == 0) {
+            t->errors++;
         }
     }
+    c->olen = 0;
+    c->ooff = 0;
+    c->rhead = 0;
+    c->rcount = 0;
+    c->rgot = 0;
+    c->nsent = 0;
+    conn_open(t, c);
+}
+
+void conn_open(struct thread_ctx *t, struct conn *c)
+{
+    struct epoll_event ev;
+    int flag = 1;
+
+    c->state = CONN_CONNECTING;
+    c->opened = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (c->fd < 0) {
+        perror("client");
+        exit(1);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(c->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0
+        && errno != EINPROGRESS) {
+        /* Reported through EPOLLERR below, like an asynchronous failure */
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/* Queue one request on c; the caller flushes */
+void conn_issue(struct thread_ctx *t, struct conn *c, long long start)
+{
+    struct request *r;
+    uint32_t body;
+    int size;
 
-    wait(NULL);
+    size = sizes[t->sizeidx++ % nsizes];
+    if (c->olen + size > c->ocap) {
+        if (c->ooff > 0) {
+            memmove(c->obuf, c->obuf + c->ooff, c->olen - c->ooff);
+            c->olen -= c->ooff;
+            c->ooff = 0;
+        }
+        if (c->olen + size > c->ocap) {
+            c->ocap = (c->olen + size) * 2;
+            c->obuf = realloc(c->obuf, c->ocap);
+            if (c->obuf == NULL) {
+                perror("client");
+                exit(1);
+            }
+        }
+    }
+    if (length_framed) {
+        /* A 4-byte big-endian body length, then the body */
+        body = htonl(size - 4);
+        memcpy(c->obuf + c->olen, &body, 4);
+        memcpy(c->obuf + c->olen + 4, payload, size - 4);
+    } else {
+        /* Every payload ends in a newline so line-framed servers can echo it */
+        memcpy(c->obuf + c->olen, payload, size - 1);
+        c->obuf[c->olen + size - 1] = '\n';
+    }
+    c->olen += size;
+
+    r = &c->reqs[(c->rhead + c->rcount) % depth];
+    r->start = start;
+    r->size = size;
+    c->rcount++;
+    c->nsent++;
+}
+
+int conn_can_issue(struct conn *c)
+{
+    return c->state == CONN_READY && c->rcount < depth && (lifetime == 0 || c->nsent < lifetime);
+}
+
+int conn_flush(struct conn *c)
+{
+    int nsent;
+
+    while (c->ooff < c->olen) {
+        nsent = send(c->fd, c->obuf + c->ooff, c->olen - c->ooff, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->ooff += nsent;
+    }
+    c->ooff = 0;
+    c->olen = 0;
 
     return 0;
 }
 
-void child_func(int childnum)
+void ready_push(struct thread_ctx *t, struct conn *c)
+{
+    if (!c->stacked && conn_can_issue(c)) {
+        c->stacked = 1;
+        t->ready[t->nready++] = c;
+    }
+}
+
+/* Open loop: hand due requests to connections that have room for them */
+void dispatch(struct thread_ctx *t)
+{
+    struct conn *c;
+
+    while (t->bcount > 0 && t->nready > 0) {
+        c = t->ready[t->nready - 1];
+        if (!conn_can_issue(c)) {
+            c->stacked = 0;
+            t->nready--;
+            continue;
+        }
+        conn_issue(t, c, t->backlog[t->bhead]);
+        t->bhead = (t->bhead + 1) % BACKLOG_MAX;
+        t->bcount--;
+        if (conn_flush(c) < 0) {
+            c->stacked = 0;
+            t->nready--;
+            conn_reset(t, c, 1);
+        }
+    }
+}
+
+void conn_fill(struct thread_ctx *t, struct conn *c)
+{
+    if (rate > 0) {
+        ready_push(t, c);
+        return;
+    }
+    /*
+     * The first requests on a connection are timed from connect(), so a
+     * connection storm charges time spent in the accept backlog too.
+     */
+    while (conn_can_issue(c)) {
+        conn_issue(t, c, (c->nsent == 0) ? c->opened : now_ns());
+    }
+    if (conn_flush(c) < 0) {
+        conn_reset(t, c, 1);
+    }
+}
+
+void conn_complete(struct thread_ctx *t, struct conn *c, long long now)
+{
+    struct request *r = &c->reqs[c->rhead];
+
+    if (r->start >= measure_start) {
+        hist_record(&t->hist, now - r->start);
+        t->requests++;
+        t->bytes += r->size;
+    }
+    c->rhead = (c->rhead + 1) % depth;
+    c->rcount--;
+    c->rgot = 0;
+}
+
+void conn_readable(struct thread_ctx *t, struct conn *c)
+{
+    char buffer[65536];
+    long long now;
+    int nread;
+    int avail;
+    int need;
+
+    while (1) {
+        nread = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (nread == 0) {
+            conn_reset(t, c, c->rcount > 0 || lifetime == 0 || c->nsent < lifetime);
+            return;
+        }
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn_reset(t, c, 1);
+            return;
+        }
+        now = now_ns();
+        avail = nread;
+        while (avail > 0 && c->rcount > 0) {
+            need = c->reqs[c->rhead].size - c->rgot;
+            if (avail < need) {
+                c->rgot += avail;
+                avail = 0;
+            } else {
+                avail -= need;
+                conn_complete(t, c, now);
+            }
+        }
+    }
+
+    if (lifetime > 0 && c->nsent >= lifetime && c->rcount == 0) {
+        /* Connection has served its lifetime; start over with a new one */
+        conn_reset(t, c, 0);
+        return;
+    }
+    conn_fill(t, c);
+}
+
+void conn_event(struct thread_ctx *t, struct conn *c, unsigned events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (c->state == CONN_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            conn_reset(t, c, 1);
+            return;
+        }
+        c->state = CONN_READY;
+        t->connects++;
+        conn_fill(t, c);
+        return;
+    }
+    if ((events & EPOLLOUT) && conn_flush(c) < 0) {
+        conn_reset(t, c, 1);
+        return;
+    }
+    if (events & EPOLLIN) {
+        conn_readable(t, c);
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_reset(t, c, 1);
+    }
+}
+
+void* thread_proc(void *arg)
 {
-    int sock;
-    struct sockaddr_in sAddr;
-    char buffer[25];
+    struct thread_ctx *t = (struct thread_ctx *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    struct itimerspec its;
+    unsigned long long ticks;
+    long long now;
+    int timeout;
+    int nready;
     int x;
 
-    sAddr.sin_family = AF_INET;
-    sAddr.sin_addr.s_addr = INADDR_ANY;
-    sAddr.sin_port = 0;
-    
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    bind(sock, (const struct sockaddr *) &sAddr, sizeof(sAddr));
-    
-    sAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    sAddr.sin_port = htons(1972);
-    
-    if (connect(sock, (const struct sockaddr *) &sAddr, sizeof(sAddr)) != 0) {
-      perror("client");
-      return;
-    }
-      
-    snprintf(buffer, 128, "data from client #%i.", childnum);
-    sleep(1);
-    printf("child #%i sent %i chars\n", childnum, send(sock, buffer, strlen(buffer), 0));
-    sleep(1);
-    printf("child #%i received %i chars\n", childnum, recv(sock, buffer, 25, 0));
-    sleep(1);
-    
-    close(sock);
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (rate > 0) {
+        t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timerfd, &ev);
+        t->interval = (long long) (1e9 * nthreads / rate);
+        t->next_send = now_ns();
+    }
+    for (x = 0; x < t->nconns; x++) {
+        t->conns[x].reqs = calloc(depth, sizeof(struct request));
+        conn_open(t, &t->conns[x]);
+    }
+
+    while ((now = now_ns()) < run_end) {
+        timeout = (int) ((run_end - now) / 1000000) + 1;
+        if (rate > 0) {
+            /*
+             * Open loop: requests are due on a fixed schedule whether or
+             * not the server keeps up, and latency is measured from the
+             * scheduled time so queueing delay is not hidden.
+             */
+            while (t->next_send <= now) {
+                if (t->bcount == BACKLOG_MAX) {
+                    t->dropped++;
+                } else {
+                    t->backlog[(t->bhead + t->bcount) % BACKLOG_MAX] = t->next_send;
+                    t->bcount++;
+                }
+                t->next_send += t->interval;
+            }
+            dispatch(t);
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = t->next_send / 1000000000LL;
+            its.it_value.tv_nsec = t->next_send % 1000000000LL;
+            timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+        nready = epoll_wait(t->epfd, events, MAX_EVENTS, timeout);
+        for (x = 0; x < nready; x++) {
+            if (events[x].data.ptr == NULL) {
+                read(t->timerfd, &ticks, sizeof(ticks));
+                continue;
+            }
+            conn_event(t, (struct conn *) events[x].data.ptr, events[x].events);
+        }
+    }
+
+    return arg;
+}
+
+int parse_sizes(char *list)
+{
+    char *tok;
+
+    nsizes = 0;
+    maxsize = 0;
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (nsizes == MAX_SIZES || atoi(tok) < 1) {
+            return -1;
+        }
+        sizes[nsizes] = atoi(tok);
+        if (sizes[nsizes] > maxsize) {
+            maxsize = sizes[nsizes];
+        }
+        nsizes++;
+    }
+    return (nsizes > 0) ? 0 : -1;
+}
+
+void usage(void)
+{
+    fprintf(stderr,
+            "usage: client [options] [connections]\n"
+            "  -h host     server address (127.0.0.1)\n"
+            "  -P port     server port (1972)\n"
+            "  -t threads  worker threads, each with its own epoll loop (1)\n"
+            "  -r rate     open loop at rate requests/s in total (closed loop)\n"
+            "  -p depth    requests in flight per connection (1)\n"
+            "  -s sizes    comma separated payload sizes, used in turn (25)\n"
+            "  -n count    requests per connection before reconnecting (unlimited)\n"
+            "  -l          length-prefixed requests, sizes include the 4-byte header\n"
+            "  -d secs     measured duration (10)\n"
+            "  -w secs     warmup excluded from the results (0)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct thread_ctx *threads;
+    struct hist *total;
+    struct rlimit rl;
+    long long requests = 0;
+    long long errors = 0;
+    long long connects = 0;
+    long long dropped = 0;
+    long long bytes = 0;
+    double elapsed;
+    int opt;
+    int x;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server_addr.sin_port = htons(1972);
+
+    while ((opt = getopt(argc, argv, "h:P:t:r:p:s:n:d:w:l")) != -1) {
+        switch (opt) {
+        case 'h':
+            server_addr.sin_addr.s_addr = inet_addr(optarg);
+            break;
+        case 'P':
+            server_addr.sin_port = htons(atoi(optarg));
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            if (parse_sizes(optarg) < 0) {
+                usage();
+            }
+            break;
+        case 'n':
+            lifetime = atol(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'l':
+            length_framed = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc) {
+        nconns = atoi(argv[optind]);
+    }
+    if (nthreads < 1 || nconns < nthreads || depth < 1 || duration <= 0) {
+        usage();
+    }
+    for (x = 0; x < nsizes; x++) {
+        if (length_framed && sizes[x] < 4) {
+            usage();
+        }
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    payload = malloc(maxsize);
+    threads = calloc(nthreads, sizeof(struct thread_ctx));
+    total = calloc(1, sizeof(struct hist));
+    if (payload == NULL || threads == NULL || total == NULL) {
+        perror("client");
+        return 1;
+    }
+    memset(payload, 'x', maxsize);
+
+    measure_start = now_ns() + (long long) (warmup * 1e9);
+    run_end = measure_start + (long long) (duration * 1e9);
+
+    for (x = 0; x < nthreads; x++) {
+        threads[x].nconns = nconns / nthreads + (x < nconns % nthreads);
+        threads[x].conns = calloc(threads[x].nconns, sizeof(struct conn));
+        threads[x].ready = calloc(threads[x].nconns, sizeof(struct conn *));
+        if (rate > 0) {
+            threads[x].backlog = calloc(BACKLOG_MAX, sizeof(long long));
+        }
+        if (pthread_create(&threads[x].tid, NULL, thread_proc, &threads[x]) != 0) {
+            printf("Could not create thread.\n");
+            return 1;
+        }
+    }
+    for (x = 0; x < nthreads; x++) {
+        pthread_join(threads[x].tid, NULL);
+        hist_merge(total, &threads[x].hist);
+        requests += threads[x].requests;
+        errors += threads[x].errors;
+        connects += threads[x].connects;
+        dropped += threads[x].dropped + threads[x].bcount;
+        bytes += threads[x].bytes;
+    }
+    elapsed = duration;
+
+    printf("mode        %s", rate > 0 ? "open" : "closed");
+    if (rate > 0) {
+        printf(" rate %.0f/s", rate);
+    }
+    if (length_framed) {
+        printf(" length-prefixed");
+    }
+    printf("\nconnections %i threads %i depth %i lifetime %li\n", nconns, nthreads, depth, lifetime);
+    printf("requests    %lld errors %lld connects %lld unsent %lld\n", requests, errors, connects, dropped);
+    printf("throughput  %.1f req/s %.2f MB/s\n", requests / elapsed, bytes / elapsed / 1e6);
+    if (total->total > 0) {
+        printf("latency_us  min %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f p9999 %.1f max %.1f mean %.1f\n",
+               total->min / 1e3,
+               hist_percentile(total, 50) / 1e3,
+               hist_percentile(total, 90) / 1e3,
+               hist_percentile(total, 99) / 1e3,
+               hist_percentile(total, 99.9) / 1e3,
+               hist_percentile(total, 99.99) / 1e3,
+               total->max / 1e3,
+               total->sum / total->total / 1e3);
+    }
+
+    return 0;
 }
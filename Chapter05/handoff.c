@@ -0,0 +1,84 @@
+/* handoff.c */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "handoff.h"
+
+int handoff_send_fd(int chan, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char c = 0;
+    int result;
+
+    /* At least one byte of real data must go with the descriptor */
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+        result = sendmsg(chan, &msg, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+
+    return (result < 0) ? -1 : 0;
+}
+
+int handoff_recv_fd(int chan)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char c;
+    int result;
+    int fd;
+
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        result = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0) {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
@@ -0,0 +1,15 @@
+/* handoff.h */
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/*
+ * Pass an open descriptor over a UNIX domain socket with SCM_RIGHTS.
+ * The receiver gets a new descriptor for the same open file; the sender
+ * may close its own copy as soon as the call returns.
+ */
+int handoff_send_fd(int chan, int fd);
+
+/* Receive a descriptor sent by handoff_send_fd(), or -1 on EOF or error */
+int handoff_recv_fd(int chan);
+
+#endif
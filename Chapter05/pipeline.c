@@ -0,0 +1,148 @@
+/* pipeline.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "pipeline.h"
+
+int pipeline_framing(const char *name)
+{
+    if (strcmp(name, "line") == 0) {
+        return FRAME_LINE;
+    }
+    if (strcmp(name, "length") == 0) {
+        return FRAME_LENGTH;
+    }
+    return -1;
+}
+
+/*
+ * Length of the complete request at the start of buf, 0 if more bytes
+ * are needed, or -1 if the request can never fit in the read buffer.
+ */
+static int frame_length(int framing, const char *buf, int len)
+{
+    const char *nl;
+    uint32_t body;
+
+    if (framing == FRAME_LINE) {
+        nl = memchr(buf, '\n', len);
+        if (nl != NULL) {
+            return nl - buf + 1;
+        }
+        return (len == PIPELINE_BUFF_SIZE) ? -1 : 0;
+    }
+
+    if (len < 4) {
+        return 0;
+    }
+    memcpy(&body, buf, 4);
+    body = ntohl(body);
+    if (body > PIPELINE_BUFF_SIZE - 4) {
+        return -1;
+    }
+    return (len >= 4 + (int) body) ? 4 + (int) body : 0;
+}
+
+/*
+ * Send the whole iovec array, however the socket splits it up.  It goes
+ * through sendmsg() rather than writev() for MSG_NOSIGNAL: a client that
+ * hangs up mid-pipeline is an error here, not a SIGPIPE for the server.
+ */
+static int sendmsg_all(int sock, struct iovec *iov, int niov)
+{
+    struct msghdr msg;
+    ssize_t nsent;
+
+    memset(&msg, 0, sizeof(msg));
+    while (niov > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        nsent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (niov > 0 && (size_t) nsent >= iov->iov_len) {
+            nsent -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + nsent;
+            iov->iov_len -= nsent;
+        }
+    }
+
+    return 0;
+}
+
+long pipeline_serve(int sock, int framing)
+{
+    struct iovec iov[PIPELINE_MAX_IOV];
+    char *buffer;
+    long served = 0;
+    int len = 0;
+    int off;
+    int flen;
+    int niov;
+    int nread;
+
+    buffer = malloc(PIPELINE_BUFF_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    while (1) {
+        nread = recv(sock, buffer + len, PIPELINE_BUFF_SIZE - len, 0);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        len += nread;
+
+        /*
+         * Answer everything the client has pipelined so far.  Each
+         * response is its own iovec, as it would be for a server that
+         * builds replies separately, and they all go out in one sendmsg().
+         */
+        off = 0;
+        niov = 0;
+        while ((flen = frame_length(framing, buffer + off, len - off)) > 0) {
+            iov[niov].iov_base = buffer + off;
+            iov[niov].iov_len = flen;
+            niov++;
+            off += flen;
+            served++;
+            if (niov == PIPELINE_MAX_IOV) {
+                if (sendmsg_all(sock, iov, niov) < 0) {
+                    flen = -1;
+                    break;
+                }
+                niov = 0;
+            }
+        }
+        if (flen < 0 || sendmsg_all(sock, iov, niov) < 0) {
+            served = -1;
+            break;
+        }
+
+        /* Keep the partial request, if any, at the start of the buffer */
+        len -= off;
+        if (len > 0 && off > 0) {
+            memmove(buffer, buffer + off, len);
+        }
+    }
+
+    free(buffer);
+    return served;
+}
@@ -0,0 +1,25 @@
+/* pipeline.h */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/* Framing of requests on a persistent connection */
+#define FRAME_NONE          0   /* one recv, one send, close */
+#define FRAME_LINE          1   /* each request ends in '\n' */
+#define FRAME_LENGTH        2   /* 4-byte big-endian body length, then body */
+
+/* Read buffer; no single request may be larger */
+#define PIPELINE_BUFF_SIZE  65536
+/* Most responses gathered into one sendmsg() */
+#define PIPELINE_MAX_IOV    256
+
+/* Map "line" or "length" to a FRAME_ value, or -1 */
+int pipeline_framing(const char *name);
+
+/*
+ * Echo framed requests on sock until the peer closes it.  Every complete
+ * request in the read buffer is answered by a single sendmsg().  Returns
+ * the number of requests served, or -1 on error or a malformed request.
+ */
+long pipeline_serve(int sock, int framing);
+
+#endif
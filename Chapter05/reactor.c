@@ -0,0 +1,366 @@
+/* reactor.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "reactor.h"
+
+/* Idle buffers kept for reuse before they are handed back to malloc */
+#define REACTOR_POOL_MAX    1024
+
+/*
+ * One accepted client.  Buffers are only attached while they hold data,
+ * so an idle connection costs nothing but this structure.
+ */
+struct conn {
+    int fd;
+    char *rbuf;     /* received, not yet consumed */
+    int rlen;
+    char *wbuf;     /* consumed, not yet sent */
+    int woff;
+    int wlen;
+};
+
+struct reactor {
+    int epfd;
+    int listensock;
+    int sparefd;
+    struct reactor_stats *stats;
+    struct reactor_stats own_stats;
+    char *pool[REACTOR_POOL_MAX];
+    int npool;
+};
+
+static char *buf_get(struct reactor *r)
+{
+    if (r->npool > 0) {
+        return r->pool[--r->npool];
+    }
+    return malloc(REACTOR_BUFF_SIZE);
+}
+
+static void buf_put(struct reactor *r, char *buf)
+{
+    if (r->npool < REACTOR_POOL_MAX) {
+        r->pool[r->npool++] = buf;
+    } else {
+        free(buf);
+    }
+}
+
+static void conn_close(struct reactor *r, struct conn *c)
+{
+    /* Closing the descriptor also removes it from the epoll set */
+    close(c->fd);
+    if (c->rbuf != NULL) {
+        buf_put(r, c->rbuf);
+    }
+    if (c->wbuf != NULL) {
+        buf_put(r, c->wbuf);
+    }
+    free(c);
+}
+
+/* Send as much of the write buffer as the socket will take */
+static int conn_flush(struct reactor *r, struct conn *c)
+{
+    int nsent;
+
+    while (c->woff < c->wlen) {
+        nsent = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        c->woff += nsent;
+    }
+    c->woff = 0;
+    c->wlen = 0;
+    buf_put(r, c->wbuf);
+    c->wbuf = NULL;
+
+    return 0;
+}
+
+/*
+ * Echo the read buffer back.  With nothing already queued the bytes go
+ * straight out of the read buffer; whatever the socket refuses is copied
+ * to the write buffer and left for EPOLLOUT.  Bytes that do not fit stay
+ * in the read buffer, which stops further reads until the peer catches up.
+ */
+static int conn_consume(struct reactor *r, struct conn *c)
+{
+    int used = 0;
+    int room;
+    int n;
+
+    if (c->wlen == 0) {
+        n = send(c->fd, c->rbuf, c->rlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return -1;
+            }
+            n = 0;
+        }
+        used = n;
+    }
+
+    if (used < c->rlen) {
+        if (c->wbuf == NULL) {
+            c->wbuf = buf_get(r);
+            if (c->wbuf == NULL) {
+                return -1;
+            }
+        } else if (c->woff > 0) {
+            memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+            c->wlen -= c->woff;
+            c->woff = 0;
+        }
+        room = REACTOR_BUFF_SIZE - c->wlen;
+        n = c->rlen - used;
+        if (n > room) {
+            n = room;
+        }
+        memcpy(c->wbuf + c->wlen, c->rbuf + used, n);
+        c->wlen += n;
+        used += n;
+    }
+
+    if (used < c->rlen) {
+        memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+    }
+    c->rlen -= used;
+
+    return 0;
+}
+
+/* Edge-triggered: keep reading until the socket runs dry or we must wait */
+static int conn_read(struct reactor *r, struct conn *c)
+{
+    int nread;
+
+    while (1) {
+        if (c->rbuf == NULL) {
+            c->rbuf = buf_get(r);
+            if (c->rbuf == NULL) {
+                return -1;
+            }
+        }
+        if (c->rlen == REACTOR_BUFF_SIZE) {
+            /* Backpressure: EPOLLOUT will resume reading */
+            return 0;
+        }
+        nread = recv(c->fd, c->rbuf + c->rlen, REACTOR_BUFF_SIZE - c->rlen, 0);
+        if (nread == 0) {
+            return -1;
+        }
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        c->rlen += nread;
+        if (conn_consume(r, c) < 0) {
+            return -1;
+        }
+    }
+    if (c->rlen == 0) {
+        buf_put(r, c->rbuf);
+        c->rbuf = NULL;
+    }
+
+    return 0;
+}
+
+static int conn_writable(struct reactor *r, struct conn *c)
+{
+    if (c->wlen > 0 && conn_flush(r, c) < 0) {
+        return -1;
+    }
+    if (c->rlen > 0) {
+        if (conn_consume(r, c) < 0) {
+            return -1;
+        }
+        return conn_read(r, c);
+    }
+
+    return 0;
+}
+
+static void accept_clients(struct reactor *r)
+{
+    struct epoll_event ev;
+    struct conn *c;
+    int newsock;
+    int naccepted = 0;
+
+    while (1) {
+        newsock = accept4(r->listensock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && r->sparefd >= 0) {
+                /*
+                 * Out of descriptors.  Release the spare so the pending
+                 * connection can be accepted and shut, otherwise it sits
+                 * in the queue and the listener never reports ready again.
+                 */
+                close(r->sparefd);
+                newsock = accept(r->listensock, NULL, NULL);
+                if (newsock >= 0) {
+                    close(newsock);
+                }
+                r->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("reactor");
+            }
+            if (naccepted == 0) {
+                /* Woken for a connection another reactor already took */
+                r->stats->spurious++;
+            }
+            return;
+        }
+        naccepted++;
+        r->stats->accepted++;
+
+        c = calloc(1, sizeof(struct conn));
+        if (c == NULL) {
+            close(newsock);
+            continue;
+        }
+        c->fd = newsock;
+
+        /*
+         * Register for both directions once.  Edge-triggered EPOLLOUT only
+         * fires after a send has filled the socket, so it costs nothing
+         * until a client falls behind and needs flushing.
+         */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, newsock, &ev) < 0) {
+            perror("reactor");
+            close(newsock);
+            free(c);
+        }
+    }
+}
+
+void reactor_raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int reactor_run(int listensock, int flags, struct reactor_stats *stats)
+{
+    struct reactor *r;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct epoll_event ev;
+    struct conn *c;
+    struct rusage before;
+    struct rusage after;
+    long sleeps;
+    int nready;
+    int x;
+
+    r = calloc(1, sizeof(struct reactor));
+    if (r == NULL) {
+        perror("reactor");
+        return -1;
+    }
+    r->listensock = listensock;
+    r->stats = (stats != NULL) ? stats : &r->own_stats;
+    r->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    fcntl(listensock, F_SETFL, fcntl(listensock, F_GETFL) | O_NONBLOCK);
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("reactor");
+        return -1;
+    }
+
+    /*
+     * The listener is the only entry without a connection attached.  When
+     * several reactors share it, EPOLLEXCLUSIVE wakes one of them per
+     * incoming connection instead of all of them.
+     */
+    ev.events = EPOLLIN | EPOLLET;
+    if (flags & REACTOR_EXCLUSIVE) {
+        ev.events |= EPOLLEXCLUSIVE;
+    }
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listensock, &ev) < 0) {
+        perror("reactor");
+        return -1;
+    }
+
+    while (1) {
+        /*
+         * epoll_wait() hides wakeups that find nothing ready by going back
+         * to sleep, so count them as voluntary context switches instead.
+         */
+        if (stats != NULL) {
+            getrusage(RUSAGE_THREAD, &before);
+        }
+        nready = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (stats != NULL) {
+            getrusage(RUSAGE_THREAD, &after);
+            sleeps = after.ru_nvcsw - before.ru_nvcsw;
+            stats->wakeups += sleeps;
+            if (sleeps > 1) {
+                stats->spurious += sleeps - 1;
+            }
+        }
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("reactor");
+            return -1;
+        }
+        for (x = 0; x < nready; x++) {
+            c = events[x].data.ptr;
+            if (c == NULL) {
+                accept_clients(r);
+                continue;
+            }
+            if (events[x].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(r, c);
+                continue;
+            }
+            if ((events[x].events & EPOLLOUT) && conn_writable(r, c) < 0) {
+                conn_close(r, c);
+                continue;
+            }
+            if ((events[x].events & EPOLLIN) && conn_read(r, c) < 0) {
+                conn_close(r, c);
+            }
+        }
+    }
+}
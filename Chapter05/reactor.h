@@ -0,0 +1,35 @@
+/* reactor.h */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* Size of each per-connection read and write buffer */
+#define REACTOR_BUFF_SIZE   16384
+/* Maximum number of events returned by one epoll_wait() */
+#define REACTOR_MAX_EVENTS  256
+
+/* reactor_run() flags */
+#define REACTOR_SHARED      0x01    /* listener shared with other reactors */
+#define REACTOR_EXCLUSIVE   0x02    /* ... and registered EPOLLEXCLUSIVE */
+
+/*
+ * Counters written only by the reactor that owns them.  wakeups counts
+ * the times the thread slept in epoll_wait() and was woken; a spurious
+ * one found nothing to do, either because epoll went straight back to
+ * sleep or because another reactor had already accepted the connection.
+ */
+struct reactor_stats {
+    volatile unsigned long wakeups;
+    volatile unsigned long accepted;
+    volatile unsigned long spurious;
+};
+
+/* Raise the soft descriptor limit to the hard limit */
+void reactor_raise_nofile(void);
+
+/*
+ * Serve the echo protocol on listensock until a fatal error occurs.
+ * stats may be NULL.
+ */
+int reactor_run(int listensock, int flags, struct reactor_stats *stats);
+
+#endif
@@ -3,6 +3,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <unistd.h>
+#include "reactor.h"
+#include "uring.h"
 
 int main(int argc, char *argv[])
 {
@@ -15,7 +18,28 @@ int main(int argc, char *argv[])
     int nread;
     int x;
     int val;
-    
+    int opt;
+    int use_epoll = 0;
+    int use_uring = 0;
+
+    while ((opt = getopt(argc, argv, "eu")) != -1) {
+        switch (opt) {
+        case 'e':
+            use_epoll = 1;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: server1 [-e | -u]\n");
+            return 0;
+        }
+    }
+
+    if (use_epoll || use_uring) {
+        reactor_raise_nofile();
+    }
+
     listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     val = 1;
@@ -35,12 +59,24 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    result = listen(listensock, 5);
+    result = listen(listensock, (use_epoll || use_uring) ? SOMAXCONN : 5);
     if (result < 0) {
         perror("server1");
         return 0;
     }
 
+    if (use_epoll) {
+        /* Edge-triggered reactor: each wakeup costs O(ready events) */
+        reactor_run(listensock, 0, NULL);
+        return 0;
+    }
+
+    if (use_uring) {
+        /* io_uring: multishot accept/recv, provided buffers, linked sends */
+        uring_run(listensock);
+        return 0;
+    }
+
     FD_ZERO(&readset);
     FD_SET(listensock, &readset);
 
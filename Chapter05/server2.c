@@ -1,10 +1,41 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/wait.h>
+#include <errno.h>
 #include <signal.h>
+#include "pipeline.h"
+#include "handoff.h"
+
+#define MAX_WORKERS 256
+
+/*
+ * A pre-spawned worker in handoff mode.  The master counts the sockets it
+ * has passed over chan and the worker reports back how many it has
+ * finished, so handed - completed is the worker's current load.
+ */
+struct worker {
+    pid_t pid;
+    int chan;
+    unsigned long handed;
+    unsigned long completed;
+};
+
+struct worker workers[MAX_WORKERS];
+int nworkers = 0;
+int listensock;
+int framing = FRAME_NONE;
+
+void serve_client(int sock);
+int spawn_worker(int x);
+void worker_main(int chan);
+int handoff_loop(void);
 
 void sigchld_handler(int signo)
 {
@@ -14,14 +45,34 @@ void sigchld_handler(int signo)
 int main(int argc, char *argv[])
 {
     struct sockaddr_in sAddr;
-    int listensock;
     int newsock;
-    char buffer[25];
     int result;
-    int nread;
     int pid;
     int val;
-    
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            framing = pipeline_framing(optarg);
+            if (framing < 0) {
+                fprintf(stderr, "server2: framing must be line or length\n");
+                return 0;
+            }
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "server2: workers must be 1 to %i\n", MAX_WORKERS);
+                return 0;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: server2 [-p line | -p length] [-w nworkers]\n");
+            return 0;
+        }
+    }
+
     listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     val = 1;
@@ -41,7 +92,7 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    result = listen(listensock, 5);
+    result = listen(listensock, (nworkers > 0) ? SOMAXCONN : 5);
     if (result < 0) {
         perror("exserver2");
         return 0;
@@ -49,19 +100,171 @@ int main(int argc, char *argv[])
 
     signal(SIGCHLD, sigchld_handler);
 
+    if (nworkers > 0) {
+        return handoff_loop();
+    }
+
     while (1) {
         newsock = accept(listensock, NULL ,NULL);
         if ((pid = fork()) == 0) {
             printf("child process %i created.\n", getpid());
             close(listensock);
-            nread = recv(newsock, buffer, 25, 0);
-            buffer[nread] = '\0';
-            printf("%s\n", buffer);
-            send(newsock, buffer, nread, 0);
-            close(newsock);
+            serve_client(newsock);
             printf("child process %i finished.\n", getpid());
             exit(0);
         }
         close(newsock);
     }
 }
+
+void serve_client(int sock)
+{
+    char buffer[25];
+    int nread;
+
+    if (framing != FRAME_NONE) {
+        printf("%li requests served.\n", pipeline_serve(sock, framing));
+        close(sock);
+        return;
+    }
+    nread = recv(sock, buffer, 25, 0);
+    if (nread > 0) {
+        buffer[nread] = '\0';
+        printf("%s\n", buffer);
+        send(sock, buffer, nread, 0);
+    }
+    close(sock);
+}
+
+/*
+ * Handoff mode: the master only accepts.  Each connection is passed with
+ * SCM_RIGHTS to the least loaded of the long-lived workers, so no fork()
+ * sits between accept() and the first byte served, and a crashing worker
+ * still takes only its own clients with it.
+ */
+int handoff_loop(void)
+{
+    struct pollfd fds[MAX_WORKERS + 1];
+    unsigned long report;
+    unsigned long load;
+    unsigned long best_load;
+    unsigned int next = 0;
+    int newsock;
+    int best;
+    int x;
+    int n;
+
+    for (x = 0; x < nworkers; x++) {
+        if (spawn_worker(x) < 0) {
+            return 0;
+        }
+    }
+
+    while (1) {
+        fds[0].fd = listensock;
+        fds[0].events = POLLIN;
+        for (x = 0; x < nworkers; x++) {
+            fds[x + 1].fd = workers[x].chan;
+            fds[x + 1].events = POLLIN;
+        }
+        if (poll(fds, nworkers + 1, -1) <= 0) {
+            continue;
+        }
+
+        /* Load reports first, so the choice below sees them */
+        for (x = 0; x < nworkers; x++) {
+            if (fds[x + 1].revents == 0) {
+                continue;
+            }
+            n = recv(workers[x].chan, &report, sizeof(report), MSG_DONTWAIT);
+            if (n == sizeof(report)) {
+                workers[x].completed = report;
+            } else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                printf("worker process %i died, respawning.\n", workers[x].pid);
+                close(workers[x].chan);
+                spawn_worker(x);
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        newsock = accept(listensock, NULL, NULL);
+        if (newsock < 0) {
+            continue;
+        }
+
+        /* Least loaded worker, ties broken round robin */
+        best = -1;
+        best_load = 0;
+        for (x = 0; x < nworkers; x++) {
+            n = (next + x) % nworkers;
+            if (workers[n].chan < 0) {
+                continue;
+            }
+            load = workers[n].handed - workers[n].completed;
+            if (best < 0 || load < best_load) {
+                best = n;
+                best_load = load;
+            }
+        }
+        next++;
+        if (best >= 0 && handoff_send_fd(workers[best].chan, newsock) == 0) {
+            workers[best].handed++;
+        }
+        close(newsock);
+    }
+}
+
+int spawn_worker(int x)
+{
+    int sv[2];
+    int y;
+
+    workers[x].chan = -1;
+    workers[x].handed = 0;
+    workers[x].completed = 0;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        perror("server2");
+        return -1;
+    }
+
+    fflush(stdout);
+    workers[x].pid = fork();
+    if (workers[x].pid < 0) {
+        perror("server2");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (workers[x].pid == 0) {
+        close(listensock);
+        close(sv[0]);
+        for (y = 0; y < nworkers; y++) {
+            if (y != x && workers[y].chan >= 0) {
+                close(workers[y].chan);
+            }
+        }
+        worker_main(sv[1]);
+        exit(0);
+    }
+
+    close(sv[1]);
+    workers[x].chan = sv[0];
+    return 0;
+}
+
+void worker_main(int chan)
+{
+    unsigned long completed = 0;
+    int sock;
+
+    signal(SIGCHLD, SIG_DFL);
+    printf("worker process %i started.\n", getpid());
+    while ((sock = handoff_recv_fd(chan)) >= 0) {
+        serve_client(sock);
+        completed++;
+        send(chan, &completed, sizeof(completed), MSG_NOSIGNAL);
+    }
+    printf("worker process %i finished.\n", getpid());
+}
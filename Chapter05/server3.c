@@ -1,25 +1,153 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include "pipeline.h"
+
+/*
+ * The pool is managed Apache style: every child owns a slot in a
+ * shared-memory scoreboard, marks itself busy while it serves a client,
+ * and the parent forks or retires children so the number of idle ones
+ * stays between the spare watermarks.
+ */
+#define SB_NAME         "/server3.scoreboard"
+#define SB_MAX_SLOTS    256
+#define MAX_SPAWN_RATE  32
+#define MAINT_USEC      200000
+
+#define SLOT_EMPTY      0
+#define SLOT_STARTING   1
+#define SLOT_IDLE       2
+#define SLOT_BUSY       3
+
+struct slot {
+    volatile pid_t pid;
+    volatile int status;
+    volatile unsigned long requests;
+    volatile unsigned long wakeups;     /* times the idle child was woken */
+    volatile unsigned long spurious;    /* ... without getting a connection */
+    time_t started;
+};
+
+struct scoreboard {
+    int nslots;
+    volatile unsigned long crashes;
+    struct slot slots[SB_MAX_SLOTS];
+};
+
+struct scoreboard *sb;
+int listensock;
+int deathpipe[2];
+int exclusive = 0;
+int framing = FRAME_NONE;
+volatile sig_atomic_t shutting_down = 0;
+
+void child_main(int slot);
+int spawn_child(int slot);
+void reap_children(void);
+void maintain_pool(int nchildren, int min_spare, int max_spare, int max_children);
+int show_scoreboard(void);
+
+void sigchld_handler(int signo)
+{
+    /* Only here to interrupt the maintenance sleep; reaping is done in main */
+}
+
+void sigterm_handler(int signo)
+{
+    shutting_down = 1;
+}
 
 int main(int argc, char *argv[])
 {
     struct sockaddr_in sAddr;
-    int listensock;
-    int newsock;
-    char buffer[25];
+    struct sigaction sa;
     int result;
-    int nread;
-    int pid;
     int nchildren = 1;
+    int min_spare = 0;
+    int max_spare = 0;
+    int max_children = 0;
+    int shmfd;
+    int opt;
     int x;
     int val;
 
-    if (argc > 1) {
-        nchildren = atoi(argv[1]);
+    while ((opt = getopt(argc, argv, "m:M:x:ep:w")) != -1) {
+        switch (opt) {
+        case 'e':
+            exclusive = 1;
+            break;
+        case 'm':
+            min_spare = atoi(optarg);
+            break;
+        case 'M':
+            max_spare = atoi(optarg);
+            break;
+        case 'x':
+            max_children = atoi(optarg);
+            break;
+        case 'p':
+            framing = pipeline_framing(optarg);
+            if (framing < 0) {
+                fprintf(stderr, "server3: framing must be line or length\n");
+                return 0;
+            }
+            break;
+        case 'w':
+            return show_scoreboard();
+        default:
+            fprintf(stderr, "usage: server3 [-e] [-p line | -p length] [-m minspare] [-M maxspare] [-x maxchildren] [nchildren]\n"
+                            "       server3 -w\n");
+            return 0;
+        }
+    }
+
+    if (optind < argc) {
+        nchildren = atoi(argv[optind]);
+    }
+    if (max_children < nchildren) {
+        max_children = nchildren;
+    }
+    if (max_children > SB_MAX_SLOTS) {
+        max_children = SB_MAX_SLOTS;
+    }
+    if (nchildren > max_children) {
+        nchildren = max_children;
+    }
+
+    /* The scoreboard lives in shared memory so "server3 -w" can read it */
+    shmfd = shm_open(SB_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (shmfd < 0 || ftruncate(shmfd, sizeof(struct scoreboard)) < 0) {
+        perror("server3");
+        return 0;
+    }
+    sb = mmap(NULL, sizeof(struct scoreboard), PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+    if (sb == MAP_FAILED) {
+        perror("server3");
+        return 0;
+    }
+    close(shmfd);
+    sb->nslots = max_children;
+
+    /* Idle children poll this pipe; one byte written retires one of them */
+    if (pipe(deathpipe) < 0) {
+        perror("server3");
+        return 0;
     }
+    fcntl(deathpipe[0], F_SETFL, O_NONBLOCK);
 
     listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
@@ -40,26 +168,311 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    result = listen(listensock, 5);
+    result = listen(listensock, SOMAXCONN);
     if (result < 0) {
         perror("exserver3");
         return 0;
     }
 
+    /* Children poll before accepting, so a lost race must not block */
+    fcntl(listensock, F_SETFL, O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = sigterm_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
     for (x = 0; x < nchildren; x++) {
-        if ((pid = fork()) == 0) {
-            while (1) {
-                newsock = accept(listensock, NULL ,NULL);
-                printf("client connected to child process %i.\n", getpid());
-                nread = recv(newsock, buffer, 25, 0);
+        spawn_child(x);
+    }
+
+    while (!shutting_down) {
+        usleep(MAINT_USEC);
+        if (shutting_down) {
+            break;
+        }
+        reap_children();
+        if (min_spare > 0 || max_spare > 0 || max_children > nchildren) {
+            maintain_pool(nchildren, min_spare, max_spare, max_children);
+        }
+    }
+
+    for (x = 0; x < sb->nslots; x++) {
+        if (sb->slots[x].pid > 0) {
+            kill(sb->slots[x].pid, SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0);
+    shm_unlink(SB_NAME);
+
+    return 0;
+}
+
+int spawn_child(int slot)
+{
+    int pid;
+
+    sb->slots[slot].status = SLOT_STARTING;
+    sb->slots[slot].requests = 0;
+    sb->slots[slot].wakeups = 0;
+    sb->slots[slot].spurious = 0;
+    sb->slots[slot].started = time(NULL);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        child_main(slot);
+        exit(0);
+    }
+    if (pid < 0) {
+        perror("server3");
+        sb->slots[slot].status = SLOT_EMPTY;
+        return -1;
+    }
+    sb->slots[slot].pid = pid;
+
+    return pid;
+}
+
+/* Clear the slots of children that exited, respawning any that crashed */
+void reap_children(void)
+{
+    int status;
+    int pid;
+    int x;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (x = 0; x < sb->nslots; x++) {
+            if (sb->slots[x].pid == pid) {
+                break;
+            }
+        }
+        if (x == sb->nslots) {
+            continue;
+        }
+        sb->slots[x].pid = 0;
+        sb->slots[x].status = SLOT_EMPTY;
+        if (shutting_down) {
+            continue;
+        }
+        if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0)) {
+            sb->crashes++;
+            printf("child process %i in slot %i died, respawning.\n", pid, x);
+            spawn_child(x);
+        }
+    }
+}
+
+/*
+ * Called every MAINT_USEC.  Too few idle children: fork more, doubling
+ * the batch each round of shortage like Apache does.  Too many: retire
+ * one idle child per round through the pipe of death.
+ */
+void maintain_pool(int nchildren, int min_spare, int max_spare, int max_children)
+{
+    static int spawn_rate = 1;
+    int idle = 0;
+    int total = 0;
+    int free_slot = -1;
+    int nspawn;
+    int x;
+
+    for (x = 0; x < sb->nslots; x++) {
+        switch (sb->slots[x].status) {
+        case SLOT_EMPTY:
+            if (free_slot < 0) {
+                free_slot = x;
+            }
+            break;
+        case SLOT_STARTING:
+        case SLOT_IDLE:
+            idle++;
+            total++;
+            break;
+        default:
+            total++;
+        }
+    }
+
+    if (max_spare > 0 && idle > max_spare && total > nchildren) {
+        write(deathpipe[1], "!", 1);
+        spawn_rate = 1;
+    } else if ((idle < min_spare || total < nchildren) && total < max_children) {
+        nspawn = spawn_rate;
+        for (x = free_slot; x >= 0 && x < sb->nslots && nspawn > 0 && total < max_children; x++) {
+            if (sb->slots[x].status == SLOT_EMPTY) {
+                spawn_child(x);
+                nspawn--;
+                total++;
+            }
+        }
+        if (spawn_rate < MAX_SPAWN_RATE) {
+            spawn_rate *= 2;
+        }
+    } else {
+        spawn_rate = 1;
+    }
+}
+
+void child_main(int slot)
+{
+    struct pollfd fds[2];
+    struct epoll_event ev;
+    struct epoll_event events[2];
+    struct rusage before;
+    struct rusage after;
+    long sleeps;
+    long served;
+    char buffer[25];
+    char c;
+    int epfd = -1;
+    int listen_ready;
+    int death_ready;
+    int newsock;
+    int nread;
+    int n;
+    int x;
+
+    fds[0].fd = listensock;
+    fds[0].events = POLLIN;
+    fds[1].fd = deathpipe[0];
+    fds[1].events = POLLIN;
+
+    if (exclusive) {
+        /*
+         * poll() wakes every idle child for each connection.  A private
+         * epoll set with both descriptors registered EPOLLEXCLUSIVE wakes
+         * just one of them per connection or per byte of the death pipe.
+         */
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = listensock;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listensock, &ev);
+        ev.data.fd = deathpipe[0];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, deathpipe[0], &ev);
+    }
+
+    while (1) {
+        sb->slots[slot].status = SLOT_IDLE;
+        listen_ready = 0;
+        death_ready = 0;
+        /*
+         * poll() and epoll_wait() go back to sleep by themselves when they
+         * are woken and find nothing ready, so a herd never shows up as a
+         * failed accept.  Count wakeups as voluntary context switches.
+         */
+        getrusage(RUSAGE_SELF, &before);
+        if (exclusive) {
+            n = epoll_wait(epfd, events, 2, -1);
+            for (x = 0; x < n; x++) {
+                if (events[x].data.fd == listensock) {
+                    listen_ready = 1;
+                } else {
+                    death_ready = 1;
+                }
+            }
+        } else if (poll(fds, 2, -1) > 0) {
+            listen_ready = fds[0].revents & POLLIN;
+            death_ready = fds[1].revents & POLLIN;
+        }
+        getrusage(RUSAGE_SELF, &after);
+        sleeps = after.ru_nvcsw - before.ru_nvcsw;
+        sb->slots[slot].wakeups += sleeps;
+        if (sleeps > 1) {
+            sb->slots[slot].spurious += sleeps - 1;
+        }
+        if (death_ready && read(deathpipe[0], &c, 1) == 1) {
+            return;
+        }
+        if (!listen_ready) {
+            continue;
+        }
+        newsock = accept(listensock, NULL ,NULL);
+        if (newsock < 0) {
+            /* Another child won the race for this connection */
+            sb->slots[slot].spurious++;
+            continue;
+        }
+        sb->slots[slot].status = SLOT_BUSY;
+        printf("client connected to child process %i.\n", getpid());
+        if (framing != FRAME_NONE) {
+            served = pipeline_serve(newsock, framing);
+            if (served > 0) {
+                sb->slots[slot].requests += served;
+            }
+        } else {
+            nread = recv(newsock, buffer, 25, 0);
+            if (nread > 0) {
                 buffer[nread] = '\0';
                 printf("%s\n", buffer);
                 send(newsock, buffer, nread, 0);
-                close(newsock);
-                printf("client disconnected from child process %i.\n", getpid());
             }
+            sb->slots[slot].requests++;
         }
+        close(newsock);
+        printf("client disconnected from child process %i.\n", getpid());
+    }
+}
+
+/* Print the scoreboard of a running server3, one character per slot */
+int show_scoreboard(void)
+{
+    struct scoreboard *board;
+    unsigned long requests = 0;
+    unsigned long wakeups = 0;
+    unsigned long spurious = 0;
+    int idle = 0;
+    int busy = 0;
+    int shmfd;
+    int x;
+
+    shmfd = shm_open(SB_NAME, O_RDONLY, 0);
+    if (shmfd < 0) {
+        perror("server3");
+        return 1;
+    }
+    board = mmap(NULL, sizeof(struct scoreboard), PROT_READ, MAP_SHARED, shmfd, 0);
+    if (board == MAP_FAILED) {
+        perror("server3");
+        return 1;
+    }
+
+    for (x = 0; x < board->nslots; x++) {
+        switch (board->slots[x].status) {
+        case SLOT_EMPTY:
+            putchar('.');
+            break;
+        case SLOT_STARTING:
+            putchar('S');
+            idle++;
+            break;
+        case SLOT_IDLE:
+            putchar('_');
+            idle++;
+            break;
+        default:
+            putchar('W');
+            busy++;
+        }
+        requests += board->slots[x].requests;
+        wakeups += board->slots[x].wakeups;
+        spurious += board->slots[x].spurious;
+        if (x % 64 == 63) {
+            putchar('\n');
+        }
+    }
+    if (board->nslots % 64 != 0) {
+        putchar('\n');
     }
+    printf("children %i idle %i busy %i requests %lu crashes %lu\n",
+           idle + busy, idle, busy, requests, board->crashes);
+    printf("wakeups %lu spurious %lu (%.2f per accept)\n",
+           wakeups, spurious, requests > 0 ? (double) spurious / requests : 0.0);
+    printf("'_' idle, 'W' busy, 'S' starting, '.' empty slot\n");
 
-    wait(NULL);
+    return 0;
 }
@@ -1,11 +1,26 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include "pipeline.h"
+#include "workpool.h"
+
+/* Seconds between worker counter reports in pool mode */
+#define STATS_INTERVAL  5
 
 void* thread_proc(void *arg);
+void pool_task(void *arg);
+void serve_client(int sock);
+void* report_proc(void *arg);
+
+int framing = FRAME_NONE;
+int nworkers = 0;
 
 int main(int argc, char *argv[])
 {
@@ -15,7 +30,31 @@ int main(int argc, char *argv[])
     int result;
     pthread_t thread_id;
     int val;
-    
+    int opt;
+    struct workpool *pool = NULL;
+
+    while ((opt = getopt(argc, argv, "p:w:")) != -1) {
+        switch (opt) {
+        case 'p':
+            framing = pipeline_framing(optarg);
+            if (framing < 0) {
+                fprintf(stderr, "server4: framing must be line or length\n");
+                return 0;
+            }
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                fprintf(stderr, "server4: need at least one worker\n");
+                return 0;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: server4 [-p line | -p length] [-w nworkers]\n");
+            return 0;
+        }
+    }
+
     listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     val = 1;
@@ -35,12 +74,36 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    result = listen(listensock, 5);
+    result = listen(listensock, (nworkers > 0) ? SOMAXCONN : 5);
     if (result < 0) {
         perror("exserver4");
         return 0;
     }
 
+    if (nworkers > 0) {
+        /*
+         * A fixed pool replaces the thread per connection: accepted
+         * sockets are queued round robin on the workers' deques, and a
+         * worker with nothing of its own steals from the others.
+         */
+        pool = workpool_create(nworkers);
+        if (pool == NULL) {
+            printf("Could not create worker pool.\n");
+            return 0;
+        }
+        result = pthread_create(&thread_id, NULL, report_proc, pool);
+        if (result != 0) {
+            printf("Could not create thread.\n");
+            return 0;
+        }
+        while (1) {
+            newsock = accept(listensock, NULL, NULL);
+            if (newsock >= 0) {
+                workpool_submit(pool, pool_task, (void *) (intptr_t) newsock);
+            }
+        }
+    }
+
     while (1) {
         newsock = accept(listensock, NULL ,NULL);
 	result = pthread_create(&thread_id, NULL, thread_proc, (void *) newsock);
@@ -56,15 +119,69 @@ int main(int argc, char *argv[])
 void* thread_proc(void *arg)
 {
   int sock;
-  char buffer[25];
-  int nread;
 
   printf("child thread %i with pid %i created.\n", pthread_self(), getpid());
   sock = (int) arg;
+  serve_client(sock);
+  printf("child thread %i with pid %i finished.\n", pthread_self(), getpid());
+  return arg;
+}
+
+void pool_task(void *arg)
+{
+  serve_client((int) (intptr_t) arg);
+}
+
+void serve_client(int sock)
+{
+  char buffer[25];
+  int nread;
+
+  if (framing != FRAME_NONE) {
+    printf("%li requests served.\n", pipeline_serve(sock, framing));
+    close(sock);
+    return;
+  }
   nread = recv(sock, buffer, 25, 0);
-  buffer[nread] = '\0';
-  printf("%s\n", buffer);
-  send(sock, buffer, nread, 0);
+  if (nread > 0) {
+    buffer[nread] = '\0';
+    printf("%s\n", buffer);
+    send(sock, buffer, nread, 0);
+  }
   close(sock);
-  printf("child thread %i with pid %i finished.\n", pthread_self(), getpid());
+}
+
+/* Print each worker's counters whenever the pool has done more work */
+void* report_proc(void *arg)
+{
+  struct workpool *pool;
+  struct workpool_stats *stats;
+  unsigned long executed;
+  unsigned long stolen;
+  unsigned long last = 0;
+  int x;
+
+  pool = (struct workpool *) arg;
+  stats = calloc(nworkers, sizeof(struct workpool_stats));
+
+  while (1) {
+    sleep(STATS_INTERVAL);
+    workpool_stats(pool, stats);
+    executed = 0;
+    stolen = 0;
+    for (x = 0; x < nworkers; x++) {
+      executed += stats[x].executed;
+      stolen += stats[x].stolen;
+    }
+    if (executed == last) {
+      continue;
+    }
+    last = executed;
+    for (x = 0; x < nworkers; x++) {
+      printf("worker %i: executed %lu stolen %lu depth %i max %i\n",
+             x, stats[x].executed, stats[x].stolen, stats[x].depth, stats[x].max_depth);
+    }
+    printf("executed %lu stolen %lu (%.1f%%)\n", executed, stolen, 100.0 * stolen / executed);
+    fflush(stdout);
+  }
 }
@@ -1,33 +1,175 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "reactor.h"
+#include "pipeline.h"
+
+#define MAX_CPUS    1024
+
+/* Seconds between accept counter reports in the shared-listener modes */
+#define STATS_INTERVAL  5
+
+struct reactor_arg {
+    int listensock;
+    int cpu;
+    int flags;
+    struct reactor_stats stats;
+};
 
 void* thread_proc(void *arg);
+void* reactor_proc(void *arg);
+int open_listener(int reuseport, int backlog);
+void report_stats(struct reactor_arg *rargs, int nchildren);
+int parse_cpus(char *list, int *cpus);
+
+int framing = FRAME_NONE;
 
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in sAddr;
     int listensock;
     int result;
     int nchildren = 1;
     pthread_t thread_id;
+    pthread_t *reactors;
+    struct reactor_arg *rargs;
+    int cpus[MAX_CPUS];
+    int ncpus = 0;
+    int reuseport = 0;
+    int shared = 0;
+    int flags = 0;
+    int opt;
     int x;
-    int val;
-    
-    if (argc > 1) {
-      nchildren = atoi(argv[1]);
+
+    while ((opt = getopt(argc, argv, "rsec:p:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reuseport = 1;
+            break;
+        case 's':
+            shared = 1;
+            flags |= REACTOR_SHARED;
+            break;
+        case 'e':
+            shared = 1;
+            flags |= REACTOR_SHARED | REACTOR_EXCLUSIVE;
+            break;
+        case 'c':
+            ncpus = parse_cpus(optarg, cpus);
+            if (ncpus < 0) {
+                fprintf(stderr, "server5: bad cpu list %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'p':
+            framing = pipeline_framing(optarg);
+            if (framing < 0) {
+                fprintf(stderr, "server5: framing must be line or length\n");
+                return 0;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: server5 [-r | -s | -e] [-c cpu,cpu,...] [-p line | -p length] [nthreads]\n");
+            return 0;
+        }
+    }
+
+    if (optind < argc) {
+      nchildren = atoi(argv[optind]);
+    }
+
+    if (reuseport || shared) {
+        /*
+         * With -r every thread gets its own SO_REUSEPORT listener and epoll
+         * loop, so the kernel spreads incoming connections across the
+         * threads with no shared accept queue or lock between them.
+         *
+         * With -s the threads' epoll loops all watch one listener and every
+         * connection wakes all of them; -e registers the listener with
+         * EPOLLEXCLUSIVE so only one is woken.  The accept counters show
+         * the difference as spurious wakeups per accepted connection.
+         */
+        reactor_raise_nofile();
+        if (shared) {
+            listensock = open_listener(0, SOMAXCONN);
+            if (listensock < 0) {
+                return 0;
+            }
+        }
+        reactors = calloc(nchildren, sizeof(pthread_t));
+        rargs = calloc(nchildren, sizeof(struct reactor_arg));
+        if (reactors == NULL || rargs == NULL) {
+            perror("server5");
+            return 0;
+        }
+        for (x = 0; x < nchildren; x++) {
+            rargs[x].listensock = shared ? listensock : open_listener(1, SOMAXCONN);
+            if (rargs[x].listensock < 0) {
+                return 0;
+            }
+            rargs[x].flags = flags;
+            rargs[x].cpu = (ncpus > 0) ? cpus[x % ncpus] : -1;
+            result = pthread_create(&reactors[x], NULL, reactor_proc, &rargs[x]);
+            if (result != 0) {
+              printf("Could not create thread.\n");
+              return 0;
+            }
+        }
+        if (shared) {
+            report_stats(rargs, nchildren);
+        }
+        for (x = 0; x < nchildren; x++) {
+            pthread_join(reactors[x], NULL);
+        }
+        return 0;
+    }
+
+    listensock = open_listener(0, 5);
+    if (listensock < 0) {
+        return 0;
+    }
+
+   for (x = 0; x < nchildren; x++) {
+	result = pthread_create(&thread_id, NULL, thread_proc, (void *) listensock);
+	if (result != 0) {
+	  printf("Could not create thread.\n");
+	  return 0;
+	}
+	sched_yield();
     }
 
+   pthread_join (thread_id, NULL);
+}
+
+int open_listener(int reuseport, int backlog)
+{
+    struct sockaddr_in sAddr;
+    int listensock;
+    int result;
+    int val;
+
     listensock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     val = 1;
     result = setsockopt(listensock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
     if (result < 0) {
         perror("server5");
-        return 0;
+        return -1;
+    }
+
+    if (reuseport) {
+        result = setsockopt(listensock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+        if (result < 0) {
+            perror("server5");
+            return -1;
+        }
     }
 
     sAddr.sin_family = AF_INET;
@@ -37,25 +179,64 @@ int main(int argc, char *argv[])
     result = bind(listensock, (struct sockaddr *) &sAddr, sizeof(sAddr));
     if (result < 0) {
         perror("exserver5");
-        return 0;
+        return -1;
     }
 
-    result = listen(listensock, 5);
+    result = listen(listensock, backlog);
     if (result < 0) {
         perror("exserver5");
-        return 0;
+        return -1;
     }
 
-   for (x = 0; x < nchildren; x++) {
-	result = pthread_create(&thread_id, NULL, thread_proc, (void *) listensock);
-	if (result != 0) {
-	  printf("Could not create thread.\n");
-	  return 0;
-	}
-	sched_yield();
+    return listensock;
+}
+
+/* Print the summed accept counters whenever they change */
+void report_stats(struct reactor_arg *rargs, int nchildren)
+{
+    unsigned long accepted;
+    unsigned long wakeups;
+    unsigned long spurious;
+    unsigned long last = 0;
+    int x;
+
+    while (1) {
+        sleep(STATS_INTERVAL);
+        accepted = wakeups = spurious = 0;
+        for (x = 0; x < nchildren; x++) {
+            accepted += rargs[x].stats.accepted;
+            wakeups += rargs[x].stats.wakeups;
+            spurious += rargs[x].stats.spurious;
+        }
+        if (accepted == last) {
+            continue;
+        }
+        last = accepted;
+        printf("accepted %lu wakeups %lu spurious %lu (%.2f per accept)\n",
+               accepted, wakeups, spurious, (double) spurious / accepted);
+        fflush(stdout);
     }
+}
 
-   pthread_join (thread_id, NULL);
+/* Parse a comma separated list of CPU numbers, returning how many */
+int parse_cpus(char *list, int *cpus)
+{
+    char *tok;
+    char *end;
+    int ncpus = 0;
+
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (ncpus == MAX_CPUS) {
+            return -1;
+        }
+        cpus[ncpus] = strtol(tok, &end, 10);
+        if (*end != '\0' || cpus[ncpus] < 0 || cpus[ncpus] >= CPU_SETSIZE) {
+            return -1;
+        }
+        ncpus++;
+    }
+
+    return (ncpus > 0) ? ncpus : -1;
 }
 
 void* thread_proc(void *arg)
@@ -69,6 +250,12 @@ void* thread_proc(void *arg)
   while (1) {
     sock = accept(listensock, NULL, NULL);
     printf("client connected to child thread %i with pid %i.\n", pthread_self(), getpid());
+    if (framing != FRAME_NONE) {
+      printf("%li requests served.\n", pipeline_serve(sock, framing));
+      close(sock);
+      printf("client disconnected from child thread %lu with pid %i.\n", (unsigned long) pthread_self(), getpid());
+      continue;
+    }
     nread = recv(sock, buffer, 25, 0);
     buffer[nread] = '\0';
     printf("%s\n", buffer);
@@ -77,3 +264,24 @@ void* thread_proc(void *arg)
     printf("client disconnected from child thread %i with pid %i.\n", pthread_self(), getpid());
   }
 }
+
+void* reactor_proc(void *arg)
+{
+  struct reactor_arg *rarg;
+  cpu_set_t cpuset;
+
+  rarg = (struct reactor_arg *) arg;
+
+  if (rarg->cpu >= 0) {
+    CPU_ZERO(&cpuset);
+    CPU_SET(rarg->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+      printf("Could not pin thread to cpu %i.\n", rarg->cpu);
+    }
+  }
+
+  reactor_run(rarg->listensock, rarg->flags,
+              (rarg->flags & REACTOR_SHARED) ? &rarg->stats : NULL);
+
+  return arg;
+}
@@ -0,0 +1,604 @@
+/* uring.c */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/* user_data carries the operation, the buffer id and the descriptor */
+#define OP_ACCEPT   1
+#define OP_RECV     2
+#define OP_SEND     3
+#define OP_CANCEL   4
+
+#define UD(op, fd, bid) (((__u64) (op) << 56) | ((__u64) (bid) << 32) | (__u32) (fd))
+#define UD_OP(ud)       ((int) ((ud) >> 56))
+#define UD_BID(ud)      ((int) (((ud) >> 32) & 0xffff))
+#define UD_FD(ud)       ((int) ((ud) & 0xffffffff))
+
+/*
+ * Per-descriptor state.  Received buffers are echoed in arrival order:
+ * they wait on a FIFO threaded through bufnext[] and the first inflight
+ * of them are currently submitted as one chain of linked sends.
+ */
+struct uconn {
+    int open;
+    int recv_armed;     /* multishot recv still outstanding */
+    int eof;            /* peer closed, drain the queue then close */
+    int broken;         /* send failed, drop the queue and close */
+    int throttled;      /* recv cancelled until the queue drains */
+    int inflight;
+    int queued;
+    int head;
+    int tail;
+    int dirty;
+    int next_dirty;
+    int starved;
+    int next_starved;
+    int deferred;       /* recv waiting for room in the SQ */
+    int next_deferred;
+};
+
+struct uring {
+    int fd;
+    int listensock;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    int br_dirty;
+    char *bufs;
+    int bufnext[URING_NBUFS];
+    int bufoff[URING_NBUFS];
+    int buflen[URING_NBUFS];
+
+    struct uconn *conns;
+    int nconns;
+    int dirty_head;
+    int starved_head;
+    int deferred_head;
+    int accept_deferred;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Hand everything queued so far to the kernel, optionally waiting for a completion */
+static int ring_submit(struct uring *r, unsigned wait)
+{
+    unsigned to_submit;
+    int result;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+    result = sys_io_uring_enter(r->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static unsigned ring_space(struct uring *r)
+{
+    return r->sq_entries - (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Whether n SQEs are free, handing what is queued to the kernel first if
+ * not.  The kernel may not take it (EBUSY until completions are reaped),
+ * so the caller must be ready to leave its work for a later round.
+ */
+static int ring_reserve(struct uring *r, unsigned n)
+{
+    if (ring_space(r) < n) {
+        ring_submit(r, 0);
+    }
+    return ring_space(r) >= n;
+}
+
+/* The next free SQE, or NULL if the SQ is still full */
+static struct io_uring_sqe *ring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!ring_reserve(r, 1)) {
+        return NULL;
+    }
+    sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+
+    return sqe;
+}
+
+/* Give a buffer back to the kernel; published once per loop iteration */
+static void buf_recycle(struct uring *r, int bid)
+{
+    struct io_uring_buf *b;
+
+    /* Fields are set one at a time: bufs[0].resv overlays the ring tail */
+    b = &r->br->bufs[r->br_tail & (URING_NBUFS - 1)];
+    b->addr = (unsigned long) (r->bufs + (size_t) bid * URING_BUFF_SIZE);
+    b->len = URING_BUFF_SIZE;
+    b->bid = bid;
+    r->br_tail++;
+    r->br_dirty = 1;
+}
+
+static void arm_accept(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(r);
+    if (sqe == NULL) {
+        r->accept_deferred = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listensock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD(OP_ACCEPT, 0, 0);
+}
+
+static void arm_recv(struct uring *r, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(r);
+    if (sqe == NULL) {
+        r->conns[fd].deferred = 1;
+        r->conns[fd].next_deferred = r->deferred_head;
+        r->deferred_head = fd;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD(OP_RECV, fd, 0);
+    r->conns[fd].recv_armed = 1;
+}
+
+static void throttle_recv(struct uring *r, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Without room it is tried again on the next recv completion */
+    sqe = ring_get_sqe(r);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD(OP_RECV, fd, 0);
+    sqe->user_data = UD(OP_CANCEL, fd, 0);
+    r->conns[fd].throttled = 1;
+}
+
+static void mark_dirty(struct uring *r, int fd)
+{
+    struct uconn *c = &r->conns[fd];
+
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = r->dirty_head;
+        r->dirty_head = fd;
+    }
+}
+
+/*
+ * Submit the queued buffers of one connection as a chain of linked sends,
+ * so they go out in order without waiting for each other's completions.
+ * A chain must go in whole, so without room for it the connection stays
+ * dirty until the next round.
+ */
+static void send_chain(struct uring *r, int fd)
+{
+    struct uconn *c = &r->conns[fd];
+    struct io_uring_sqe *sqe;
+    int bid;
+
+    if (!ring_reserve(r, (c->queued < URING_MAX_CHAIN) ? c->queued : URING_MAX_CHAIN)) {
+        mark_dirty(r, fd);
+        return;
+    }
+    for (bid = c->head; bid >= 0 && c->inflight < URING_MAX_CHAIN; bid = r->bufnext[bid]) {
+        sqe = ring_get_sqe(r);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long) (r->bufs + (size_t) bid * URING_BUFF_SIZE + r->bufoff[bid]);
+        sqe->len = r->buflen[bid] - r->bufoff[bid];
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = UD(OP_SEND, fd, bid);
+        c->inflight++;
+    }
+    /* The last send ends the chain */
+    sqe->flags = 0;
+}
+
+/* Clear a slot but keep its place on the dirty list, which may still name it */
+static void conn_reset(struct uconn *c)
+{
+    int dirty = c->dirty;
+    int next_dirty = c->next_dirty;
+
+    memset(c, 0, sizeof(*c));
+    c->dirty = dirty;
+    c->next_dirty = next_dirty;
+    c->head = -1;
+    c->tail = -1;
+}
+
+static void conn_maybe_close(struct uring *r, int fd)
+{
+    struct uconn *c = &r->conns[fd];
+    int bid;
+
+    if (!c->open || c->recv_armed || c->starved || c->deferred || c->inflight > 0) {
+        return;
+    }
+    if (!c->broken && !(c->eof && c->head < 0)) {
+        return;
+    }
+    for (bid = c->head; bid >= 0; bid = r->bufnext[bid]) {
+        buf_recycle(r, bid);
+    }
+    /* Nothing is outstanding on fd, so no stale completion can name it */
+    close(fd);
+    conn_reset(c);
+}
+
+static void handle_accept(struct uring *r, struct io_uring_cqe *cqe)
+{
+    struct uconn *c;
+
+    if (cqe->res >= 0) {
+        if (cqe->res >= r->nconns) {
+            close(cqe->res);
+        } else {
+            c = &r->conns[cqe->res];
+            conn_reset(c);
+            c->open = 1;
+            arm_recv(r, cqe->res);
+        }
+    } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+        fprintf(stderr, "uring: accept: %s\n", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(r);
+    }
+}
+
+static void handle_recv(struct uring *r, struct io_uring_cqe *cqe)
+{
+    int fd = UD_FD(cqe->user_data);
+    struct uconn *c = &r->conns[fd];
+    int bid;
+
+    if (cqe->res > 0) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        r->buflen[bid] = cqe->res;
+        r->bufoff[bid] = 0;
+        r->bufnext[bid] = -1;
+        if (c->tail >= 0) {
+            r->bufnext[c->tail] = bid;
+        } else {
+            c->head = bid;
+        }
+        c->tail = bid;
+        c->queued++;
+        mark_dirty(r, fd);
+        if (c->queued >= URING_CONN_BUFS && !c->throttled && (cqe->flags & IORING_CQE_F_MORE)) {
+            /* A peer that sends without reading must not drain the shared pool */
+            throttle_recv(r, fd);
+        }
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+
+    c->recv_armed = 0;
+    if (cqe->res == -ECANCELED && c->throttled && !c->broken) {
+        if (c->queued <= URING_CONN_BUFS / 2) {
+            c->throttled = 0;
+            arm_recv(r, fd);
+        }
+    } else if (cqe->res == -ENOBUFS) {
+        /* Every buffer is queued somewhere; re-arm once some come back */
+        c->starved = 1;
+        c->next_starved = r->starved_head;
+        r->starved_head = fd;
+    } else if (cqe->res > 0) {
+        arm_recv(r, fd);
+    } else {
+        c->eof = 1;
+        conn_maybe_close(r, fd);
+    }
+}
+
+static void handle_send(struct uring *r, struct io_uring_cqe *cqe)
+{
+    int fd = UD_FD(cqe->user_data);
+    int bid = UD_BID(cqe->user_data);
+    struct uconn *c = &r->conns[fd];
+
+    c->inflight--;
+    if (cqe->res == r->buflen[bid] - r->bufoff[bid]) {
+        /* Linked sends complete in order, so this is the queue head */
+        c->head = r->bufnext[bid];
+        if (c->head < 0) {
+            c->tail = -1;
+        }
+        c->queued--;
+        buf_recycle(r, bid);
+        if (c->throttled && !c->recv_armed && !c->broken && c->queued <= URING_CONN_BUFS / 2) {
+            c->throttled = 0;
+            arm_recv(r, fd);
+        }
+    } else if (cqe->res >= 0) {
+        /* Short send: the rest of the chain is cancelled and resubmitted */
+        r->bufoff[bid] += cqe->res;
+    } else if (cqe->res != -ECANCELED) {
+        c->broken = 1;
+        if (c->recv_armed) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    if (c->inflight == 0) {
+        if (c->broken || c->head < 0) {
+            conn_maybe_close(r, fd);
+        } else {
+            mark_dirty(r, fd);
+        }
+    }
+}
+
+static int ring_init(struct uring *r, int listensock)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct rlimit rl;
+    size_t sq_size;
+    size_t cq_size;
+    char *sq_ptr;
+    char *cq_ptr;
+    unsigned *sq_array;
+    unsigned x;
+
+    r->listensock = listensock;
+    r->dirty_head = -1;
+    r->starved_head = -1;
+    r->deferred_head = -1;
+
+    /* Single issuer with deferred task work keeps completions off the network path */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        perror("uring: io_uring_setup");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "uring: kernel too old\n");
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("uring: mmap");
+        return -1;
+    }
+    cq_ptr = sq_ptr;
+
+    r->sq_head = (unsigned *) (sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+    r->sq_mask = *(unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    for (x = 0; x < p.sq_entries; x++) {
+        sq_array[x] = x;
+    }
+
+    r->cq_head = (unsigned *) (cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+    r->cq_mask = *(unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        perror("uring: mmap");
+        return -1;
+    }
+
+    /* Provided buffer ring shared with the kernel for multishot recv */
+    r->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = malloc((size_t) URING_NBUFS * URING_BUFF_SIZE);
+    if (r->br == MAP_FAILED || r->bufs == NULL) {
+        perror("uring");
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) r->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("uring: register buffer ring");
+        return -1;
+    }
+    for (x = 0; x < URING_NBUFS; x++) {
+        buf_recycle(r, x);
+    }
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    r->br_dirty = 0;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("uring");
+        return -1;
+    }
+    r->nconns = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 24)) ? (1 << 24) : rl.rlim_cur;
+    r->conns = calloc(r->nconns, sizeof(struct uconn));
+    if (r->conns == NULL) {
+        perror("uring");
+        return -1;
+    }
+
+    return 0;
+}
+
+int uring_run(int listensock)
+{
+    struct uring *r;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned tail;
+    unsigned wait;
+    int fd;
+    int next;
+
+    r = calloc(1, sizeof(struct uring));
+    if (r == NULL) {
+        perror("uring");
+        return -1;
+    }
+    if (ring_init(r, listensock) < 0) {
+        return -1;
+    }
+
+    arm_accept(r);
+
+    /*
+     * One io_uring_enter() per iteration both submits everything queued
+     * and waits; steady-state echo needs no other system calls.
+     */
+    while (1) {
+        if (r->br_dirty) {
+            __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+            r->br_dirty = 0;
+            while (r->starved_head >= 0) {
+                fd = r->starved_head;
+                r->starved_head = r->conns[fd].next_starved;
+                r->conns[fd].starved = 0;
+                if (r->conns[fd].broken) {
+                    conn_maybe_close(r, fd);
+                } else {
+                    arm_recv(r, fd);
+                }
+            }
+        }
+
+        /* What the SQ had no room for last round, before anything new */
+        if (r->accept_deferred) {
+            r->accept_deferred = 0;
+            arm_accept(r);
+        }
+        fd = r->deferred_head;
+        r->deferred_head = -1;
+        while (fd >= 0) {
+            next = r->conns[fd].next_deferred;
+            r->conns[fd].deferred = 0;
+            if (r->conns[fd].broken) {
+                conn_maybe_close(r, fd);
+            } else {
+                arm_recv(r, fd);
+            }
+            fd = next;
+        }
+
+        /* With work still waiting for room, reap rather than sleep: the kernel may want the CQ drained */
+        wait = (r->accept_deferred || r->deferred_head >= 0 || r->dirty_head >= 0) ? 0 : 1;
+        if (ring_submit(r, wait) < 0) {
+            perror("uring: io_uring_enter");
+            return -1;
+        }
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &r->cqes[head & r->cq_mask];
+            switch (UD_OP(cqe->user_data)) {
+            case OP_ACCEPT:
+                handle_accept(r, cqe);
+                break;
+            case OP_RECV:
+                handle_recv(r, cqe);
+                break;
+            case OP_SEND:
+                handle_send(r, cqe);
+                break;
+            case OP_CANCEL:
+                /* The cancelled recv reports itself */
+                break;
+            }
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        /* Everything received this round goes out as one chain per connection */
+        next = r->dirty_head;
+        r->dirty_head = -1;
+        while (next >= 0) {
+            fd = next;
+            next = r->conns[fd].next_dirty;
+            r->conns[fd].dirty = 0;
+            if (r->conns[fd].open && r->conns[fd].inflight == 0 && r->conns[fd].head >= 0
+                && !r->conns[fd].broken) {
+                send_chain(r, fd);
+            }
+        }
+    }
+}
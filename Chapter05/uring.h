@@ -0,0 +1,19 @@
+/* uring.h */
+#ifndef URING_H
+#define URING_H
+
+/* Submission queue size; the completion queue is four times larger */
+#define URING_ENTRIES       4096
+/* Provided buffers: count must be a power of two no larger than 32768 */
+#define URING_NBUFS         4096
+#define URING_BUFF_SIZE     4096
+#define URING_BGID          1
+/* Buffers one connection may hold before its recv is paused */
+#define URING_CONN_BUFS     64
+/* Longest chain of linked sends submitted for one connection */
+#define URING_MAX_CHAIN     32
+
+/* Serve the echo protocol on listensock with io_uring until a fatal error */
+int uring_run(int listensock);
+
+#endif
@@ -0,0 +1,186 @@
+/* workpool.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "workpool.h"
+
+struct task {
+    workpool_fn fn;
+    void *arg;
+};
+
+/*
+ * A worker's bounded deque.  The owner takes tasks from the head, in the
+ * order they were queued, and thieves take them from the tail, so the two
+ * only meet on a deque that is nearly empty.
+ */
+struct worker {
+    pthread_t tid;
+    struct workpool *pool;
+    int id;
+    pthread_mutex_t lock;
+    struct task tasks[WORKPOOL_DEQUE_SIZE];
+    int head;
+    int count;
+    int max_depth;
+    volatile unsigned long executed;
+    volatile unsigned long stolen;
+};
+
+/*
+ * queued counts tasks sitting in any deque and free counts empty places,
+ * so a worker that gets past sem_wait(&queued) is sure to find a task and
+ * a submitter that gets past sem_wait(&free) is sure to find room.
+ */
+struct workpool {
+    int nworkers;
+    struct worker *workers;
+    sem_t queued;
+    sem_t free;
+    unsigned int next;
+};
+
+static int take_own(struct worker *w, struct task *t)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        *t = w->tasks[w->head];
+        w->head = (w->head + 1) % WORKPOOL_DEQUE_SIZE;
+        w->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return found;
+}
+
+static int steal(struct worker *victim, struct task *t)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->count > 0) {
+        victim->count--;
+        *t = victim->tasks[(victim->head + victim->count) % WORKPOOL_DEQUE_SIZE];
+        found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    return found;
+}
+
+static void *worker_proc(void *arg)
+{
+    struct worker *w = arg;
+    struct workpool *pool = w->pool;
+    struct task t;
+    int x;
+
+    while (1) {
+        while (sem_wait(&pool->queued) < 0 && errno == EINTR);
+
+        /* Own deque first, then every other worker's in turn */
+        while (!take_own(w, &t)) {
+            for (x = 1; x < pool->nworkers; x++) {
+                if (steal(&pool->workers[(w->id + x) % pool->nworkers], &t)) {
+                    w->stolen++;
+                    break;
+                }
+            }
+            if (x < pool->nworkers) {
+                break;
+            }
+        }
+        sem_post(&pool->free);
+
+        t.fn(t.arg);
+        w->executed++;
+    }
+
+    return NULL;
+}
+
+struct workpool *workpool_create(int nworkers)
+{
+    struct workpool *pool;
+    int x;
+
+    pool = calloc(1, sizeof(struct workpool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->workers = calloc(nworkers, sizeof(struct worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->nworkers = nworkers;
+    sem_init(&pool->queued, 0, 0);
+    sem_init(&pool->free, 0, nworkers * WORKPOOL_DEQUE_SIZE);
+
+    for (x = 0; x < nworkers; x++) {
+        pool->workers[x].pool = pool;
+        pool->workers[x].id = x;
+        pthread_mutex_init(&pool->workers[x].lock, NULL);
+    }
+    for (x = 0; x < nworkers; x++) {
+        if (pthread_create(&pool->workers[x].tid, NULL, worker_proc, &pool->workers[x]) != 0) {
+            return NULL;
+        }
+        pthread_detach(pool->workers[x].tid);
+    }
+
+    return pool;
+}
+
+void workpool_submit(struct workpool *pool, workpool_fn fn, void *arg)
+{
+    struct worker *w;
+    unsigned int start;
+    int x;
+
+    while (sem_wait(&pool->free) < 0 && errno == EINTR);
+
+    /* Round robin, skipping deques that are full */
+    start = __sync_fetch_and_add(&pool->next, 1);
+    for (x = 0; ; x++) {
+        w = &pool->workers[(start + x) % pool->nworkers];
+        pthread_mutex_lock(&w->lock);
+        if (w->count < WORKPOOL_DEQUE_SIZE) {
+            w->tasks[(w->head + w->count) % WORKPOOL_DEQUE_SIZE].fn = fn;
+            w->tasks[(w->head + w->count) % WORKPOOL_DEQUE_SIZE].arg = arg;
+            w->count++;
+            if (w->count > w->max_depth) {
+                w->max_depth = w->count;
+            }
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    sem_post(&pool->queued);
+}
+
+int workpool_stats(struct workpool *pool, struct workpool_stats *stats)
+{
+    struct worker *w;
+    int x;
+
+    for (x = 0; x < pool->nworkers; x++) {
+        w = &pool->workers[x];
+        pthread_mutex_lock(&w->lock);
+        stats[x].executed = w->executed;
+        stats[x].stolen = w->stolen;
+        stats[x].depth = w->count;
+        stats[x].max_depth = w->max_depth;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return pool->nworkers;
+}
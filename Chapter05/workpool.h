@@ -0,0 +1,32 @@
+/* workpool.h */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/* Tasks each worker can have queued; submitting blocks when all are full */
+#define WORKPOOL_DEQUE_SIZE 256
+
+typedef void (*workpool_fn)(void *arg);
+
+/*
+ * A snapshot of one worker.  stolen counts the tasks it took from other
+ * workers' deques; depth is how many are queued on its own deque now.
+ */
+struct workpool_stats {
+    unsigned long executed;
+    unsigned long stolen;
+    int depth;
+    int max_depth;
+};
+
+struct workpool;
+
+/* Start nworkers threads, or return NULL */
+struct workpool *workpool_create(int nworkers);
+
+/* Queue fn(arg) on the next worker in turn, waiting while every deque is full */
+void workpool_submit(struct workpool *pool, workpool_fn fn, void *arg);
+
+/* Copy the counters of every worker into stats, returning how many */
+int workpool_stats(struct workpool *pool, struct workpool_stats *stats);
+
+#endif
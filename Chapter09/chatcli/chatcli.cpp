@@ -0,0 +1,186 @@
+/* chatcli.cpp */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string>
+#include <qapplication.h>
+#include <qmessagebox.h>
+#include "logindlg.h"
+#include "chatwin.h"
+#include "chatcli.h"
+#include "../chatsrv/linebuf.h"
+
+using namespace std;
+
+/* Global Variables */
+int client_socket;
+/* What has been received on client_socket but not yet read as lines */
+line_buffer client_reader(MAX_LINE_BUFF - 1);
+
+
+int main(int argc, char **argv)
+{
+    cLoginDlg *logindlg;
+    string host;
+    int port;
+    string nickname;
+
+    QApplication app(argc, argv);
+
+    do {
+        logindlg = new cLoginDlg(NULL);
+        if (logindlg->exec() == QDialog::Rejected) {
+            delete logindlg;
+            return 0;
+        }
+        host = logindlg->hostEdit->text().ascii();
+        port = atoi(logindlg->portEdit->text().ascii());
+        nickname = logindlg->nickEdit->text().ascii();
+    } while (connectAndJoin(host, port, nickname) == 0);
+
+    cChatWin *chatwin = new cChatWin();
+    chatwin->client_socket = client_socket;
+    app.setMainWidget(chatwin);
+    chatwin->setCaption("Chat Test");
+    chatwin->show();
+    app.connect(&app, SIGNAL(lastWindowClosed()), &app, SLOT(quit()));
+    int res = app.exec();
+    return res;
+}
+
+int connectAndJoin(string host, int port, string nickname)
+{
+    sockaddr_in sAddr;
+    hostent *dotaddr = NULL;
+    int flag = 1;
+    string joinString;
+    char buff[MAX_LINE_BUFF];
+    cmd_t cmd;
+
+	client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    client_reader.clear();
+
+    bzero(&sAddr, sizeof(sockaddr_in));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = INADDR_ANY;
+    sAddr.sin_port = htons(port);
+    dotaddr = gethostbyname(host.c_str());
+    if (dotaddr) {
+        bcopy((const void *) dotaddr->h_addr_list[0], (void *) &sAddr.sin_addr.s_addr, dotaddr->h_length);
+    } else {
+        sAddr.sin_addr.s_addr = inet_addr("0.0.0.0");
+    }
+
+    /* Connect to server */
+    if (connect(client_socket, (const sockaddr *) &sAddr, sizeof(sAddr)) != 0) {
+        QMessageBox::critical(NULL, "Connection Failed", "Unable to connect.");
+        close(client_socket);
+        return 0;
+    }
+
+    /* Turn off Nagle's algorithm*/
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    /* Set socket to non-blocking */
+    ioctl(client_socket, FIONBIO, (char *) &flag);
+
+    joinString = "JOIN " + nickname + "\n";
+    send(client_socket, joinString.c_str(), joinString.length(), 0);
+    readLine(client_socket, buff, MAX_LINE_BUFF, 0);
+    cmd = decodeCommand(buff);
+    
+    if (cmd.command == "100") {
+        return 1;
+    } else if (cmd.command == "200") {
+        QMessageBox::critical(NULL, "Nickname In Use", "The nickname you've chosen is already in use.");
+        close(client_socket);
+        return 0;
+    } else if (cmd.command == "201") {
+        QMessageBox::critical(NULL, "Invalid Nickname", "The nickname you've chosen is invalid.");
+        close(client_socket);
+        return 0;
+    } else {
+        QMessageBox::critical(NULL, "Unknown Error", "An unknown error has occurred.");
+        close(client_socket);
+        return 0;
+    }
+
+}
+
+/*
+ * Hand back the next line from the server, without its newline.  Lines
+ * already received are returned without touching the socket; otherwise
+ * wait up to timeout microseconds (0 waits for ever) and read whatever
+ * has arrived in one go.  Returns the line length plus one, 0 on timeout
+ * and -1 once the connection is lost.  Lines that would not fit buffer
+ * are skipped.
+ */
+int readLine(int sock, char *buffer, int buffsize, int timeout)
+{
+    fd_set fset;
+    struct timeval tv;
+    int sockStatus;
+    int status;
+    char *line;
+    size_t len;
+    ssize_t nChars;
+
+    while (1) {
+        while ((status = client_reader.next(&line, &len)) != 0) {
+            if (status > 0 && len < (size_t) buffsize) {
+                memcpy(buffer, line, len + 1);
+                return len + 1;
+            }
+        }
+
+        FD_ZERO(&fset);
+        FD_SET(sock, &fset);
+        if (timeout > 0) {
+          tv.tv_sec = 0;
+          tv.tv_usec = timeout;
+          sockStatus = select(sock + 1, &fset, NULL,  &fset, &tv);
+        } else {
+          sockStatus = select(sock + 1, &fset, NULL,  &fset, NULL);
+        }
+        if (sockStatus <= 0) {
+            return sockStatus;
+        }
+
+        nChars = client_reader.fill(sock);
+        if (nChars < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (nChars <= 0) {
+            return -1;
+        }
+    }
+}
+
+cmd_t decodeCommand(const char *buffer)
+{
+    struct cmd_t ret_cmd;
+    int state;
+
+    state = 0;
+    for (int x = 0; x < strlen(buffer); x++) {
+        if (buffer[x] == ' ' && state < 2) {
+            state++;
+        } else {
+            switch (state) {
+            case 0:     ret_cmd.command += toupper(buffer[x]);
+                        break;
+            case 1:     ret_cmd.op1 += buffer[x];
+                        break;
+            default:    ret_cmd.op2 += buffer[x];
+            }
+        }
+    }
+
+    return ret_cmd;
+}
@@ -0,0 +1,573 @@
+/* chatload.cpp */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "linebuf.h"
+
+using namespace std;
+
+/* #define's */
+#define SERVER_PORT     5296
+#define MAX_EVENTS      256
+#define MAX_LINE_BUFF   1024
+/* Give up on a phase that makes no progress for this long */
+#define PHASE_TIMEOUT   30
+/* A paced run stops waiting for stragglers after this long without a delivery */
+#define DRAIN_TIMEOUT   5
+
+/*
+ * Room load test for chatsrv.  rooms x size bots connect and JOIN,
+ * size to a room, and once every bot is in, each sends its messages.
+ * The run ends when every bot has received every message sent in its
+ * room, and the rate reported is lines delivered per second.  With the
+ * room size fixed, more rooms means more independent fan-out, which is
+ * what should scale with the server's threads.
+ *
+ * With -R the bots are a swarm at a steady pace instead: rate messages a
+ * second, spread over every bot in turn, for -d seconds, some of them
+ * PMSGs to a roommate (-P percent).  Each carries its number and send
+ * time, so every recipient can time it, and each message's first and
+ * last arrival give how long its whole fan-out took and how far apart
+ * its recipients got it.  Bots and server share a host, and so a clock.
+ */
+
+/* Structures */
+struct bot_t {
+    int index;                  /* botN, in roomN % rooms */
+    int sock;
+    bool joined;
+    unsigned long received;     /* MSG lines seen */
+    string out;                 /* still to be sent */
+    size_t outoff;
+    line_buffer *in;
+};
+
+struct worker_t {
+    pthread_t tid;
+    int index;
+    vector<bot_t *> bots;
+    int epfd;
+    bool failed;
+    unsigned long sent;         /* paced run: messages sent */
+    double sending;             /* ... and when the last went */
+    unsigned long stray;        /* ... and lines that did not parse as ours */
+    vector<long> latency;       /* ... send to receipt, per MSG recipient, ns */
+    vector<long> pmsg_latency;
+};
+
+/* A paced message: when it went, and when its recipients got it */
+struct track_t {
+    long sent;
+    int expected;               /* recipients: the room for a MSG, one for a PMSG */
+    atomic<int> count;
+    atomic<long> first;
+    atomic<long> last;
+};
+
+/* Globals */
+struct sockaddr_in server;
+int nrooms = 1;
+int room_size = 50;
+int nmessages = 100;
+int nthreads = 2;
+pthread_barrier_t barrier;
+long rate = 0;                  /* -R: messages a second over the swarm; 0 for the flat-out run */
+int duration = 10;
+int pmsg_percent = 0;
+track_t *tracks;
+unsigned long per_worker;       /* messages each thread sends; their numbers are its own block */
+atomic<unsigned long> completed(0);     /* messages every recipient has */
+
+/* Forward declarations */
+void* worker_proc(void *arg);
+bool run_phase(worker_t *w, bool joining);
+bool run_paced(worker_t *w);
+void send_paced(worker_t *w, bot_t *bot, unsigned long id);
+void record(worker_t *w, const char *line);
+void send_quit(worker_t *w);
+bool send_pending(bot_t *bot);
+void report(const char *label, vector<long> &samples);
+long now_ns(void);
+double now(void);
+
+int main(int argc, char *argv[])
+{
+    struct hostent *host;
+    struct rlimit rl;
+    vector<worker_t> workers;
+    const char *hostname = "127.0.0.1";
+    double start;
+    double elapsed;
+    unsigned long delivered;
+    unsigned long sent;
+    unsigned long total = 0;
+    vector<long> latency;
+    vector<long> pmsg_latency;
+    vector<long> fanout;
+    vector<long> skew;
+    double sending = 0;
+    int port = SERVER_PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:r:s:m:t:R:d:P:")) != -1) {
+        switch (opt) {
+        case 'h':
+            hostname = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            nrooms = atoi(optarg);
+            break;
+        case 's':
+            room_size = atoi(optarg);
+            break;
+        case 'm':
+            nmessages = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'R':
+            rate = atol(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'P':
+            pmsg_percent = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: chatload [-h host] [-p port] [-r rooms] [-s room size] [-t threads]\n"
+                            "                [-m messages per bot] | [-R messages per second -d seconds -P pmsg %%]\n");
+            return 1;
+        }
+    }
+    if (nrooms < 1 || room_size < 1 || nmessages < 1 || nthreads < 1 || rate < 0 || duration < 1 ||
+        pmsg_percent < 0 || pmsg_percent > 100) {
+        fprintf(stderr, "chatload: counts must be positive, -P a percentage\n");
+        return 1;
+    }
+    if (rate > 0) {
+        /* Every message gets a slot up front, so recipients on any thread can mark it off */
+        per_worker = max(1L, rate * duration / nthreads);
+        total = per_worker * nthreads;
+        tracks = new track_t[total]();
+        for (unsigned long i = 0; i < total; i++) {
+            tracks[i].first = LONG_MAX;
+        }
+    }
+
+    host = gethostbyname(hostname);
+    if (host == NULL) {
+        fprintf(stderr, "chatload: unknown host %s\n", hostname);
+        return 1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    memcpy(&server.sin_addr, host->h_addr_list[0], host->h_length);
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Bots are dealt out to the threads in turn, so every thread has a share of every room */
+    workers.resize(nthreads);
+    for (int i = 0; i < nrooms * room_size; i++) {
+        bot_t *bot = new bot_t;
+        char line[64];
+
+        bot->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (bot->sock < 0 || connect(bot->sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+            /* Tens of thousands of bots need the open file limit, here and at the server, above that */
+            fprintf(stderr, "chatload: bot %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+        bot->index = i;
+        bot->joined = false;
+        bot->received = 0;
+        snprintf(line, sizeof(line), "JOIN bot%d room%d\n", i, i % nrooms);
+        bot->out = line;
+        bot->outoff = 0;
+        bot->in = new line_buffer(MAX_LINE_BUFF);
+        workers[i % nthreads].bots.push_back(bot);
+    }
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].index = i;
+        workers[i].failed = false;
+        workers[i].sent = 0;
+        workers[i].stray = 0;
+        pthread_create(&workers[i].tid, NULL, worker_proc, &workers[i]);
+    }
+
+    /* Everyone has joined: go */
+    pthread_barrier_wait(&barrier);
+    start = now();
+    pthread_barrier_wait(&barrier);
+    /* Everyone has everything */
+    pthread_barrier_wait(&barrier);
+    elapsed = now() - start;
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].failed) {
+            fprintf(stderr, "chatload: timed out or lost the server\n");
+            return 1;
+        }
+    }
+
+    if (rate == 0) {
+        delivered = (unsigned long) nrooms * room_size * room_size * nmessages;
+        printf("rooms %d size %d messages %d: %lu lines delivered in %.3f s, %.0f lines/s\n",
+               nrooms, room_size, nmessages, delivered, elapsed, delivered / elapsed);
+        return 0;
+    }
+
+    sent = 0;
+    for (int i = 0; i < nthreads; i++) {
+        sent += workers[i].sent;
+        sending = max(sending, workers[i].sending - start);
+        latency.insert(latency.end(), workers[i].latency.begin(), workers[i].latency.end());
+        pmsg_latency.insert(pmsg_latency.end(), workers[i].pmsg_latency.begin(), workers[i].pmsg_latency.end());
+        if (workers[i].stray > 0) {
+            fprintf(stderr, "chatload: %lu lines on thread %d were not ours\n", workers[i].stray, i);
+        }
+    }
+    for (unsigned long i = 0; i < total; i++) {
+        if (tracks[i].expected > 1 && tracks[i].count == tracks[i].expected) {
+            fanout.push_back(tracks[i].last - tracks[i].sent);
+            skew.push_back(tracks[i].last - tracks[i].first);
+        }
+    }
+    printf("%d bots in %d rooms of %d on %d threads; %lu messages in %.1f s (%ld/s asked, %.0f/s sent), %d%% PMSG\n",
+           nrooms * room_size, nrooms, room_size, nthreads, sent, sending, rate, sent / sending, pmsg_percent);
+    printf("%lu of %lu messages reached every recipient; latency in us\n", completed.load(), sent);
+    printf("%-22s %10s %9s %9s %9s %9s %9s\n", "", "samples", "p50", "p90", "p99", "p99.9", "max");
+    report("MSG, per recipient", latency);
+    report("MSG, whole fan-out", fanout);
+    report("MSG, recipient skew", skew);
+    report("PMSG", pmsg_latency);
+
+    return 0;
+}
+
+void* worker_proc(void *arg)
+{
+    worker_t *w = (worker_t *) arg;
+    struct epoll_event ev;
+    int flag = 1;
+    bool ok;
+
+    w->epfd = epoll_create1(0);
+    for (size_t i = 0; i < w->bots.size(); i++) {
+        setsockopt(w->bots[i]->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+        fcntl(w->bots[i]->sock, F_SETFL, O_NONBLOCK);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = w->bots[i];
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->bots[i]->sock, &ev);
+    }
+
+    ok = run_phase(w, true);
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+
+    if (ok && rate > 0) {
+        ok = run_paced(w);
+        send_quit(w);
+    } else if (ok) {
+        for (size_t i = 0; i < w->bots.size(); i++) {
+            bot_t *bot = w->bots[i];
+
+            bot->out.clear();
+            bot->outoff = 0;
+            for (int n = 0; n < nmessages; n++) {
+                bot->out += "MSG load message number " + to_string(n) + "\n";
+            }
+        }
+        ok = run_phase(w, false);
+    }
+    w->failed = !ok;
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+/*
+ * Send what each bot has queued and read until every bot has its JOIN
+ * reply (joining) or all the MSG lines for its room (otherwise).
+ */
+bool run_phase(worker_t *w, bool joining)
+{
+    struct epoll_event events[MAX_EVENTS];
+    unsigned long expected = (unsigned long) room_size * nmessages;
+    size_t remaining = w->bots.size();
+    double last = now();
+    char *line;
+    size_t len;
+    ssize_t nread;
+    int nready;
+    int status;
+
+    for (size_t i = 0; i < w->bots.size(); i++) {
+        if (!send_pending(w->bots[i])) {
+            return false;
+        }
+    }
+
+    while (remaining > 0) {
+        nready = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+        if (nready <= 0) {
+            if (now() - last > PHASE_TIMEOUT) {
+                return false;
+            }
+            continue;
+        }
+        last = now();
+
+        for (int i = 0; i < nready; i++) {
+            bot_t *bot = (bot_t *) events[i].data.ptr;
+
+            if ((events[i].events & EPOLLOUT) && !send_pending(bot)) {
+                return false;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                continue;
+            }
+            while ((nread = bot->in->fill(bot->sock)) > 0) {
+                while ((status = bot->in->next(&line, &len)) != 0) {
+                    if (status < 0) {
+                        continue;
+                    }
+                    if (joining && !bot->joined && strncmp(line, "100 OK", 6) == 0) {
+                        bot->joined = true;
+                        remaining--;
+                    } else if (!joining && strncmp(line, "MSG ", 4) == 0) {
+                        if (++bot->received == expected) {
+                            remaining--;
+                        }
+                    }
+                }
+            }
+            if (nread == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The paced run.  This thread's bots take turns to send its share of the
+ * rate, and everything they receive is timed, until every message has
+ * reached every recipient, or deliveries stop coming.
+ */
+bool run_paced(worker_t *w)
+{
+    struct epoll_event events[MAX_EVENTS];
+    long interval = 1000000000L * nthreads / rate;
+    unsigned long base = w->index * per_worker;
+    unsigned long total = per_worker * nthreads;
+    double last = now();
+    long next = now_ns();
+    long wait;
+    char *line;
+    size_t len;
+    ssize_t nread;
+    int nready;
+    int status;
+
+    while (w->sent < per_worker || completed.load(memory_order_relaxed) < total) {
+        /* Catch up on whatever fell due while waiting, since epoll_wait() only counts milliseconds */
+        while (w->sent < per_worker && now_ns() >= next) {
+            send_paced(w, w->bots[w->sent % w->bots.size()], base + w->sent);
+            w->sent++;
+            next += interval;
+            if (w->sent == per_worker) {
+                w->sending = now();
+            }
+        }
+
+        wait = (w->sent < per_worker) ? max(0L, (next - now_ns()) / 1000000) : 100;
+        nready = epoll_wait(w->epfd, events, MAX_EVENTS, wait);
+        if (nready <= 0) {
+            if (w->sent == per_worker && now() - last > DRAIN_TIMEOUT) {
+                /* What is still missing has been lost, to the server's queue limits say */
+                return true;
+            }
+            continue;
+        }
+        last = now();
+
+        for (int i = 0; i < nready; i++) {
+            bot_t *bot = (bot_t *) events[i].data.ptr;
+
+            if ((events[i].events & EPOLLOUT) && !send_pending(bot)) {
+                return false;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                continue;
+            }
+            while ((nread = bot->in->fill(bot->sock)) > 0) {
+                while ((status = bot->in->next(&line, &len)) != 0) {
+                    if (status > 0) {
+                        record(w, line);
+                    }
+                }
+            }
+            if (nread == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Send message id from bot: to its room, or now and then to a roommate */
+void send_paced(worker_t *w, bot_t *bot, unsigned long id)
+{
+    track_t &track = tracks[id];
+    char line[96];
+
+    track.sent = now_ns();
+    if (room_size > 1 && (long) (id % 100) < pmsg_percent) {
+        /* Bots nrooms apart share a room */
+        track.expected = 1;
+        snprintf(line, sizeof(line), "PMSG bot%d %lu %ld\n",
+                 (bot->index + nrooms) % (nrooms * room_size), id, track.sent);
+    } else {
+        track.expected = room_size;
+        snprintf(line, sizeof(line), "MSG %lu %ld\n", id, track.sent);
+    }
+    bot->out.erase(0, bot->outoff);
+    bot->outoff = 0;
+    bot->out += line;
+    send_pending(bot);
+}
+
+/*
+ * Time a line a bot received: "MSG nick id sent" or "PMSG nick id sent".
+ * The first recipient and the last to get a message mark its track, and
+ * whoever completes it counts it.
+ */
+void record(worker_t *w, const char *line)
+{
+    const char *p;
+    char *end;
+    unsigned long id;
+    long sent;
+    long at = now_ns();
+    long seen;
+    bool pmsg = strncmp(line, "PMSG ", 5) == 0;
+
+    if (!pmsg && strncmp(line, "MSG ", 4) != 0) {
+        return;
+    }
+    p = strchr(line + 4 + pmsg, ' ');
+    if (p == NULL) {
+        w->stray++;
+        return;
+    }
+    id = strtoul(p + 1, &end, 10);
+    if (*end != ' ' || id >= per_worker * nthreads) {
+        w->stray++;
+        return;
+    }
+    sent = strtol(end + 1, &end, 10);
+    if (*end != ' ' && *end != '\0') {
+        w->stray++;
+        return;
+    }
+
+    track_t &track = tracks[id];
+    (pmsg ? w->pmsg_latency : w->latency).push_back(at - sent);
+    seen = track.first.load(memory_order_relaxed);
+    while (at < seen && !track.first.compare_exchange_weak(seen, at, memory_order_relaxed)) {
+    }
+    seen = track.last.load(memory_order_relaxed);
+    while (at > seen && !track.last.compare_exchange_weak(seen, at, memory_order_relaxed)) {
+    }
+    if (track.count.fetch_add(1, memory_order_acq_rel) + 1 == track.expected) {
+        completed.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+/* Leave the way a client should, so the server sees QUITs rather than lost connections */
+void send_quit(worker_t *w)
+{
+    for (size_t i = 0; i < w->bots.size(); i++) {
+        send(w->bots[i]->sock, "QUIT\n", 5, MSG_NOSIGNAL);
+    }
+}
+
+bool send_pending(bot_t *bot)
+{
+    ssize_t nsent;
+
+    while (bot->outoff < bot->out.length()) {
+        nsent = send(bot->sock, bot->out.data() + bot->outoff, bot->out.length() - bot->outoff, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        bot->outoff += nsent;
+    }
+
+    return true;
+}
+
+void report(const char *label, vector<long> &samples)
+{
+    size_t n = samples.size();
+
+    if (n == 0) {
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    printf("%-22s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f\n", label, n, samples[n / 2] / 1e3,
+           samples[n * 9 / 10] / 1e3, samples[n * 99 / 100] / 1e3, samples[n * 999 / 1000] / 1e3,
+           samples[n - 1] / 1e3);
+}
+
+long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
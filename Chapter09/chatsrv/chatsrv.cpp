@@ -0,0 +1,3223 @@
+/* chatsrv.cpp */
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include <map>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <charconv>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#include "mpsc.h"
+#include "linebuf.h"
+#include "command.h"
+#include "msglog.h"
+#include "frame.h"
+#include "metrics.h"
+#include "roster.h"
+
+using namespace std;
+
+/* #define's */
+#define LISTEN_PORT     5296
+/* Default for -m: longest command line accepted, newline excluded */
+#define MAX_LINE_BUFF   1024
+#define MAX_EVENTS      256
+#define MAX_LOOPS       256
+/* Queued messages gathered into one send */
+#define MAX_IOV         64
+/* Seconds between counter reports */
+#define STATS_INTERVAL  5
+/* The room a JOIN without a room name goes to */
+#define DEFAULT_ROOM    "lobby"
+/* Defaults for -q, -n and -b: per-client queue limits and the server-wide budget */
+#define QUEUE_BYTES     (1024 * 1024)
+#define QUEUE_MSGS      8192
+#define MEMORY_BUDGET   (256L * 1024 * 1024)
+/* Budget a loop takes from the shared pool at a time */
+#define BUDGET_CHUNK    (64 * 1024)
+/* A frame for a binary client takes no more queued messages once it is this big */
+#define FRAME_BATCH     (64 * 1024)
+/* Longest NAMES, OPS or PRESENCE line; a longer list goes on in another line */
+#define ROSTER_LINE     4096
+/* Default for -H: logged messages replayed on JOIN; and the most HISTORY sends */
+#define JOIN_HISTORY    20
+#define HISTORY_MAX     500
+
+/* Cluster limits: nodes, and the unsent bytes a link may hold before it is reset */
+#define MAX_NODES       16
+#define LINK_BUFFER     (64 * 1024 * 1024)
+/* Milliseconds between attempts to bring a down link back, and that a JOIN waits on a home node */
+#define LINK_RETRY      1000
+#define CLAIM_TIMEOUT   5000
+/* Longest line on a link: a client's line, with the room and a nickname in front */
+#define LINK_MAX_LINE   (4 * max_line + 64)
+
+/* What becomes of a client whose queue is over its limits (-p) */
+#define POLICY_DROP         0   /* lose the oldest queued messages */
+#define POLICY_COALESCE     1   /* lose queued chat text, keep presence, say how much went */
+#define POLICY_DISCONNECT   2   /* drop the client */
+
+/* What a JOIN asked for, after the room name */
+#define JOIN_BINARY     1   /* the binary protocol */
+#define JOIN_BATCH      2   /* a NAMES snapshot and PRESENCE deltas, not JOIN and QUIT lines */
+
+/* Inbox event types */
+#define EV_ADOPT        0   /* take over client, then run line (its JOIN) */
+#define EV_LINK         1   /* take over a link from a peer's loop of our index */
+
+/* What an epoll registration points at, other than a listening socket or an eventfd */
+#define H_CLIENT        0
+#define H_LINK          1
+
+/* Structures */
+struct loop_t;
+struct room_t;
+
+struct handle_t {
+    explicit handle_t(int kind) : kind(kind) {}
+
+    int kind;
+};
+
+/*
+ * A framed message, newline included.  A broadcast builds one and every
+ * recipient's queue holds a reference to it, so fanning out to N clients
+ * costs N reference counts rather than N strings.
+ */
+typedef shared_ptr<const string> payload_t;
+
+/*
+ * One entry in a client's send queue: a framed message, or a run of
+ * logged messages that goes out of the segment file with sendfile().
+ * Entries queued for a binary client are encoded into a binary frame
+ * when they are about to be sent.
+ */
+struct outmsg_t {
+    outmsg_t(const payload_t &payload) : payload(payload), offset(0), length(payload->length()), binary(false) {}
+    outmsg_t(const log_range_t &range)
+        : segment(range.segment), offset(range.offset), length(range.length), binary(false) {}
+
+    payload_t payload;
+    shared_ptr<log_segment_t> segment;
+    off_t offset;
+    size_t length;
+    bool binary;            /* text lines still to be encoded by encode_frame() */
+};
+
+/*
+ * One connection.  A client belongs to the loop that accepted it until it
+ * joins a room, and from then on to the loop that owns the room.  Only
+ * the owning loop's thread ever touches it.
+ */
+struct client_t : handle_t {
+    explicit client_t(size_t max_line) : handle_t(H_CLIENT), inbound(max_line) {}
+
+    uint64_t id;
+    uint32_t slot;          /* in its loop's clients */
+    int sock;
+    bool joined;
+    bool opstatus;
+    bool closing;           /* close once outbound has been sent */
+    bool pending;           /* on flush_list */
+    bool dead;              /* closed, freed after the current batch */
+    bool evicting;          /* over its limits; dropped once the current batch is done */
+    bool claiming;          /* JOIN waiting on the room's home node; input is held */
+    bool binary;            /* joined with the binary protocol: frames both ways from then on */
+    bool batch;             /* joined with BATCH */
+    room_t *room;
+    size_t member_index;    /* place in room->members */
+    string nickname;
+    line_buffer inbound;    /* received bytes not yet handed to process_line */
+    deque<outmsg_t> outbound;  /* oldest first */
+    size_t outoff;          /* bytes of outbound.front() already sent */
+    size_t queued;          /* bytes held in outbound */
+    size_t reply_mark;      /* where process_line puts its reply, kept right as the queue is trimmed */
+    bool replying;          /* a reply is still to go in at reply_mark */
+    payload_t notice;       /* the last "messages skipped" line queued, and its count */
+    unsigned long skipped;
+    unsigned long messages; /* ever queued for it, for segments per message */
+};
+
+/* Someone in a room: a client of this loop, or a member connected to another node */
+struct member_t {
+    client_t *client;       /* NULL for a member elsewhere */
+    int node;
+    bool op;                /* for a member elsewhere; a client here has opstatus */
+    bool joined;            /* false while only reserved by this node as the room's home */
+};
+
+/*
+ * A chat room.  Every room belongs to one loop, picked by hashing its
+ * name, and all of its members are moved to that loop when they join,
+ * so the room needs no lock and its fan-out never leaves the thread.
+ * In a cluster every node keeps the room while anyone, anywhere, is in
+ * it, and knows its members on other nodes from what their nodes send.
+ */
+struct room_t {
+    string name;
+    string topic;
+    name_table<member_t> roster;            /* nickname -> member, here or elsewhere */
+    vector<client_t *> members;             /* the clients here, for fan-out */
+    int node_members[MAX_NODES];            /* joined remote members on each node */
+    int batch_members;                      /* members here that joined with BATCH */
+    string presence;                        /* " +nick" and " -nick" not yet sent to them */
+    bool presence_pending;                  /* on presence_rooms */
+    message_log *log;                       /* NULL without -l */
+    bool log_dirty;                         /* on dirty_rooms */
+};
+
+/*
+ * A connection between two nodes, carrying the rooms of one loop index.
+ * Links are one-way: each loop connects out to every peer and only writes
+ * to that socket, and reads what the peers' loops of the same index send
+ * it on the links it accepted.  Every node runs the same number of loops,
+ * so both ends own the same rooms and nothing off a link changes thread.
+ */
+struct link_t : handle_t {
+    explicit link_t(size_t max_line) : handle_t(H_LINK), inbound(max_line) {}
+
+    int node;               /* the peer; -1 until an accepted link says */
+    int sock;               /* -1 while an outgoing link is down */
+    bool outgoing;
+    bool connected;         /* outgoing: connect() has finished */
+    bool pending;           /* on link_flush */
+    bool dead;              /* accepted link closed, freed after the current batch */
+    string out;             /* frames batched up for the next send */
+    size_t outoff;          /* bytes of out already sent */
+    line_buffer inbound;    /* accepted links */
+};
+
+/* A JOIN sent to the room's home node for its nickname */
+struct claim_t {
+    uint64_t client_id;
+    uint32_t client_slot;
+    int home;
+    string room;
+    string nickname;
+    int modes;              /* JOIN_BINARY, JOIN_BATCH */
+    long deadline;          /* ms; given up on after this */
+};
+
+struct event_t : mpsc_node {
+    int type;
+    handle_t *handle;       /* the client or link being handed over */
+    string line;
+};
+
+/* Counters written by one loop thread and read by the reporter */
+struct loop_stats_t {
+    atomic<unsigned long> commands;
+    atomic<unsigned long> posted;       /* events put in any inbox */
+    atomic<unsigned long> wakeups;      /* eventfd writes to other loops */
+    atomic<unsigned long> adopted;      /* clients moved in to join a room here */
+    atomic<unsigned long> dropped;      /* messages lost to drop-oldest */
+    atomic<unsigned long> coalesced;    /* chat lines lost to coalescing */
+    atomic<unsigned long> disconnected; /* clients dropped for their queues */
+    atomic<unsigned long> logged;       /* messages appended to room logs */
+    atomic<unsigned long> replayed;     /* logged messages sent as history */
+    atomic<unsigned long> frames_out;   /* lines sent to other nodes */
+    atomic<unsigned long> frames_in;
+    atomic<unsigned long> claims;       /* JOINs referred to another node */
+    atomic<long> links;                 /* outgoing links up */
+    atomic<long> rooms;
+    atomic<long> members;
+    atomic<long> queued;                /* bytes queued, as of the last batch */
+    atomic<unsigned long> messages_out; /* messages queued for clients, as of the last batch */
+    atomic<unsigned long> sends;        /* ... sendmsg() and sendfile() calls that sent them */
+    atomic<unsigned long> segments;     /* TCP data segments sent to clients since closed */
+    atomic<unsigned long> closed_messages;  /* ... and the messages queued for those clients */
+    histogram command_time[FRAME_IDS];  /* handler run time by command id, ns */
+    histogram fanout_time;              /* delivering one message to a room's members here, ns */
+    histogram fanout_size;              /* ... and how many they were */
+    histogram queue_depth;              /* messages a client has queued when it is flushed */
+    histogram queue_bytes;              /* ... and their bytes */
+    histogram batch_time;               /* one pass of the loop, from epoll_wait() to the next, ns */
+    histogram lock_wait;                /* waiting for commit_lock, ns */
+    histogram lock_hold;                /* holding it */
+};
+
+/*
+ * An event loop thread.  Producers on any thread push onto inbox and
+ * write evfd only if wake_pending was clear, so a burst of events costs
+ * the loop one wakeup.
+ */
+struct loop_t {
+    pthread_t tid;
+    int index;
+    int epfd;
+    int evfd;
+    int timerfd;            /* -D: goes off when the held client output is due */
+    int presence_timer;     /* -J: goes off when the rooms' gathered JOINs and QUITs are due */
+    int listensock;
+    atomic<bool> wake_pending;
+    mpsc_queue inbox;
+    vector<client_t *> clients;     /* by slot; NULL in a free one */
+    vector<uint32_t> free_slots;
+    map<string, room_t *, less<>> rooms;    /* the rooms this loop owns */
+    vector<client_t *> flush_list;
+    bool flush_armed;       /* timerfd is set for flush_list */
+    bool flush_due;         /* ... and has gone off */
+    vector<client_t *> dead_list;
+    vector<client_t *> evict_list;
+    vector<room_t *> dirty_rooms;   /* logged to since the last commit */
+    vector<room_t *> presence_rooms;    /* with JOINs or QUITs gathered for BATCH clients */
+    bool presence_armed;
+    bool presence_due;
+    link_t *out_links[MAX_NODES];   /* to each peer; NULL for this node */
+    link_t *in_links[MAX_NODES];    /* from each peer, once it has said who it is */
+    vector<link_t *> link_flush;
+    vector<link_t *> dead_links;
+    map<uint64_t, claim_t> claims;  /* by sequence number */
+    uint64_t claim_seq;
+    long next_retry;                /* when down links are next tried, in ms */
+    long queued;            /* bytes queued for this loop's clients */
+    long credit;            /* budget taken from budget_free and not yet used */
+    bool over_budget;       /* the pool ran dry; shed_load() is due */
+    unsigned long messages_out;     /* counted here, published to stats once a batch */
+    unsigned long sends;
+    unsigned long segments;
+    unsigned long closed_messages;
+    loop_stats_t stats;
+};
+
+typedef int (*command_fn)(const cmd_t &cmd, client_t *client, payload_t &reply);
+
+struct command_t {
+    string_view verb;
+    int id;                 /* in the binary protocol */
+    command_fn handler;
+    bool before_join;       /* allowed before the client has joined */
+};
+
+typedef void (*frame_fn)(link_t *link, const cmd_t &frame);
+
+/* What a peer can send on a link, after the NODE line that opens it */
+struct frame_t {
+    string_view verb;
+    frame_fn handler;
+};
+
+/* Globals */
+int sparefd = -1;
+size_t max_line = MAX_LINE_BUFF - 1;
+int nloops;
+loop_t *loops[MAX_LOOPS];
+atomic<uint64_t> next_client_id(1);
+size_t queue_bytes = QUEUE_BYTES;
+size_t queue_msgs = QUEUE_MSGS;
+int queue_policy = POLICY_DROP;
+long flush_delay = 0;           /* -D: microseconds client output may be held to send more at once */
+long presence_window = 0;       /* -J: microseconds JOINs and QUITs are gathered for; 0 for one batch */
+long memory_budget = MEMORY_BUDGET;
+/*
+ * Queued bytes still to be had, server-wide.  Loops take from it a chunk
+ * at a time and hand back what they free in chunks, so the shared counter
+ * is touched once per BUDGET_CHUNK rather than once per message.  It goes
+ * negative when the budget is overspent.
+ */
+atomic<long> budget_free;
+string log_dir;
+size_t join_history = JOIN_HISTORY;
+int client_port = LISTEN_PORT;
+/* The cluster: every node's link address, in node order, and which one we are */
+int nnodes = 1;
+int self_node = 0;
+struct sockaddr_in node_addrs[MAX_NODES];
+int link_listen = -1;
+
+/*
+ * Group commit.  At the end of each batch a loop hands over what its rooms
+ * appended, and one thread writes it through to disk, taking everything
+ * that piled up while it was busy as the next group.  Nothing waits on it.
+ */
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+vector<log_sync_t> commit_queue;
+atomic<unsigned long> log_commits(0);
+/* The commit thread's side of commit_lock, and how long each group takes to write through */
+histogram commit_lock_wait;
+histogram commit_lock_hold;
+histogram commit_time;
+
+/* Who may ask for STATS: a client that gives -a's key, or anyone who can open -S's socket */
+string admin_key;
+string stats_path;
+int stats_listen = -1;
+
+thread_local loop_t *this_loop;
+
+/* Forward declarations */
+void* loop_proc(void *arg);
+void arm_timer(int fd, long usec);
+void* commit_proc(void *arg);
+void commit_logs(loop_t *loop);
+void submit_syncs(vector<log_sync_t> &syncs);
+void log_message(room_t *room, const payload_t &payload);
+size_t replay_history(client_t *client, size_t count);
+void accept_clients(loop_t *loop);
+void add_client(loop_t *loop, client_t *client);
+void remove_client(loop_t *loop, client_t *client);
+bool read_client(client_t *client);
+bool process_input(client_t *client);
+bool process_line(client_t *client, const char *buffer, size_t length);
+bool process_frame(client_t *client, char *body, size_t length);
+bool run_command(client_t *client, const command_t *command, const cmd_t &cmd);
+payload_t make_payload(initializer_list<string_view> parts);
+void post(loop_t *loop, int type, handle_t *handle, string_view line);
+int drain_inbox(loop_t *loop);
+void adopt_client(client_t *client, string_view line);
+void move_client(client_t *client, loop_t *loop, string_view line);
+loop_t *room_owner(string_view name);
+void broadcast(room_t *room, const payload_t &payload, client_t *except);
+void deliver(client_t *client, const payload_t &payload);
+void enqueue(client_t *client, size_t pos, outmsg_t msg);
+void dequeue(client_t *client, size_t pos);
+void budget_take(loop_t *loop, size_t length);
+void budget_return(loop_t *loop, size_t length);
+void trim_queue(client_t *client, size_t max_bytes, size_t max_msgs);
+void coalesce_queue(client_t *client);
+void evict_client(client_t *client);
+void shed_load(loop_t *loop);
+void enter_room(client_t *client, room_t *room);
+void leave_room(client_t *client);
+int send_queue(client_t *client);
+void encode_frame(client_t *client);
+void flush_client(client_t *client);
+void drop_client(client_t *client);
+void fan_out(room_t *room, const payload_t &payload, client_t *except);
+void announce(room_t *room, char change, string_view nickname, const payload_t &line, client_t *except);
+void flush_presence(room_t *room);
+void append_list(string &out, string_view verb, string_view list);
+room_t *find_room(string_view name, bool create);
+void release_room(room_t *room);
+bool nick_taken(room_t *room, string_view nickname);
+void complete_join(client_t *client, room_t *room, string_view nickname, bool op, int modes);
+string join_modes(int modes);
+bool parse_nodes(const char *arg);
+long now_ms(void);
+int room_home(string_view name);
+void start_links(loop_t *loop);
+void retry_links(loop_t *loop);
+void connect_link(link_t *link);
+void link_connected(link_t *link);
+void link_down(link_t *link);
+bool link_send(int node, initializer_list<string_view> parts);
+void forward_room(room_t *room, const payload_t &payload);
+void flush_link(link_t *link);
+void accept_links(loop_t *loop);
+void link_event(link_t *link, uint32_t events);
+void read_link(link_t *link);
+bool process_link(link_t *link);
+void adopt_link(link_t *link);
+void install_link(link_t *link);
+void drop_node(int node);
+void add_remote(room_t *room, string_view nickname, int node, bool joined);
+void remove_remote(room_t *room, int index);
+void remote_line(int node, string_view name, string_view line);
+int claim_nickname(client_t *client, int home, string_view name, string_view nickname, int modes,
+                   payload_t &reply);
+client_t *take_claim(uint64_t seq, claim_t *taken);
+void finish_claim(client_t *client, const payload_t &reply);
+void watch_input(client_t *client, bool on);
+void fail_claims(int node, long now);
+void room_frame(link_t *link, const cmd_t &frame);
+void to_frame(link_t *link, const cmd_t &frame);
+void claim_frame(link_t *link, const cmd_t &frame);
+void grant_frame(link_t *link, const cmd_t &frame);
+void deny_frame(link_t *link, const cmd_t &frame);
+void report_stats(void);
+void print_counters(unsigned long *last);
+void serve_stats(void);
+string stats_report(const string &prefix);
+size_t parse_size(const char *arg);
+int join_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int msg_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int pmsg_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int op_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int kick_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int topic_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int quit_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int history_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+int stats_command(const cmd_t &cmd, client_t *client, payload_t &reply);
+
+/*
+ * Verb dispatch: one hash and one compare, the slots worked out at compile
+ * time.  Binary clients name the command by id, which is a plain index.
+ */
+constexpr command_t commands[] = {
+    { "JOIN",  ID_JOIN,  join_command,  true },
+    { "MSG",   ID_MSG,   msg_command,   false },
+    { "PMSG",  ID_PMSG,  pmsg_command,  false },
+    { "OP",    ID_OP,    op_command,    false },
+    { "KICK",  ID_KICK,  kick_command,  false },
+    { "TOPIC", ID_TOPIC, topic_command, false },
+    { "QUIT",  ID_QUIT,  quit_command,  false },
+    { "HISTORY", ID_HISTORY, history_command, false },
+    { "STATS", ID_STATS, stats_command, true },
+};
+constexpr array<int, VERB_SLOTS> command_slots = build_verb_slots(commands);
+constexpr array<int, FRAME_IDS> command_ids = build_id_slots(commands);
+
+constexpr frame_t frames[] = {
+    { "ROOM",  room_frame },
+    { "TO",    to_frame },
+    { "CLAIM", claim_frame },
+    { "GRANT", grant_frame },
+    { "DENY",  deny_frame },
+};
+constexpr array<int, VERB_SLOTS> frame_slots = build_verb_slots(frames);
+
+/* A handler's return when the client has been handed to another loop */
+#define COMMAND_MOVED   -1
+/* ... or when its JOIN waits on another node, with its input held until then */
+#define COMMAND_PARKED  -2
+
+/* Replies are the same every time, so they are framed once */
+const payload_t reply_ok = make_payload({ "100 OK" });
+const payload_t reply_nick_in_use = make_payload({ "200 NICKNAME IN USE" });
+const payload_t reply_invalid_nick = make_payload({ "201 INVALID NICKNAME" });
+const payload_t reply_unknown_nick = make_payload({ "202 UNKNOWN NICKNAME" });
+const payload_t reply_denied = make_payload({ "203 DENIED" });
+const payload_t reply_must_join = make_payload({ "203 DENIED - MUST JOIN FIRST" });
+const payload_t reply_already_joined = make_payload({ "203 DENIED - ALREADY JOINED" });
+const payload_t reply_too_long = make_payload({ "204 LINE TOO LONG" });
+const payload_t reply_invalid_room = make_payload({ "205 INVALID ROOM" });
+const payload_t reply_no_history = make_payload({ "206 NO HISTORY" });
+const payload_t reply_unavailable = make_payload({ "207 ROOM UNAVAILABLE" });
+const payload_t reply_bad_frame = make_payload({ "208 BAD FRAME" });
+const payload_t reply_unknown_command = make_payload({ "900 UNKNOWN COMMAND" });
+
+/* main */
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in sAddr;
+    struct rlimit rl;
+    pthread_t tid;
+    const char *nodes = NULL;
+    int listensock;
+    int result;
+    int flag = 1;
+    int opt;
+
+    nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:m:q:n:p:b:D:J:l:H:P:N:F:a:S:")) != -1) {
+        switch (opt) {
+        case 't':
+            nloops = atoi(optarg);
+            break;
+        case 'm':
+            max_line = atoi(optarg);
+            break;
+        case 'q':
+            queue_bytes = parse_size(optarg);
+            break;
+        case 'n':
+            queue_msgs = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0) {
+                queue_policy = POLICY_DROP;
+            } else if (strcmp(optarg, "coalesce") == 0) {
+                queue_policy = POLICY_COALESCE;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                queue_policy = POLICY_DISCONNECT;
+            } else {
+                fprintf(stderr, "chatsrv: policy is drop, coalesce or disconnect\n");
+                return 0;
+            }
+            break;
+        case 'b':
+            memory_budget = parse_size(optarg);
+            break;
+        case 'D':
+            flush_delay = atol(optarg);
+            break;
+        case 'J':
+            presence_window = atol(optarg);
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 'H':
+            join_history = atoi(optarg);
+            break;
+        case 'P':
+            client_port = atoi(optarg);
+            break;
+        case 'N':
+            self_node = atoi(optarg);
+            break;
+        case 'F':
+            nodes = optarg;
+            break;
+        case 'a':
+            admin_key = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: chatsrv [-t threads] [-m max line] [-q queue bytes] [-n queue messages]\n"
+                            "               [-p drop|coalesce|disconnect] [-b budget bytes] [-D flush delay us]\n"
+                            "               [-J presence window us]\n"
+                            "               [-l log directory] [-H messages replayed on join]\n"
+                            "               [-P port] [-F host:port,... -N node]\n"
+                            "               [-a STATS key] [-S stats socket path]\n");
+            return 0;
+        }
+    }
+    if (nodes != NULL && !parse_nodes(nodes)) {
+        return 0;
+    }
+    if (self_node < 0 || self_node >= nnodes) {
+        fprintf(stderr, "chatsrv: node must be 0 to %d\n", nnodes - 1);
+        return 0;
+    }
+    if (nloops < 1) {
+        nloops = 1;
+    }
+    if (nloops > MAX_LOOPS) {
+        nloops = MAX_LOOPS;
+    }
+    if (queue_msgs < 1) {
+        queue_msgs = 1;
+    }
+    if (flush_delay < 0) {
+        flush_delay = 0;
+    }
+    if (presence_window < 0) {
+        presence_window = 0;
+    }
+    budget_free = memory_budget;
+    if (join_history > HISTORY_MAX) {
+        join_history = HISTORY_MAX;
+    }
+    if (!log_dir.empty()) {
+        if (mkdir(log_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("chatsrv");
+            return 0;
+        }
+        result = pthread_create(&tid, NULL, commit_proc, NULL);
+        if (result != 0) {
+            printf("could not create thread.\n");
+            return 0;
+        }
+    }
+    /* sendfile() has no MSG_NOSIGNAL */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Every client is a descriptor, so allow as many as the hard limit */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    listensock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    setsockopt(listensock, SOL_SOCKET, SO_REUSEADDR, (char *) &flag, sizeof(int));
+
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_port = htons(client_port);
+    sAddr.sin_addr.s_addr = INADDR_ANY;
+
+    result = bind(listensock, (struct sockaddr *) &sAddr, sizeof(sAddr));
+    if (result < 0) {
+        perror("chatsrv");
+        return 0;
+    }
+
+    result = listen(listensock, SOMAXCONN);
+    if (result < 0) {
+        perror("chatsrv");
+        return 0;
+    }
+
+    if (nnodes > 1) {
+        /* Peers connect here, one link per loop from each */
+        link_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        setsockopt(link_listen, SOL_SOCKET, SO_REUSEADDR, (char *) &flag, sizeof(int));
+        sAddr.sin_port = node_addrs[self_node].sin_port;
+        if (bind(link_listen, (struct sockaddr *) &sAddr, sizeof(sAddr)) < 0 ||
+            listen(link_listen, SOMAXCONN) < 0) {
+            perror("chatsrv");
+            return 0;
+        }
+    }
+
+    if (!stats_path.empty()) {
+        struct sockaddr_un uAddr;
+
+        /* Read by connecting: the report is written and the connection closed */
+        memset(&uAddr, 0, sizeof(uAddr));
+        uAddr.sun_family = AF_UNIX;
+        if (stats_path.length() >= sizeof(uAddr.sun_path)) {
+            fprintf(stderr, "chatsrv: stats socket path too long\n");
+            return 0;
+        }
+        strcpy(uAddr.sun_path, stats_path.c_str());
+        unlink(uAddr.sun_path);
+        stats_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (bind(stats_listen, (struct sockaddr *) &uAddr, sizeof(uAddr)) < 0 ||
+            listen(stats_listen, SOMAXCONN) < 0) {
+            perror("chatsrv");
+            return 0;
+        }
+    }
+
+    sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    for (int i = 0; i < nloops; i++) {
+        loops[i] = new loop_t();
+        loops[i]->index = i;
+        loops[i]->listensock = listensock;
+        loops[i]->wake_pending = false;
+        loops[i]->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loops[i]->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loops[i]->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        loops[i]->presence_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loops[i]->epfd < 0 || loops[i]->evfd < 0 || loops[i]->timerfd < 0 || loops[i]->presence_timer < 0) {
+            perror("chatsrv");
+            return 0;
+        }
+    }
+    /* Only once they all exist, since any loop may hand work to any other */
+    for (int i = 0; i < nloops; i++) {
+        result = pthread_create(&loops[i]->tid, NULL, loop_proc, loops[i]);
+        if (result != 0) {
+            printf("could not create thread.\n");
+            return 0;
+        }
+    }
+
+    report_stats();
+
+    return 1;
+}
+
+void* loop_proc(void *arg)
+{
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    loop_t *loop;
+    client_t *client;
+    handle_t *handle;
+    eventfd_t count;
+    uint64_t expirations;
+    uint64_t start;
+    bool flush_now;
+    bool presence_now;
+    int nready;
+
+    loop = (loop_t *) arg;
+    this_loop = loop;
+
+    /* Every loop accepts; EPOLLEXCLUSIVE wakes one of them per connection */
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listensock, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = loop;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop->timerfd;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev);
+    ev.data.ptr = &loop->presence_timer;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->presence_timer, &ev);
+    if (nnodes > 1) {
+        /* Links in are accepted the same way, then passed to the loop they are for */
+        ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        ev.data.ptr = &link_listen;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, link_listen, &ev);
+        start_links(loop);
+    }
+
+    while (1) {
+        /* With peers, wake now and then to bring back links that are down */
+        nready = epoll_wait(loop->epfd, events, MAX_EVENTS, (nnodes > 1) ? LINK_RETRY : -1);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("chatsrv");
+            exit(1);
+        }
+        start = now_ns();
+
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(loop);
+                continue;
+            }
+            if (events[i].data.ptr == loop) {
+                /* An exchange, not a store, so it pairs with the producers' exchange */
+                eventfd_read(loop->evfd, &count);
+                loop->wake_pending.exchange(false);
+                continue;
+            }
+            if (events[i].data.ptr == &link_listen) {
+                accept_links(loop);
+                continue;
+            }
+            if (events[i].data.ptr == &loop->timerfd) {
+                if (read(loop->timerfd, &expirations, sizeof(expirations)) > 0) {
+                    loop->flush_armed = false;
+                    loop->flush_due = true;
+                }
+                continue;
+            }
+            if (events[i].data.ptr == &loop->presence_timer) {
+                if (read(loop->presence_timer, &expirations, sizeof(expirations)) > 0) {
+                    loop->presence_armed = false;
+                    loop->presence_due = true;
+                }
+                continue;
+            }
+            handle = (handle_t *) events[i].data.ptr;
+            if (handle->kind == H_LINK) {
+                link_event((link_t *) handle, events[i].events);
+                continue;
+            }
+            client = (client_t *) handle;
+            if (client->dead) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (!read_client(client)) {
+                    /* Handed to the loop that owns its room; no longer ours to touch */
+                    continue;
+                }
+            }
+            if (!client->dead && (events[i].events & EPOLLOUT) && !client->pending) {
+                client->pending = true;
+                loop->flush_list.push_back(client);
+            }
+        }
+
+        if (nnodes > 1 && now_ms() >= loop->next_retry) {
+            retry_links(loop);
+        }
+
+        /*
+         * Take in clients handed over by other loops, drop the ones whose
+         * queues overflowed, then send what this batch queued.  Anything a
+         * socket cannot take now stays queued until EPOLLOUT reports room,
+         * and that is what counts against the budget.  What the batch has
+         * for each peer goes in one send on its link.  With -D, client
+         * output is held until the timer set by the first batch to queue
+         * any goes off, so the batches in between share each client's send.
+         * JOINs and QUITs for BATCH clients go out first, gathered over
+         * the batch, or with -J over the window its timer measures.
+         */
+        flush_now = (flush_delay == 0 || loop->flush_due);
+        presence_now = (presence_window == 0 || loop->presence_due);
+        while (drain_inbox(loop) > 0 || (flush_now && !loop->flush_list.empty()) || !loop->evict_list.empty() ||
+               !loop->link_flush.empty() || (presence_now && !loop->presence_rooms.empty())) {
+            for (size_t i = 0; i < loop->evict_list.size(); i++) {
+                drop_client(loop->evict_list[i]);
+            }
+            loop->evict_list.clear();
+            if (presence_now) {
+                for (size_t i = 0; i < loop->presence_rooms.size(); i++) {
+                    loop->presence_rooms[i]->presence_pending = false;
+                    flush_presence(loop->presence_rooms[i]);
+                }
+                loop->presence_rooms.clear();
+                loop->presence_due = false;
+            }
+            if (flush_now) {
+                for (size_t i = 0; i < loop->flush_list.size(); i++) {
+                    loop->flush_list[i]->pending = false;
+                    if (!loop->flush_list[i]->dead) {
+                        flush_client(loop->flush_list[i]);
+                    }
+                }
+                loop->flush_list.clear();
+                loop->flush_due = false;
+            }
+            if (loop->over_budget) {
+                shed_load(loop);
+            }
+            for (size_t i = 0; i < loop->link_flush.size(); i++) {
+                loop->link_flush[i]->pending = false;
+                flush_link(loop->link_flush[i]);
+            }
+            loop->link_flush.clear();
+        }
+        if (!loop->flush_list.empty() && !loop->flush_armed) {
+            arm_timer(loop->timerfd, flush_delay);
+            loop->flush_armed = true;
+        }
+        if (!loop->presence_rooms.empty() && !loop->presence_armed) {
+            arm_timer(loop->presence_timer, presence_window);
+            loop->presence_armed = true;
+        }
+        loop->stats.queued.store(loop->queued, memory_order_relaxed);
+        loop->stats.messages_out.store(loop->messages_out, memory_order_relaxed);
+        loop->stats.sends.store(loop->sends, memory_order_relaxed);
+        loop->stats.segments.store(loop->segments, memory_order_relaxed);
+        loop->stats.closed_messages.store(loop->closed_messages, memory_order_relaxed);
+        commit_logs(loop);
+        loop->stats.batch_time.add(now_ns() - start);
+
+        if (!loop->dead_list.empty() && !loop->flush_list.empty()) {
+            /* Held output for a client that has gone since: the list must not outlive it */
+            loop->flush_list.erase(remove_if(loop->flush_list.begin(), loop->flush_list.end(),
+                                             [](client_t *c) { return c->dead; }),
+                                   loop->flush_list.end());
+        }
+        for (size_t i = 0; i < loop->dead_list.size(); i++) {
+            delete loop->dead_list[i];
+        }
+        loop->dead_list.clear();
+        for (size_t i = 0; i < loop->dead_links.size(); i++) {
+            delete loop->dead_links[i];
+        }
+        loop->dead_links.clear();
+    }
+
+    return arg;
+}
+
+/* Set one of a loop's timers to go off once, usec from now */
+void arm_timer(int fd, long usec)
+{
+    struct itimerspec when;
+
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = usec / 1000000;
+    when.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(fd, 0, &when, NULL);
+}
+
+void* commit_proc(void *arg)
+{
+    vector<log_sync_t> group;
+    uint64_t start;
+    uint64_t locked;
+
+    while (1) {
+        start = now_ns();
+        pthread_mutex_lock(&commit_lock);
+        locked = now_ns();
+        commit_lock_wait.add(locked - start);
+        while (commit_queue.empty()) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+            /* Asleep in the wait is not holding the lock */
+            locked = now_ns();
+        }
+        group.swap(commit_queue);
+        pthread_mutex_unlock(&commit_lock);
+        start = now_ns();
+        commit_lock_hold.add(start - locked);
+
+        for (size_t i = 0; i < group.size(); i++) {
+            log_sync(group[i]);
+        }
+        /* Segments a loop has finished with are unmapped here, off the loop's thread */
+        group.clear();
+        log_commits.fetch_add(1, memory_order_relaxed);
+        commit_time.add(now_ns() - start);
+    }
+
+    return arg;
+}
+
+/* Hand what this loop's rooms logged during the batch to the committer */
+void commit_logs(loop_t *loop)
+{
+    vector<log_sync_t> syncs;
+
+    if (loop->dirty_rooms.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < loop->dirty_rooms.size(); i++) {
+        loop->dirty_rooms[i]->log->unsynced(syncs);
+        loop->dirty_rooms[i]->log_dirty = false;
+    }
+    loop->dirty_rooms.clear();
+    submit_syncs(syncs);
+}
+
+void submit_syncs(vector<log_sync_t> &syncs)
+{
+    uint64_t start = now_ns();
+    uint64_t locked;
+
+    pthread_mutex_lock(&commit_lock);
+    locked = now_ns();
+    for (size_t i = 0; i < syncs.size(); i++) {
+        commit_queue.push_back(move(syncs[i]));
+    }
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&commit_lock);
+    this_loop->stats.lock_wait.add(locked - start);
+    this_loop->stats.lock_hold.add(now_ns() - locked);
+}
+
+void accept_clients(loop_t *loop)
+{
+    struct epoll_event ev;
+    client_t *client;
+    int newsock;
+    int flag = 1;
+
+    while (1) {
+        newsock = accept4(loop->listensock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && sparefd >= 0) {
+                /* Out of descriptors: accept and shut the connection rather than stall */
+                close(sparefd);
+                newsock = accept(loop->listensock, NULL, NULL);
+                if (newsock >= 0) {
+                    close(newsock);
+                }
+                sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            return;
+        }
+
+        /* Turn off Nagle's algorithm*/
+        setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+
+        client = new client_t(max_line);
+        client->id = next_client_id.fetch_add(1);
+        client->sock = newsock;
+        client->joined = false;
+        client->opstatus = false;
+        client->closing = false;
+        client->pending = false;
+        client->dead = false;
+        client->evicting = false;
+        client->claiming = false;
+        client->binary = false;
+        client->batch = false;
+        client->room = NULL;
+        client->member_index = 0;
+        client->outoff = 0;
+        client->queued = 0;
+        client->reply_mark = 0;
+        client->replying = false;
+        client->skipped = 0;
+        client->messages = 0;
+        add_client(loop, client);
+
+        /*
+         * Edge-triggered in both directions: EPOLLOUT only fires after a
+         * send has filled the socket, so a client that keeps up with its
+         * output never causes an extra wakeup.
+         */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newsock, &ev) < 0) {
+            remove_client(loop, client);
+            close(newsock);
+            delete client;
+        }
+    }
+}
+
+/*
+ * Give a client a slot in the loop's table.  Slots are reused, so a slot
+ * and the client's id together name it: the pair is what a JOIN waiting
+ * on another node keeps to find its client again.
+ */
+void add_client(loop_t *loop, client_t *client)
+{
+    if (loop->free_slots.empty()) {
+        client->slot = loop->clients.size();
+        loop->clients.push_back(client);
+    } else {
+        client->slot = loop->free_slots.back();
+        loop->free_slots.pop_back();
+        loop->clients[client->slot] = client;
+    }
+}
+
+void remove_client(loop_t *loop, client_t *client)
+{
+    loop->clients[client->slot] = NULL;
+    loop->free_slots.push_back(client->slot);
+}
+
+/* Read and act on everything the client has sent; false once it has moved to another loop */
+bool read_client(client_t *client)
+{
+    ssize_t nread;
+
+    while (1) {
+        if (client->claiming) {
+            /* Parked on a CLAIM: what it sends waits in the kernel, not in inbound */
+            return true;
+        }
+        nread = client->inbound.fill(client->sock);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (nread <= 0) {
+            /* If we've lost the client then process it as a QUIT. */
+            drop_client(client);
+            return true;
+        }
+        if (client->closing) {
+            /* QUIT or KICK already ended the session; ignore the rest */
+            client->inbound.clear();
+            continue;
+        }
+        if (!process_input(client)) {
+            return false;
+        }
+    }
+}
+
+/*
+ * Run the complete lines, or frames once the client has switched to the
+ * binary protocol, already buffered; false once the client has moved.
+ */
+bool process_input(client_t *client)
+{
+    char *line;
+    size_t len;
+    int status;
+
+    while (!client->closing && !client->claiming) {
+        if (client->binary) {
+            status = client->inbound.next_frame(&line, &len, FRAME_MAX_BODY);
+        } else {
+            status = client->inbound.next(&line, &len);
+        }
+        if (status == 0) {
+            break;
+        }
+        if (status < 0) {
+            /* Too long to be a command; the client stays and the next line is read */
+            deliver(client, reply_too_long);
+        } else if (client->binary ? !process_frame(client, line, len) : !process_line(client, line, len)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Run one command line; false if it handed the client to another loop */
+bool process_line(client_t *client, const char *buffer, size_t length)
+{
+    cmd_t cmd = parse_command(string_view(buffer, length));
+
+    return run_command(client, find_verb(command_slots, commands, cmd.command), cmd);
+}
+
+/*
+ * Run the commands in one frame from a binary client, through the same
+ * handlers as command lines; false if the client has moved.  A frame that
+ * does not decode is answered once and the rest of it is ignored.
+ */
+bool process_frame(client_t *client, char *body, size_t length)
+{
+    const char *p = body;
+    frame_event_t event;
+    const command_t *command;
+    size_t size;
+    cmd_t cmd;
+    int status = 0;
+
+    while (!client->closing && (status = next_event(&p, body + length, &event)) > 0) {
+        size = 0;
+        for (int i = 0; i < event.count; i++) {
+            /* What other clients, the log and the links see is lines, so a newline in text becomes a space */
+            replace((char *) event.fields[i].data(), (char *) event.fields[i].data() + event.fields[i].length(),
+                    '\n', ' ');
+            size += event.fields[i].length();
+        }
+        if (size > max_line) {
+            deliver(client, reply_too_long);
+            continue;
+        }
+        command = find_id(command_ids, commands, event.id);
+        cmd.command = (command != NULL) ? command->verb : string_view();
+        cmd.op1 = event.fields[0];
+        cmd.op2 = event.fields[1];
+        if (!run_command(client, command, cmd)) {
+            return false;
+        }
+    }
+    if (status < 0) {
+        deliver(client, reply_bad_frame);
+    }
+
+    return true;
+}
+
+/* Run a command, from either protocol; false if it handed the client to another loop */
+bool run_command(client_t *client, const command_t *command, const cmd_t &cmd)
+{
+    payload_t reply;
+    int status;
+
+    /* Where the reply goes: ahead of anything the command itself sends this client */
+    client->reply_mark = client->outbound.size();
+    client->replying = true;
+
+    this_loop->stats.commands.fetch_add(1, memory_order_relaxed);
+
+    if (!client->joined && (command == NULL || !command->before_join)) {
+        reply = reply_must_join;
+    } else if (command == NULL) {
+        reply = reply_unknown_command;
+    } else {
+        uint64_t start = now_ns();
+
+        status = command->handler(cmd, client, reply);
+        /* Charged to the loop it ran on, even if the client has moved on */
+        this_loop->stats.command_time[command->id].add(now_ns() - start);
+        if (status == COMMAND_MOVED) {
+            return false;
+        }
+        if (status == COMMAND_PARKED) {
+            /* The reply comes when the home node answers */
+            client->replying = false;
+            return true;
+        }
+    }
+
+    enqueue(client, client->reply_mark, move(reply));
+    client->replying = false;
+
+    return true;
+}
+
+/* Frame a message from its pieces with a single copy, however many clients it goes to */
+payload_t make_payload(initializer_list<string_view> parts)
+{
+    string framed;
+    size_t length = 1;
+
+    for (string_view part : parts) {
+        length += part.length();
+    }
+    framed.reserve(length);
+    for (string_view part : parts) {
+        framed.append(part);
+    }
+    framed += '\n';
+
+    return make_shared<const string>(move(framed));
+}
+
+/*
+ * Put an event in a loop's inbox.  Posting to our own loop needs no
+ * wakeup since the inbox is drained before the loop sleeps again.
+ */
+void post(loop_t *loop, int type, handle_t *handle, string_view line)
+{
+    event_t *event;
+
+    event = new event_t;
+    event->type = type;
+    event->handle = handle;
+    event->line = line;
+    loop->inbox.push(event);
+    this_loop->stats.posted.fetch_add(1, memory_order_relaxed);
+
+    if (loop != this_loop && !loop->wake_pending.exchange(true)) {
+        this_loop->stats.wakeups.fetch_add(1, memory_order_relaxed);
+        eventfd_write(loop->evfd, 1);
+    }
+}
+
+int drain_inbox(loop_t *loop)
+{
+    mpsc_node *node;
+    event_t *event;
+    int n = 0;
+
+    while ((node = loop->inbox.pop()) != NULL) {
+        event = static_cast<event_t *>(node);
+        n++;
+        switch (event->type) {
+        case EV_ADOPT:
+            adopt_client((client_t *) event->handle, event->line);
+            break;
+        case EV_LINK:
+            adopt_link((link_t *) event->handle);
+            break;
+        }
+        delete event;
+    }
+
+    return n;
+}
+
+/* The loop that owns the named room */
+loop_t *room_owner(string_view name)
+{
+    return loops[hash<string_view>()(name) % nloops];
+}
+
+/*
+ * Hand a client that is joining a room on another loop over to that loop,
+ * along with the JOIN line for it to run there.  After this the client
+ * belongs to the other thread and must not be touched here.
+ */
+void move_client(client_t *client, loop_t *loop, string_view line)
+{
+    vector<client_t *> &flush_list = this_loop->flush_list;
+
+    epoll_ctl(this_loop->epfd, EPOLL_CTL_DEL, client->sock, NULL);
+    remove_client(this_loop, client);
+    if (client->pending) {
+        flush_list.erase(find(flush_list.begin(), flush_list.end(), client));
+        client->pending = false;
+    }
+    /* Its queue goes with it, and is charged to the new loop */
+    budget_return(this_loop, client->queued);
+    post(loop, EV_ADOPT, client, line);
+}
+
+void adopt_client(client_t *client, string_view line)
+{
+    struct epoll_event ev;
+
+    this_loop->stats.adopted.fetch_add(1, memory_order_relaxed);
+    add_client(this_loop, client);
+    budget_take(this_loop, client->queued);
+    /* Adding a socket that is already readable reports it at once, so nothing is missed */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    if (epoll_ctl(this_loop->epfd, EPOLL_CTL_ADD, client->sock, &ev) < 0) {
+        drop_client(client);
+        return;
+    }
+
+    /* The JOIN that brought it here, then whatever it sent after that */
+    process_line(client, line.data(), line.length());
+    process_input(client);
+}
+
+/* Send to every member of a room but one (or none), on this node and the others */
+void broadcast(room_t *room, const payload_t &payload, client_t *except)
+{
+    fan_out(room, payload, except);
+    if (nnodes > 1) {
+        forward_room(room, payload);
+    }
+}
+
+/* Send to the room's members on this node only */
+void fan_out(room_t *room, const payload_t &payload, client_t *except)
+{
+    uint64_t start = now_ns();
+    size_t recipients = 0;
+
+    /* What BATCH clients have been told must stay in order with what they are told now */
+    flush_presence(room);
+    for (size_t i = 0; i < room->members.size(); i++) {
+        if (room->members[i] != except) {
+            deliver(room->members[i], payload);
+            recipients++;
+        }
+    }
+    this_loop->stats.fanout_time.add(now_ns() - start);
+    this_loop->stats.fanout_size.add(recipients);
+}
+
+/*
+ * A JOIN (change '+') or QUIT ('-') in the room: the line for everyone
+ * here but except, and for BATCH clients, one word more in the room's
+ * next PRESENCE instead.  Everyone's PRESENCE is the same payload, so a
+ * storm of N joins costs each of them one line rather than N.
+ */
+void announce(room_t *room, char change, string_view nickname, const payload_t &line, client_t *except)
+{
+    for (size_t i = 0; i < room->members.size(); i++) {
+        if (room->members[i] != except && !room->members[i]->batch) {
+            deliver(room->members[i], line);
+        }
+    }
+    if (room->batch_members == 0) {
+        return;
+    }
+    room->presence.append(1, ' ').append(1, change).append(nickname);
+    if (!room->presence_pending) {
+        room->presence_pending = true;
+        this_loop->presence_rooms.push_back(room);
+    }
+}
+
+/*
+ * Send the room's gathered changes to its BATCH clients.  They apply them
+ * in order, each one saying whether a nickname is in the room or not, so
+ * a change their NAMES already showed does no harm.
+ */
+void flush_presence(room_t *room)
+{
+    string lines;
+
+    if (room->presence.empty()) {
+        return;
+    }
+    append_list(lines, "PRESENCE", room->presence);
+    room->presence.clear();
+
+    payload_t payload = make_shared<const string>(move(lines));
+
+    for (size_t i = 0; i < room->members.size(); i++) {
+        if (room->members[i]->batch) {
+            deliver(room->members[i], payload);
+        }
+    }
+}
+
+/* "verb" and then a list of words, each with a space in front, as lines no longer than ROSTER_LINE */
+void append_list(string &out, string_view verb, string_view list)
+{
+    size_t start = 0;
+    size_t end;
+
+    while (start < list.length()) {
+        end = list.length();
+        if (end - start > ROSTER_LINE) {
+            /* Break before the last word that does not fit; a word too long for any line goes alone */
+            end = list.rfind(' ', start + ROSTER_LINE);
+            if (end == start) {
+                end = min(list.find(' ', start + 1), list.length());
+            }
+        }
+        out.append(verb).append(list.substr(start, end - start)).append(1, '\n');
+        start = end;
+    }
+}
+
+/* Queue a message for a client of this loop and make sure it is flushed after this batch */
+void deliver(client_t *client, const payload_t &payload)
+{
+    enqueue(client, client->outbound.size(), payload);
+}
+
+/*
+ * Put a message at pos in the client's queue and charge it to the budget.
+ * Bytes are counted per queue, so a broadcast counts once for each client
+ * still holding it: more than the memory actually used, never less.
+ */
+void enqueue(client_t *client, size_t pos, outmsg_t msg)
+{
+    size_t length = msg.length;
+
+    if (client->evicting) {
+        return;
+    }
+    msg.binary = client->binary;
+    client->outbound.insert(client->outbound.begin() + pos, move(msg));
+    client->queued += length;
+    client->messages++;
+    this_loop->messages_out++;
+    budget_take(this_loop, length);
+    if (client->queued > queue_bytes || client->outbound.size() > queue_msgs) {
+        /* Only what the socket will not take counts; a client that keeps up is never trimmed */
+        send_queue(client);
+        if (client->queued > queue_bytes || client->outbound.size() > queue_msgs) {
+            trim_queue(client, queue_bytes, queue_msgs);
+        }
+    }
+    if (!client->pending) {
+        client->pending = true;
+        this_loop->flush_list.push_back(client);
+    }
+}
+
+/* Take the message at pos out of the client's queue and give its bytes back */
+void dequeue(client_t *client, size_t pos)
+{
+    size_t length = client->outbound[pos].length;
+
+    client->outbound.erase(client->outbound.begin() + pos);
+    client->queued -= length;
+    budget_return(this_loop, length);
+    if (pos < client->reply_mark) {
+        client->reply_mark--;
+    }
+}
+
+/* Account for bytes queued on a loop, topping its credit up from the pool */
+void budget_take(loop_t *loop, size_t length)
+{
+    long take;
+    long avail;
+
+    loop->queued += length;
+    if (loop->credit < (long) length) {
+        take = BUDGET_CHUNK + length;
+        avail = budget_free.fetch_sub(take, memory_order_relaxed);
+        if (avail < take) {
+            /* Less than a chunk left: take just this message, and see if even that was there */
+            budget_free.fetch_add(BUDGET_CHUNK, memory_order_relaxed);
+            take = length;
+            if (avail < take) {
+                loop->over_budget = true;
+            }
+        }
+        loop->credit += take;
+    }
+    loop->credit -= length;
+}
+
+/* Account for bytes sent or dropped, handing surplus credit back to the pool */
+void budget_return(loop_t *loop, size_t length)
+{
+    loop->queued -= length;
+    loop->credit += length;
+    if (loop->credit > 2 * BUDGET_CHUNK) {
+        budget_free.fetch_add(loop->credit - BUDGET_CHUNK, memory_order_relaxed);
+        loop->credit = BUDGET_CHUNK;
+    }
+}
+
+/*
+ * Apply the policy to a queue holding more than max_bytes or max_msgs,
+ * and drop the client if that does not bring it under.  A message that
+ * has been partly sent stays, or the client would get half a line.
+ */
+void trim_queue(client_t *client, size_t max_bytes, size_t max_msgs)
+{
+    size_t first = (client->outoff > 0) ? 1 : 0;
+    unsigned long dropped = 0;
+
+    if (queue_policy == POLICY_DROP) {
+        while (client->outbound.size() > first && (client->queued > max_bytes || client->outbound.size() > max_msgs)) {
+            dequeue(client, first);
+            dropped++;
+        }
+        this_loop->stats.dropped.fetch_add(dropped, memory_order_relaxed);
+    } else if (queue_policy == POLICY_COALESCE) {
+        coalesce_queue(client);
+    }
+
+    if (client->queued > max_bytes || client->outbound.size() > max_msgs) {
+        evict_client(client);
+    }
+}
+
+/*
+ * Throw away the chat text queued for a client but keep everything that
+ * changes what it knows about the room (JOIN, QUIT, OP, KICK, TOPIC and
+ * replies), then tell it how many messages it missed.  History it asked
+ * for is bounded and is left alone.
+ */
+void coalesce_queue(client_t *client)
+{
+    size_t first = (client->outoff > 0) ? 1 : 0;
+    unsigned long skipped = 0;
+    unsigned long carried = 0;
+    size_t i = first;
+
+    while (i < client->outbound.size()) {
+        const payload_t &payload = client->outbound[i].payload;
+
+        if (payload && (payload->compare(0, 4, "MSG ") == 0 || payload->compare(0, 5, "PMSG ") == 0)) {
+            /* An earlier notice still queued is folded into the new one */
+            if (payload == client->notice) {
+                carried = client->skipped;
+            } else {
+                skipped++;
+            }
+            dequeue(client, i);
+        } else {
+            i++;
+        }
+    }
+    if (skipped + carried == 0) {
+        return;
+    }
+    this_loop->stats.coalesced.fetch_add(skipped, memory_order_relaxed);
+
+    client->skipped = skipped + carried;
+    client->notice = make_payload({ "MSG * ", to_string(client->skipped), " messages skipped" });
+    if (first <= client->reply_mark) {
+        client->reply_mark++;
+    }
+    client->outbound.insert(client->outbound.begin() + first, client->notice);
+    client->outbound[first].binary = client->binary;
+    client->queued += client->notice->length();
+    budget_take(this_loop, client->notice->length());
+}
+
+/*
+ * Drop the client once this batch is over; doing it now could change a
+ * room that is part way through a broadcast.  Nothing more is queued for
+ * it and nothing more it sends is read.
+ */
+void evict_client(client_t *client)
+{
+    if (client->evicting) {
+        return;
+    }
+    client->evicting = true;
+    client->closing = true;
+    this_loop->evict_list.push_back(client);
+    this_loop->stats.disconnected.fetch_add(1, memory_order_relaxed);
+}
+
+/*
+ * The budget is overspent; run once a batch, from the loop.  Hand back
+ * the credit this loop holds, and if the pool is still short, find the
+ * highest level such that cutting every queue on this loop down to it
+ * frees what is missing, and apply the policy to each queue above it.
+ * The longest queues lose the most, but an overrun spread thinly over
+ * many queues is shed as surely as one piled up in a few.
+ */
+void shed_load(loop_t *loop)
+{
+    vector<client_t *> queues;
+    client_t *client;
+    size_t level = 0;
+    size_t below;
+    size_t keep;
+    long deficit;
+    long total = 0;
+
+    loop->over_budget = false;
+    budget_free.fetch_add(loop->credit, memory_order_relaxed);
+    loop->credit = 0;
+    deficit = -budget_free.load(memory_order_relaxed);
+    if (deficit <= 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < loop->clients.size(); i++) {
+        client = loop->clients[i];
+        if (client != NULL && client->queued > 0 && !client->evicting) {
+            queues.push_back(client);
+        }
+    }
+    sort(queues.begin(), queues.end(), [](client_t *a, client_t *b) { return a->queued > b->queued; });
+
+    /* Cutting the i + 1 longest to the next one's length frees total less that much each */
+    for (size_t i = 0; i < queues.size(); i++) {
+        total += queues[i]->queued;
+        below = (i + 1 < queues.size()) ? queues[i + 1]->queued : 0;
+        if (total - (long) ((i + 1) * below) >= deficit) {
+            level = (total - deficit) / (i + 1);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < queues.size() && queues[i]->queued > level; i++) {
+        client = queues[i];
+        /* Much of a queue may only be waiting for the end of the batch; send that first */
+        send_queue(client);
+        if (client->queued > level) {
+            /* A message part way out stays whatever the level, so it is no reason to drop the client */
+            keep = (client->outoff > 0) ? max(level, client->outbound.front().length) : level;
+            trim_queue(client, keep, client->outbound.size());
+        }
+    }
+    budget_free.fetch_add(loop->credit, memory_order_relaxed);
+    loop->credit = 0;
+}
+
+/* Append a room message to the room's log, to be committed after this batch */
+void log_message(room_t *room, const payload_t &payload)
+{
+    if (room->log == NULL || !room->log->append(payload->data(), payload->length())) {
+        return;
+    }
+    this_loop->stats.logged.fetch_add(1, memory_order_relaxed);
+    if (!room->log_dirty) {
+        room->log_dirty = true;
+        this_loop->dirty_rooms.push_back(room);
+    }
+}
+
+/* Queue the last count messages of the client's room, to go straight from the log files */
+size_t replay_history(client_t *client, size_t count)
+{
+    vector<log_range_t> ranges;
+    size_t found;
+
+    if (client->room->log == NULL || count == 0) {
+        return 0;
+    }
+    found = client->room->log->tail(count, ranges);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        enqueue(client, client->outbound.size(), ranges[i]);
+    }
+    this_loop->stats.replayed.fetch_add(found, memory_order_relaxed);
+
+    return found;
+}
+
+/* The named room of this loop, made if create is set and it does not exist yet */
+room_t *find_room(string_view name, bool create)
+{
+    map<string, room_t *, less<>>::iterator room_iter;
+    room_t *room;
+
+    room_iter = this_loop->rooms.find(name);
+    if (room_iter != this_loop->rooms.end()) {
+        return (*room_iter).second;
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    room = new room_t();
+    room->name = name;
+    room->log = NULL;
+    room->log_dirty = false;
+    if (!log_dir.empty()) {
+        /* The log picks up whatever an earlier incarnation of the room left */
+        room->log = new message_log(log_dir, name);
+        if (!room->log->ok()) {
+            fprintf(stderr, "chatsrv: cannot open the log for room %s\n", room->name.c_str());
+            delete room->log;
+            room->log = NULL;
+        }
+    }
+    this_loop->rooms[room->name] = room;
+    this_loop->stats.rooms.fetch_add(1, memory_order_relaxed);
+
+    return room;
+}
+
+/* Drop the room once nobody is left in it, here or on another node */
+void release_room(room_t *room)
+{
+    if (!room->roster.empty()) {
+        return;
+    }
+    if (room->presence_pending) {
+        vector<room_t *> &presence_rooms = this_loop->presence_rooms;
+
+        presence_rooms.erase(find(presence_rooms.begin(), presence_rooms.end(), room));
+    }
+    if (room->log_dirty) {
+        vector<room_t *> &dirty_rooms = this_loop->dirty_rooms;
+        vector<log_sync_t> syncs;
+
+        dirty_rooms.erase(find(dirty_rooms.begin(), dirty_rooms.end(), room));
+        room->log->unsynced(syncs);
+        submit_syncs(syncs);
+    }
+    delete room->log;
+    this_loop->rooms.erase(room->name);
+    this_loop->stats.rooms.fetch_sub(1, memory_order_relaxed);
+    delete room;
+}
+
+/* Whether a nickname is taken in the room by anyone this node knows of */
+bool nick_taken(room_t *room, string_view nickname)
+{
+    return room->roster.find(nickname) >= 0;
+}
+
+void enter_room(client_t *client, room_t *room)
+{
+    client->room = room;
+    client->member_index = room->members.size();
+    room->members.push_back(client);
+    room->roster.insert(client->nickname, member_t{ client, self_node, false, true });
+    if (client->batch) {
+        room->batch_members++;
+    }
+    this_loop->stats.members.fetch_add(1, memory_order_relaxed);
+}
+
+/* Take a client out of its room, and drop the room once nobody is left in it */
+void leave_room(client_t *client)
+{
+    room_t *room = client->room;
+
+    if (room == NULL) {
+        return;
+    }
+    room->roster.erase(room->roster.find(client->nickname));
+    room->members[client->member_index] = room->members.back();
+    room->members[client->member_index]->member_index = client->member_index;
+    room->members.pop_back();
+    if (client->batch) {
+        room->batch_members--;
+    }
+    client->room = NULL;
+    this_loop->stats.members.fetch_sub(1, memory_order_relaxed);
+
+    release_room(room);
+}
+
+/*
+ * Send as much of the queue as the socket takes, gathering up to MAX_IOV
+ * messages per call, and drop the references to whatever went out whole.
+ * sendmsg() rather than writev() so that MSG_NOSIGNAL still applies.
+ * Logged history goes straight from the segment file with sendfile().
+ * 1 once the queue is empty, 0 if the socket is full, -1 on an error.
+ */
+int send_queue(client_t *client)
+{
+    struct iovec iov[MAX_IOV];
+    struct msghdr msg;
+    size_t niov;
+    ssize_t nsent;
+    off_t offset;
+
+    while (!client->outbound.empty()) {
+        if (client->outbound.front().binary) {
+            encode_frame(client);
+        }
+        outmsg_t &front = client->outbound.front();
+
+        if (front.segment) {
+            offset = front.offset + client->outoff;
+            nsent = sendfile(client->sock, front.segment->fd, &offset, front.length - client->outoff);
+        } else {
+            niov = 0;
+            for (deque<outmsg_t>::iterator it = client->outbound.begin();
+                 it != client->outbound.end() && niov < MAX_IOV && !(*it).segment && !(*it).binary; ++it) {
+                iov[niov].iov_base = (void *) (*it).payload->data();
+                iov[niov].iov_len = (*it).length;
+                niov++;
+            }
+            iov[0].iov_base = (char *) iov[0].iov_base + client->outoff;
+            iov[0].iov_len -= client->outoff;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = niov;
+            nsent = sendmsg(client->sock, &msg, MSG_NOSIGNAL);
+        }
+        this_loop->sends++;
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* The socket is full; EPOLLOUT will bring us back */
+                return 0;
+            }
+            return -1;
+        }
+
+        nsent += client->outoff;
+        while (!client->outbound.empty() && (size_t) nsent >= client->outbound.front().length) {
+            nsent -= client->outbound.front().length;
+            dequeue(client, 0);
+        }
+        client->outoff = nsent;
+    }
+
+    return 1;
+}
+
+/*
+ * Replace the binary entries at the front of the client's queue with one
+ * frame holding an event for each of their lines.  Done just before a
+ * send, so one frame carries whatever built up while the socket was busy.
+ * History is copied out of the log, which sendfile() cannot frame.  A
+ * send can come while a reply is still to be placed, and then the frame
+ * stops at reply_mark: what is queued ahead of the reply and what comes
+ * after it are never folded together.
+ */
+void encode_frame(client_t *client)
+{
+    string frame;
+    const char *p;
+    const char *end;
+    const char *nl;
+    size_t at;
+    size_t mark = client->reply_mark;
+    bool ahead = client->replying && mark > 0;
+    size_t folded = 0;
+
+    at = begin_frame(frame);
+    while (!client->outbound.empty() && client->outbound.front().binary && frame.length() < FRAME_BATCH &&
+           (!ahead || folded < mark)) {
+        outmsg_t &front = client->outbound.front();
+
+        p = front.segment ? front.segment->data + front.offset : front.payload->data();
+        end = p + front.length;
+        while (p < end) {
+            nl = (const char *) memchr(p, '\n', end - p);
+            if (nl == NULL) {
+                nl = end;
+            }
+            append_line(frame, string_view(p, nl - p));
+            p = nl + 1;
+        }
+        dequeue(client, 0);
+        folded++;
+    }
+    end_frame(frame, at);
+
+    client->outbound.emplace_front(make_shared<const string>(move(frame)));
+    client->queued += client->outbound.front().length;
+    budget_take(this_loop, client->outbound.front().length);
+    if (ahead) {
+        /* Everything folded was ahead of the reply, and so is the frame */
+        client->reply_mark++;
+    }
+}
+
+/* Send what the client has queued, closing it on an error or once a closing client is done */
+void flush_client(client_t *client)
+{
+    int status;
+
+    this_loop->stats.queue_depth.add(client->outbound.size());
+    this_loop->stats.queue_bytes.add(client->queued);
+    status = send_queue(client);
+
+    if (status < 0 || (status > 0 && client->closing)) {
+        drop_client(client);
+    }
+}
+
+void drop_client(client_t *client)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    payload_t reply;
+
+    if (client->dead) {
+        return;
+    }
+    if (client->joined) {
+        /* If we've lost the client then process it as a QUIT. */
+        quit_command(cmd_t(), client, reply);
+    }
+    remove_client(this_loop, client);
+    budget_return(this_loop, client->queued);
+    client->outbound.clear();
+    client->queued = 0;
+    /* The segments it took are only known to the kernel, and only until the close */
+    if (getsockopt(client->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        this_loop->segments += info.tcpi_data_segs_out;
+        this_loop->closed_messages += client->messages;
+    }
+    /* Closing the descriptor also takes it out of the epoll set */
+    close(client->sock);
+    client->dead = true;
+    this_loop->dead_list.push_back(client);
+}
+
+/* -F: the link address of every node, in node order */
+bool parse_nodes(const char *arg)
+{
+    struct hostent *host;
+    string list = arg;
+    string entry;
+    size_t start = 0;
+    size_t end;
+    size_t colon;
+
+    nnodes = 0;
+    while (start <= list.length()) {
+        end = list.find(',', start);
+        if (end == string::npos) {
+            end = list.length();
+        }
+        entry = list.substr(start, end - start);
+        colon = entry.rfind(':');
+        if (colon == string::npos || nnodes == MAX_NODES) {
+            fprintf(stderr, "chatsrv: nodes are host:port, at most %d of them\n", MAX_NODES);
+            return false;
+        }
+        host = gethostbyname(entry.substr(0, colon).c_str());
+        if (host == NULL) {
+            fprintf(stderr, "chatsrv: unknown host %s\n", entry.substr(0, colon).c_str());
+            return false;
+        }
+        memset(&node_addrs[nnodes], 0, sizeof(struct sockaddr_in));
+        node_addrs[nnodes].sin_family = AF_INET;
+        node_addrs[nnodes].sin_port = htons(atoi(entry.c_str() + colon + 1));
+        memcpy(&node_addrs[nnodes].sin_addr, host->h_addr_list[0], host->h_length);
+        nnodes++;
+        start = end + 1;
+    }
+
+    return true;
+}
+
+long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The node that says who may have which nickname in a room.  room_owner()
+ * takes the hash modulo the loops; the quotient spreads the rooms of each
+ * loop over the nodes.
+ */
+int room_home(string_view name)
+{
+    if (nnodes == 1) {
+        return 0;
+    }
+    return (hash<string_view>()(name) / nloops) % nnodes;
+}
+
+/* Set up this loop's link to every peer; the ones not up yet are retried */
+void start_links(loop_t *loop)
+{
+    link_t *link;
+
+    for (int n = 0; n < nnodes; n++) {
+        if (n == self_node) {
+            continue;
+        }
+        link = new link_t(0);
+        link->node = n;
+        link->sock = -1;
+        link->outgoing = true;
+        link->connected = false;
+        link->pending = false;
+        link->dead = false;
+        link->outoff = 0;
+        loop->out_links[n] = link;
+        connect_link(link);
+    }
+    loop->next_retry = now_ms() + LINK_RETRY;
+}
+
+/* Try the links that are down again, and give up on JOINs that have waited too long */
+void retry_links(loop_t *loop)
+{
+    for (int n = 0; n < nnodes; n++) {
+        if (loop->out_links[n] != NULL && loop->out_links[n]->sock < 0) {
+            connect_link(loop->out_links[n]);
+        }
+    }
+    fail_claims(-1, now_ms());
+    loop->next_retry = now_ms() + LINK_RETRY;
+}
+
+void connect_link(link_t *link)
+{
+    struct epoll_event ev;
+    int flag = 1;
+
+    link->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (link->sock < 0) {
+        return;
+    }
+    /* Frames are batched already; Nagle would only hold the last of a batch back */
+    setsockopt(link->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = link;
+    epoll_ctl(this_loop->epfd, EPOLL_CTL_ADD, link->sock, &ev);
+
+    if (connect(link->sock, (struct sockaddr *) &node_addrs[link->node], sizeof(struct sockaddr_in)) == 0) {
+        link_connected(link);
+    } else if (errno != EINPROGRESS) {
+        close(link->sock);
+        link->sock = -1;
+    }
+}
+
+/*
+ * An outgoing link is up.  Say who we are, then tell the peer about our
+ * members of this loop's rooms: it may have dropped them, or never known.
+ */
+void link_connected(link_t *link)
+{
+    map<string, room_t *, less<>>::iterator room_iter;
+    room_t *room;
+
+    link->connected = true;
+    this_loop->stats.links.fetch_add(1, memory_order_relaxed);
+    link_send(link->node, { "NODE ", to_string(self_node), " ", to_string(this_loop->index), " ", to_string(nloops) });
+    for (room_iter = this_loop->rooms.begin(); room_iter != this_loop->rooms.end(); ++room_iter) {
+        room = (*room_iter).second;
+        for (size_t i = 0; i < room->members.size(); i++) {
+            link_send(link->node, { "ROOM ", room->name, " JOIN ", room->members[i]->nickname });
+            if (room->members[i]->opstatus) {
+                link_send(link->node, { "ROOM ", room->name, " OP ", room->members[i]->nickname });
+            }
+        }
+        if (!room->members.empty() && !room->topic.empty()) {
+            link_send(link->node, { "ROOM ", room->name, " TOPIC * ", room->topic });
+        }
+    }
+}
+
+/*
+ * Close a link.  An outgoing one is retried later; when an accepted one
+ * goes, so does everything we knew of that node's members.
+ */
+void link_down(link_t *link)
+{
+    if (link->outgoing) {
+        if (link->sock < 0) {
+            return;
+        }
+        close(link->sock);
+        link->sock = -1;
+        if (link->connected) {
+            link->connected = false;
+            this_loop->stats.links.fetch_sub(1, memory_order_relaxed);
+        }
+        link->out.clear();
+        link->outoff = 0;
+        /* JOINs waiting on that node will not hear back */
+        fail_claims(link->node, 0);
+        return;
+    }
+
+    if (link->dead) {
+        return;
+    }
+    close(link->sock);
+    link->dead = true;
+    this_loop->dead_links.push_back(link);
+    if (link->node >= 0 && this_loop->in_links[link->node] == link) {
+        this_loop->in_links[link->node] = NULL;
+        drop_node(link->node);
+    }
+}
+
+/* Queue a frame for a peer, to go with the rest of the batch; false if the link is down */
+bool link_send(int node, initializer_list<string_view> parts)
+{
+    link_t *link = this_loop->out_links[node];
+
+    if (link == NULL || !link->connected) {
+        return false;
+    }
+    for (string_view part : parts) {
+        link->out.append(part);
+    }
+    link->out += '\n';
+    this_loop->stats.frames_out.fetch_add(1, memory_order_relaxed);
+    if (!link->pending) {
+        link->pending = true;
+        this_loop->link_flush.push_back(link);
+    }
+
+    return true;
+}
+
+/*
+ * Pass a room line on to the other nodes.  Chat only goes where the room
+ * has members; everything that changes the room goes to every node, so
+ * each one knows who has which nickname.
+ */
+void forward_room(room_t *room, const payload_t &payload)
+{
+    string_view line(payload->data(), payload->length() - 1);
+    bool chat = line.compare(0, 4, "MSG ") == 0;
+
+    for (int n = 0; n < nnodes; n++) {
+        if (n != self_node && (!chat || room->node_members[n] > 0)) {
+            link_send(n, { "ROOM ", room->name, " ", line });
+        }
+    }
+}
+
+/* Send what is batched for a peer; a peer that stops reading has its link reset */
+void flush_link(link_t *link)
+{
+    ssize_t nsent;
+
+    while (link->sock >= 0 && link->outoff < link->out.length()) {
+        nsent = send(link->sock, link->out.data() + link->outoff, link->out.length() - link->outoff, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (link->out.length() - link->outoff > LINK_BUFFER) {
+                    /* Starting over costs the peer a resync, not unbounded memory here */
+                    link_down(link);
+                } else if (link->outoff > link->out.length() / 2) {
+                    link->out.erase(0, link->outoff);
+                    link->outoff = 0;
+                }
+                return;
+            }
+            link_down(link);
+            return;
+        }
+        link->outoff += nsent;
+    }
+    link->out.clear();
+    link->outoff = 0;
+}
+
+void accept_links(loop_t *loop)
+{
+    struct epoll_event ev;
+    link_t *link;
+    int newsock;
+    int flag = 1;
+
+    while (1) {
+        newsock = accept4(link_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+
+        link = new link_t(LINK_MAX_LINE);
+        link->node = -1;
+        link->sock = newsock;
+        link->outgoing = false;
+        link->connected = true;
+        link->pending = false;
+        link->dead = false;
+        link->outoff = 0;
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = link;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newsock, &ev) < 0) {
+            close(newsock);
+            delete link;
+        }
+    }
+}
+
+void link_event(link_t *link, uint32_t events)
+{
+    char buf[256];
+    socklen_t len = sizeof(int);
+    ssize_t nread;
+    int error = 0;
+
+    if (!link->outgoing) {
+        if (!link->dead) {
+            read_link(link);
+        }
+        return;
+    }
+    if (link->sock < 0) {
+        return;
+    }
+
+    if (!link->connected) {
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            getsockopt(link->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+                close(link->sock);
+                link->sock = -1;
+            } else {
+                link_connected(link);
+            }
+        }
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        /* Peers never write on our links, so anything to read is the end of it */
+        while ((nread = recv(link->sock, buf, sizeof(buf), 0)) > 0) {
+        }
+        if (nread == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            link_down(link);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && !link->pending) {
+        link->pending = true;
+        this_loop->link_flush.push_back(link);
+    }
+}
+
+void read_link(link_t *link)
+{
+    ssize_t nread;
+
+    while (1) {
+        nread = link->inbound.fill(link->sock);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (nread <= 0) {
+            link_down(link);
+            return;
+        }
+        if (!process_link(link)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Act on the frames buffered from a peer; false once the link has been
+ * handed to the loop it is for.  The first frame says which that is.
+ */
+bool process_link(link_t *link)
+{
+    const frame_t *frame;
+    cmd_t cmd;
+    char *line;
+    size_t len;
+    int status;
+    int node;
+    int index;
+    int count;
+
+    while (!link->dead && (status = link->inbound.next(&line, &len)) != 0) {
+        if (status < 0) {
+            /* A peer with a longer -m than ours */
+            continue;
+        }
+        this_loop->stats.frames_in.fetch_add(1, memory_order_relaxed);
+
+        if (link->node < 0) {
+            if (sscanf(line, "NODE %d %d %d", &node, &index, &count) != 3 || node < 0 || node >= nnodes ||
+                node == self_node || index < 0 || index >= nloops || count != nloops) {
+                /* Rooms only line up when every node runs the same number of loops */
+                fprintf(stderr, "chatsrv: refused link \"%s\", this is node %d with %d loops\n",
+                        line, self_node, nloops);
+                link_down(link);
+                return true;
+            }
+            link->node = node;
+            if (loops[index] != this_loop) {
+                epoll_ctl(this_loop->epfd, EPOLL_CTL_DEL, link->sock, NULL);
+                post(loops[index], EV_LINK, link, "");
+                return false;
+            }
+            install_link(link);
+            continue;
+        }
+
+        cmd = parse_command(string_view(line, len));
+        frame = find_verb(frame_slots, frames, cmd.command);
+        if (frame != NULL) {
+            frame->handler(link, cmd);
+        }
+    }
+
+    return true;
+}
+
+void adopt_link(link_t *link)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = link;
+    if (epoll_ctl(this_loop->epfd, EPOLL_CTL_ADD, link->sock, &ev) < 0) {
+        close(link->sock);
+        delete link;
+        return;
+    }
+    install_link(link);
+    process_link(link);
+}
+
+/* Make an accepted link the one from its node, replacing any earlier one */
+void install_link(link_t *link)
+{
+    if (this_loop->in_links[link->node] != NULL) {
+        /* The peer reconnected before we saw the old link go; it is about to resync */
+        link_down(this_loop->in_links[link->node]);
+    }
+    this_loop->in_links[link->node] = link;
+}
+
+/* A peer's link in has gone, and as far as we can tell so has everyone on it */
+void drop_node(int node)
+{
+    map<string, room_t *, less<>>::iterator room_iter;
+    vector<room_t *> rooms;
+    room_t *room;
+    string nickname;
+    bool joined;
+
+    for (room_iter = this_loop->rooms.begin(); room_iter != this_loop->rooms.end(); ++room_iter) {
+        rooms.push_back((*room_iter).second);
+    }
+    for (size_t i = 0; i < rooms.size(); i++) {
+        room = rooms[i];
+        /* Removing a member moves the last one into its place, so that place is looked at again */
+        for (size_t m = 0; m < room->roster.size(); ) {
+            if (room->roster[m].node != node) {
+                m++;
+                continue;
+            }
+            nickname = room->roster.name(m);
+            joined = room->roster[m].joined;
+            remove_remote(room, m);
+            if (joined) {
+                announce(room, '-', nickname, make_payload({ "QUIT ", nickname }), NULL);
+            }
+        }
+        release_room(room);
+    }
+}
+
+void add_remote(room_t *room, string_view nickname, int node, bool joined)
+{
+    room->roster.insert(nickname, member_t{ NULL, node, false, joined });
+    if (joined) {
+        room->node_members[node]++;
+    }
+}
+
+void remove_remote(room_t *room, int index)
+{
+    member_t &member = room->roster[index];
+
+    if (member.joined) {
+        room->node_members[member.node]--;
+    }
+    room->roster.erase(index);
+}
+
+/*
+ * A room line from another node: the line its own members were sent.
+ * Ours get it too, and what it says about the room is recorded here.
+ * A line that tells us nothing new is dropped without a word, so that a
+ * peer can repeat its members whenever its link comes back.
+ */
+void remote_line(int node, string_view name, string_view line)
+{
+    cmd_t cmd = parse_command(line);
+    payload_t payload;
+    member_t *member = NULL;
+    client_t *target;
+    room_t *room;
+    bool joined;
+    int index;
+
+    room = find_room(name, cmd.command == "JOIN");
+    if (room == NULL) {
+        return;
+    }
+    index = room->roster.find(cmd.op1);
+    if (index >= 0) {
+        member = &room->roster[index];
+    }
+    payload = make_payload({ line });
+
+    if (cmd.command == "JOIN") {
+        if (member != NULL && member->joined) {
+            return;
+        }
+        if (member == NULL) {
+            add_remote(room, cmd.op1, node, true);
+        } else {
+            /* A nickname we granted as the room's home, now taken up */
+            member->node = node;
+            member->joined = true;
+            room->node_members[node]++;
+        }
+        announce(room, '+', cmd.op1, payload, NULL);
+    } else if (cmd.command == "QUIT") {
+        if (member == NULL || member->client != NULL || member->node != node) {
+            return;
+        }
+        joined = member->joined;
+        remove_remote(room, index);
+        if (joined) {
+            announce(room, '-', cmd.op1, payload, NULL);
+        }
+        release_room(room);
+    } else if (cmd.command == "OP") {
+        if (member == NULL) {
+            return;
+        }
+        bool &op = (member->client != NULL) ? member->client->opstatus : member->op;
+
+        if (op) {
+            return;
+        }
+        op = true;
+        fan_out(room, payload, NULL);
+    } else if (cmd.command == "KICK") {
+        if (member == NULL) {
+            return;
+        }
+        if (member->client != NULL) {
+            target = member->client;
+            fan_out(room, payload, NULL);
+            leave_room(target);
+            target->joined = false;
+            target->closing = true;
+        } else {
+            remove_remote(room, index);
+            fan_out(room, payload, NULL);
+            release_room(room);
+        }
+    } else if (cmd.command == "TOPIC") {
+        if (cmd.op1 == "*" && cmd.op2 == room->topic) {
+            return;
+        }
+        room->topic = cmd.op2;
+        fan_out(room, payload, NULL);
+    } else {
+        fan_out(room, payload, NULL);
+        if (cmd.command == "MSG") {
+            log_message(room, payload);
+        }
+    }
+}
+
+/*
+ * Ask the room's home node for the nickname.  The client is parked until
+ * the answer comes: its JOIN reply, and whatever it sent after the JOIN,
+ * wait for it, so its commands still run in the order it sent them.
+ */
+int claim_nickname(client_t *client, int home, string_view name, string_view nickname, int modes,
+                   payload_t &reply)
+{
+    uint64_t seq = ++this_loop->claim_seq;
+
+    if (!link_send(home, { "CLAIM ", name, " ", nickname, " ", to_string(seq) })) {
+        reply = reply_unavailable;
+        return 0;
+    }
+    this_loop->claims[seq] = { client->id, client->slot, home, string(name), string(nickname), modes, now_ms() + CLAIM_TIMEOUT };
+    this_loop->stats.claims.fetch_add(1, memory_order_relaxed);
+    client->claiming = true;
+    watch_input(client, false);
+
+    return COMMAND_PARKED;
+}
+
+/*
+ * The client waiting on claim seq, which is settled, with the claim in
+ * *taken unless that is NULL; NULL if it has gone in the meantime.
+ */
+client_t *take_claim(uint64_t seq, claim_t *taken)
+{
+    map<uint64_t, claim_t>::iterator claim_iter;
+    client_t *client;
+    uint64_t id;
+    uint32_t slot;
+
+    claim_iter = this_loop->claims.find(seq);
+    if (claim_iter == this_loop->claims.end()) {
+        return NULL;
+    }
+    id = (*claim_iter).second.client_id;
+    slot = (*claim_iter).second.client_slot;
+    if (taken != NULL) {
+        *taken = (*claim_iter).second;
+    }
+    this_loop->claims.erase(claim_iter);
+
+    /* The slot may have been freed since, and given to someone else */
+    client = (slot < this_loop->clients.size()) ? this_loop->clients[slot] : NULL;
+    if (client == NULL || client->id != id || client->closing) {
+        return NULL;
+    }
+    return client;
+}
+
+/*
+ * Give a parked client its JOIN reply, at reply_mark, and go on with what
+ * it sent after.  Watching its socket again reports anything still unread.
+ */
+void finish_claim(client_t *client, const payload_t &reply)
+{
+    client->claiming = false;
+    watch_input(client, true);
+    enqueue(client, client->reply_mark, reply);
+    client->replying = false;
+    process_input(client);
+}
+
+/* Start or stop reading a client's socket; its sends are always watched */
+void watch_input(client_t *client, bool on)
+{
+    struct epoll_event ev;
+
+    ev.events = (on ? EPOLLIN : 0) | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    epoll_ctl(this_loop->epfd, EPOLL_CTL_MOD, client->sock, &ev);
+}
+
+/* Give up on the JOINs waiting on node, and on any that have waited past now */
+void fail_claims(int node, long now)
+{
+    map<uint64_t, claim_t>::iterator claim_iter;
+    vector<uint64_t> failed;
+    client_t *client;
+
+    for (claim_iter = this_loop->claims.begin(); claim_iter != this_loop->claims.end(); ++claim_iter) {
+        if ((*claim_iter).second.home == node || (*claim_iter).second.deadline <= now) {
+            failed.push_back((*claim_iter).first);
+        }
+    }
+    for (size_t i = 0; i < failed.size(); i++) {
+        claim_iter = this_loop->claims.find(failed[i]);
+        if (claim_iter == this_loop->claims.end()) {
+            continue;
+        }
+        claim_t &claim = (*claim_iter).second;
+
+        if (claim.home != node) {
+            /* The answer may have been lost rather than late; let go of the nickname in case */
+            link_send(claim.home, { "ROOM ", claim.room, " QUIT ", claim.nickname });
+        }
+        client = take_claim(failed[i], NULL);
+        if (client != NULL) {
+            client->reply_mark = client->outbound.size();
+            client->replying = true;
+            finish_claim(client, reply_unavailable);
+        }
+    }
+}
+
+/* ROOM room line: a room line from the peer */
+void room_frame(link_t *link, const cmd_t &frame)
+{
+    remote_line(link->node, frame.op1, frame.op2);
+}
+
+/* TO room nickname line: a line for one of our members, a PMSG from the peer's side */
+void to_frame(link_t *link, const cmd_t &frame)
+{
+    room_t *room = find_room(frame.op1, false);
+    size_t space = frame.op2.find(' ');
+    int index;
+
+    if (room == NULL || space == string_view::npos) {
+        return;
+    }
+    index = room->roster.find(frame.op2.substr(0, space));
+    if (index >= 0 && room->roster[index].client != NULL) {
+        deliver(room->roster[index].client, make_payload({ frame.op2.substr(space + 1) }));
+    }
+}
+
+/*
+ * CLAIM room nickname seq: the peer has a JOIN for a room whose home is
+ * here.  A nickname granted is held for it until its JOIN line arrives.
+ */
+void claim_frame(link_t *link, const cmd_t &frame)
+{
+    cmd_t claim = parse_command(frame.op2);
+    room_t *room = find_room(frame.op1, true);
+    bool op;
+
+    if (nick_taken(room, claim.command)) {
+        link_send(link->node, { "DENY ", frame.op1, " ", claim.command, " ", claim.op1 });
+        return;
+    }
+    op = room->roster.empty();
+    add_remote(room, claim.command, link->node, false);
+    if (!link_send(link->node, { "GRANT ", frame.op1, " ", claim.command, " ", claim.op1, op ? " 1" : " 0" })) {
+        release_room(room);
+    }
+}
+
+/* GRANT room nickname seq op: the home node's yes, and whether the joiner starts as an operator */
+void grant_frame(link_t *link, const cmd_t &frame)
+{
+    cmd_t grant = parse_command(frame.op2);
+    client_t *client;
+    claim_t claim;
+    uint64_t seq = 0;
+
+    from_chars(grant.op1.data(), grant.op1.data() + grant.op1.length(), seq);
+    client = take_claim(seq, &claim);
+    if (client == NULL) {
+        /* Gone, or given up on: the home node can have the nickname back */
+        link_send(link->node, { "ROOM ", frame.op1, " QUIT ", grant.command });
+        return;
+    }
+    client->reply_mark = client->outbound.size();
+    client->replying = true;
+    complete_join(client, find_room(frame.op1, true), grant.command, grant.op2 == "1", claim.modes);
+    finish_claim(client, reply_ok);
+}
+
+/* DENY room nickname seq */
+void deny_frame(link_t *link, const cmd_t &frame)
+{
+    cmd_t deny = parse_command(frame.op2);
+    client_t *client;
+    uint64_t seq = 0;
+
+    from_chars(deny.op1.data(), deny.op1.data() + deny.op1.length(), seq);
+    client = take_claim(seq, NULL);
+    if (client != NULL) {
+        client->reply_mark = client->outbound.size();
+        client->replying = true;
+        finish_claim(client, reply_nick_in_use);
+    }
+}
+
+/*
+ * Print the loop counters whenever there has been activity, and in
+ * between answer whoever connects to the stats socket.
+ */
+void report_stats(void)
+{
+    struct pollfd pfd;
+    unsigned long last = 0;
+    long next = now_ms() + STATS_INTERVAL * 1000;
+    long wait;
+
+    /* Without -S the descriptor is -1, which poll() ignores, so it only sleeps */
+    pfd.fd = stats_listen;
+    pfd.events = POLLIN;
+    while (1) {
+        wait = next - now_ms();
+        if (wait > 0) {
+            if (poll(&pfd, 1, wait) > 0) {
+                serve_stats();
+            }
+            continue;
+        }
+        next += STATS_INTERVAL * 1000;
+        print_counters(&last);
+    }
+}
+
+/* The counter report, if the commands counted have changed since *last */
+void print_counters(unsigned long *last)
+{
+    unsigned long commands;
+    unsigned long posted;
+    unsigned long wakeups;
+    unsigned long adopted;
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long disconnected;
+    unsigned long logged;
+    unsigned long replayed;
+    unsigned long frames_out;
+    unsigned long frames_in;
+    unsigned long claims;
+    unsigned long messages_out;
+    unsigned long sends;
+    unsigned long segments;
+    unsigned long closed_messages;
+    long queued;
+    long links;
+
+    messages_out = sends = segments = closed_messages = 0;
+    commands = posted = wakeups = adopted = 0;
+    dropped = coalesced = disconnected = 0;
+    logged = replayed = 0;
+    frames_out = frames_in = claims = 0;
+    queued = links = 0;
+    for (int i = 0; i < nloops; i++) {
+        commands += loops[i]->stats.commands.load(memory_order_relaxed);
+        posted += loops[i]->stats.posted.load(memory_order_relaxed);
+        wakeups += loops[i]->stats.wakeups.load(memory_order_relaxed);
+        adopted += loops[i]->stats.adopted.load(memory_order_relaxed);
+        dropped += loops[i]->stats.dropped.load(memory_order_relaxed);
+        coalesced += loops[i]->stats.coalesced.load(memory_order_relaxed);
+        disconnected += loops[i]->stats.disconnected.load(memory_order_relaxed);
+        queued += loops[i]->stats.queued.load(memory_order_relaxed);
+        logged += loops[i]->stats.logged.load(memory_order_relaxed);
+        replayed += loops[i]->stats.replayed.load(memory_order_relaxed);
+        frames_out += loops[i]->stats.frames_out.load(memory_order_relaxed);
+        frames_in += loops[i]->stats.frames_in.load(memory_order_relaxed);
+        claims += loops[i]->stats.claims.load(memory_order_relaxed);
+        links += loops[i]->stats.links.load(memory_order_relaxed);
+        messages_out += loops[i]->stats.messages_out.load(memory_order_relaxed);
+        sends += loops[i]->stats.sends.load(memory_order_relaxed);
+        segments += loops[i]->stats.segments.load(memory_order_relaxed);
+        closed_messages += loops[i]->stats.closed_messages.load(memory_order_relaxed);
+    }
+    if (commands == *last) {
+        return;
+    }
+    *last = commands;
+    printf("commands %lu posted %lu wakeups %lu moved %lu\n", commands, posted, wakeups, adopted);
+    printf("queued %ld of %ld bytes, dropped %lu coalesced %lu disconnected %lu\n",
+           queued, memory_budget, dropped, coalesced, disconnected);
+    printf("messages out %lu, sends per message %.3f, segments per message %.3f (closed clients)\n",
+           messages_out, messages_out ? (double) sends / messages_out : 0.0,
+           closed_messages ? (double) segments / closed_messages : 0.0);
+    if (!log_dir.empty()) {
+        printf("logged %lu replayed %lu commits %lu\n", logged, replayed,
+               log_commits.load(memory_order_relaxed));
+    }
+    if (nnodes > 1) {
+        printf("node %d of %d: links up %ld of %d, frames out %lu in %lu, claims %lu\n",
+               self_node, nnodes, links, nloops * (nnodes - 1), frames_out, frames_in, claims);
+    }
+    /* How the rooms, and so the work, are spread over the loops */
+    for (int i = 0; i < nloops; i++) {
+        printf("  loop %d: rooms %ld members %ld commands %lu queued %ld\n", i,
+               loops[i]->stats.rooms.load(memory_order_relaxed),
+               loops[i]->stats.members.load(memory_order_relaxed),
+               loops[i]->stats.commands.load(memory_order_relaxed),
+               loops[i]->stats.queued.load(memory_order_relaxed));
+    }
+    fflush(stdout);
+}
+
+/* Write the full report to one connection on the stats socket, then close it */
+void serve_stats(void)
+{
+    struct timeval tv = { 1, 0 };
+    string report;
+    ssize_t nsent;
+    size_t off = 0;
+    int sock;
+
+    sock = accept4(stats_listen, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        return;
+    }
+    /* A reader that never reads must not hold up the counter reports */
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    report = stats_report("");
+    while (off < report.length() &&
+           (nsent = send(sock, report.data() + off, report.length() - off, MSG_NOSIGNAL)) > 0) {
+        off += nsent;
+    }
+    close(sock);
+}
+
+/*
+ * Every counter and histogram, added up over the loops, one per line and
+ * each line starting with prefix.  Any thread may call it; the loops go
+ * on writing while it reads.
+ */
+string stats_report(const string &prefix)
+{
+    hist_summary command_time[FRAME_IDS];
+    hist_summary fanout_time;
+    hist_summary fanout_size;
+    hist_summary queue_depth;
+    hist_summary queue_bytes;
+    hist_summary batch_time;
+    hist_summary lock_wait;
+    hist_summary lock_hold;
+    unsigned long total = 0;
+    unsigned long dropped = 0;
+    unsigned long coalesced = 0;
+    unsigned long disconnected = 0;
+    unsigned long messages_out = 0;
+    unsigned long sends = 0;
+    unsigned long segments = 0;
+    unsigned long closed_messages = 0;
+    long queued = 0;
+    long members = 0;
+    long rooms = 0;
+    string out;
+    char line[256];
+
+    for (int i = 0; i < nloops; i++) {
+        loop_stats_t &stats = loops[i]->stats;
+
+        for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+            command_time[commands[c].id].merge(stats.command_time[commands[c].id]);
+        }
+        fanout_time.merge(stats.fanout_time);
+        fanout_size.merge(stats.fanout_size);
+        queue_depth.merge(stats.queue_depth);
+        queue_bytes.merge(stats.queue_bytes);
+        batch_time.merge(stats.batch_time);
+        lock_wait.merge(stats.lock_wait);
+        lock_hold.merge(stats.lock_hold);
+        total += stats.commands.load(memory_order_relaxed);
+        dropped += stats.dropped.load(memory_order_relaxed);
+        coalesced += stats.coalesced.load(memory_order_relaxed);
+        disconnected += stats.disconnected.load(memory_order_relaxed);
+        queued += stats.queued.load(memory_order_relaxed);
+        messages_out += stats.messages_out.load(memory_order_relaxed);
+        sends += stats.sends.load(memory_order_relaxed);
+        segments += stats.segments.load(memory_order_relaxed);
+        closed_messages += stats.closed_messages.load(memory_order_relaxed);
+        members += stats.members.load(memory_order_relaxed);
+        rooms += stats.rooms.load(memory_order_relaxed);
+    }
+
+    snprintf(line, sizeof(line), "%sserver loops %d rooms %ld members %ld commands %lu\n",
+             prefix.c_str(), nloops, rooms, members, total);
+    out += line;
+    snprintf(line, sizeof(line), "%squeues queued %ld of %ld dropped %lu coalesced %lu disconnected %lu\n",
+             prefix.c_str(), queued, memory_budget, dropped, coalesced, disconnected);
+    out += line;
+    snprintf(line, sizeof(line), "%soutput delay %ldus messages %lu sends %lu closed %lu segments %lu\n",
+             prefix.c_str(), flush_delay, messages_out, sends, closed_messages, segments);
+    out += line;
+    for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+        command_time[commands[c].id].format(out, prefix, string("command.").append(commands[c].verb).c_str(),
+                                            true);
+    }
+    fanout_time.format(out, prefix, "fanout.time", true);
+    fanout_size.format(out, prefix, "fanout.recipients", false);
+    queue_depth.format(out, prefix, "queue.messages", false);
+    queue_bytes.format(out, prefix, "queue.bytes", false);
+    batch_time.format(out, prefix, "loop.batch", true);
+    if (!log_dir.empty()) {
+        hist_summary committer_wait;
+        hist_summary committer_hold;
+        hist_summary commits;
+
+        committer_wait.merge(commit_lock_wait);
+        committer_hold.merge(commit_lock_hold);
+        commits.merge(commit_time);
+        lock_wait.format(out, prefix, "commit_lock.wait.loops", true);
+        lock_hold.format(out, prefix, "commit_lock.hold.loops", true);
+        committer_wait.format(out, prefix, "commit_lock.wait.committer", true);
+        committer_hold.format(out, prefix, "commit_lock.hold.committer", true);
+        commits.format(out, prefix, "commit.time", true);
+    }
+
+    return out;
+}
+
+/* A byte count for an option, with an optional k, m or g suffix */
+size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t size;
+
+    size = strtoul(arg, &end, 10);
+    switch (*end) {
+    case 'g': case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'm': case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'k': case 'K':
+        size *= 1024;
+    }
+
+    return size;
+}
+
+/*
+ * JOIN nickname [room [BINARY] [BATCH]].  Nicknames are unique within a
+ * room.  A JOIN for a room owned by another loop moves the client there
+ * and runs again.  In a cluster, the room's home node decides whether the
+ * nickname is free.
+ *
+ * BINARY asks for the binary protocol of frame.h.  If the JOIN fails its
+ * reply is a line as usual; if it succeeds, everything from its reply on
+ * is frames, in both directions.  A frame starts with a zero byte, which
+ * a reply line never does, so the client can tell which it got.
+ *
+ * BATCH asks for the room's members as NAMES and OPS lists rather than a
+ * JOIN and OP line each, and for later JOINs and QUITs gathered into
+ * PRESENCE lines, which is what keeps a storm of reconnects from costing
+ * every client a line per member.
+ */
+int join_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    string_view name;
+    string_view word;
+    loop_t *owner;
+    room_t *room;
+    size_t space;
+    int modes = 0;
+    int home;
+
+    if (client->joined) {
+        reply = reply_already_joined;
+        return 0;
+    }
+    if (cmd.op1.length() == 0) {
+        reply = reply_invalid_nick;
+        return 0;
+    }
+    name = (cmd.op2.length() > 0) ? cmd.op2 : DEFAULT_ROOM;
+    while ((space = name.rfind(' ')) != string_view::npos) {
+        word = name.substr(space + 1);
+        if (verb_equal(word, "BINARY")) {
+            modes |= JOIN_BINARY;
+        } else if (verb_equal(word, "BATCH")) {
+            modes |= JOIN_BATCH;
+        } else {
+            break;
+        }
+        name = name.substr(0, space);
+    }
+    if (name.empty() || name.find(' ') != string_view::npos) {
+        reply = reply_invalid_room;
+        return 0;
+    }
+
+    owner = room_owner(name);
+    if (owner != this_loop) {
+        move_client(client, owner,
+                    string("JOIN ").append(cmd.op1).append(" ").append(name).append(join_modes(modes)));
+        return COMMAND_MOVED;
+    }
+
+    room = find_room(name, false);
+    if (room != NULL && nick_taken(room, cmd.op1)) {
+        reply = reply_nick_in_use;
+        return 0;
+    }
+    home = room_home(name);
+    if (home != self_node) {
+        return claim_nickname(client, home, name, cmd.op1, modes, reply);
+    }
+
+    room = find_room(name, true);
+    complete_join(client, room, cmd.op1, room->roster.empty(), modes);
+    reply = reply_ok;
+
+    return 1;
+}
+
+/* The words that ask for modes, as they follow a room name */
+string join_modes(int modes)
+{
+    string words;
+
+    if (modes & JOIN_BINARY) {
+        words += " BINARY";
+    }
+    if (modes & JOIN_BATCH) {
+        words += " BATCH";
+    }
+    return words;
+}
+
+/*
+ * Put the client in the room under nickname, and tell it and everyone
+ * else.  A binary client's frames start here: the JOIN reply, put ahead
+ * of the roster, is the first thing it gets in one.
+ */
+void complete_join(client_t *client, room_t *room, string_view nickname, bool op, int modes)
+{
+    string roster;
+    string names;
+    string ops;
+
+    client->joined = true;
+    client->binary = (modes & JOIN_BINARY) != 0;
+    client->batch = (modes & JOIN_BATCH) != 0;
+    client->nickname = nickname;
+    client->opstatus = op;
+    enter_room(client, room);
+    for (size_t i = 0; i < room->roster.size(); i++) {
+        member_t &member = room->roster[i];
+        bool is_op = (member.client != NULL) ? member.client->opstatus : member.op;
+
+        /* A nickname only reserved for a JOIN on another node is nobody yet */
+        if (!member.joined) {
+            continue;
+        }
+        if (client->batch) {
+            names.append(1, ' ').append(room->roster.name(i));
+            if (is_op) {
+                ops.append(1, ' ').append(room->roster.name(i));
+            }
+            continue;
+        }
+        /* Tell the new client which users are already in the room */
+        roster += "JOIN " + room->roster.name(i) + "\n";
+        /* Tell the new client who has operator status */
+        if (is_op) {
+            roster += "OP " + room->roster.name(i) + "\n";
+        }
+    }
+    append_list(roster, "NAMES", names);
+    append_list(roster, "OPS", ops);
+    /* Tell the new client the room topic */
+    roster += "TOPIC * " + room->topic + "\n";
+    deliver(client, make_shared<const string>(move(roster)));
+    /* Then what was said before it arrived */
+    replay_history(client, join_history);
+    /* Tell other clients that a new user has joined */
+    payload_t line = make_payload({ "JOIN ", nickname });
+
+    announce(room, '+', nickname, line, client);
+    if (nnodes > 1) {
+        forward_room(room, line);
+    }
+    if (op && nnodes > 1) {
+        /* Nobody else is in the room to see it, but the other nodes need to know */
+        forward_room(room, make_payload({ "OP ", nickname }));
+    }
+}
+
+int msg_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    payload_t payload = make_payload({ "MSG ", client->nickname, " ", cmd.op1, " ", cmd.op2 });
+
+    broadcast(client->room, payload, NULL);
+    log_message(client->room, payload);
+    reply = reply_ok;
+
+    return 1;
+}
+
+int pmsg_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    room_t *room = client->room;
+    int index = room->roster.find(cmd.op1);
+
+    if (index < 0 || !room->roster[index].joined) {
+        reply = reply_unknown_nick;
+    } else if (room->roster[index].client != NULL) {
+        deliver(room->roster[index].client, make_payload({ "PMSG ", client->nickname, " ", cmd.op2 }));
+        reply = reply_ok;
+    } else {
+        link_send(room->roster[index].node,
+                  { "TO ", room->name, " ", cmd.op1, " PMSG ", client->nickname, " ", cmd.op2 });
+        reply = reply_ok;
+    }
+
+    return 1;
+}
+
+int op_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    int index;
+
+    if (client->opstatus == false) {
+        reply = reply_denied;
+    } else {
+        index = client->room->roster.find(cmd.op1);
+        if (index < 0 || !client->room->roster[index].joined) {
+            reply = reply_unknown_nick;
+            return 1;
+        }
+        member_t &member = client->room->roster[index];
+
+        if (member.client != NULL) {
+            member.client->opstatus = true;
+        } else {
+            /* Its own node hears about it from the broadcast */
+            member.op = true;
+        }
+        broadcast(client->room, make_payload({ "OP ", cmd.op1 }), NULL);
+        reply = reply_ok;
+    }
+
+    return 1;
+}
+
+int kick_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    client_t *target;
+    int index;
+
+    if (client->opstatus == false) {
+        reply = reply_denied;
+    } else {
+        index = client->room->roster.find(cmd.op1);
+        if (index < 0 || !client->room->roster[index].joined) {
+            reply = reply_unknown_nick;
+            return 1;
+        }
+        target = client->room->roster[index].client;
+        if (target == NULL) {
+            /* Its own node closes it on seeing the KICK */
+            broadcast(client->room, make_payload({ "KICK ", cmd.op1, " ", client->nickname }), NULL);
+            remove_remote(client->room, index);
+            reply = reply_ok;
+        } else {
+            /* The kicked client gets its KICK line too, then is closed once that is sent */
+            broadcast(client->room, make_payload({ "KICK ", cmd.op1, " ", client->nickname }), NULL);
+            leave_room(target);
+            target->joined = false;
+            target->closing = true;
+            reply = reply_ok;
+        }
+    }
+
+    return 1;
+}
+
+int topic_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    room_t *room = client->room;
+
+    if (client->opstatus == false) {
+        reply = reply_denied;
+    } else {
+        room->topic = cmd.op1;
+        if (cmd.op2.length() != 0) {
+            room->topic += " ";
+            room->topic += cmd.op2;
+        }
+        broadcast(room, make_payload({ "TOPIC ", client->nickname, " ", room->topic }), NULL);
+        reply = reply_ok;
+    }
+
+    return 1;
+}
+
+/* QUIT, and also what happens when a joined client is lost */
+int quit_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    payload_t line = make_payload({ "QUIT ", client->nickname });
+
+    announce(client->room, '-', client->nickname, line, client);
+    if (nnodes > 1) {
+        forward_room(client->room, line);
+    }
+    leave_room(client);
+    client->joined = false;
+    client->closing = true;
+    reply = reply_ok;
+
+    return 1;
+}
+
+/* HISTORY [count].  The room's last messages as they were sent, from its log */
+int history_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    size_t count = join_history;
+
+    if (client->room->log == NULL) {
+        reply = reply_no_history;
+        return 1;
+    }
+    if (cmd.op1.length() > 0) {
+        from_chars(cmd.op1.data(), cmd.op1.data() + cmd.op1.length(), count);
+    }
+    replay_history(client, min(count, (size_t) HISTORY_MAX));
+    reply = reply_ok;
+
+    return 1;
+}
+
+/* STATS key.  The server's counters and latency histograms, for an operator with the admin key */
+int stats_command(const cmd_t &cmd, client_t *client, payload_t &reply)
+{
+    if (admin_key.empty() || cmd.op1 != admin_key) {
+        reply = reply_denied;
+        return 1;
+    }
+    deliver(client, make_shared<const string>(stats_report("STATS ")));
+    reply = reply_ok;
+
+    return 1;
+}
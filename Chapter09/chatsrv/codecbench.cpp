@@ -0,0 +1,385 @@
+/* codecbench.cpp */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "linebuf.h"
+#include "frame.h"
+
+using namespace std;
+
+/* #define's */
+#define BENCH_PORT      5297
+#define MAX_EVENTS      256
+/* Largest frame a client here will take from the server */
+#define MAX_FRAME       (16 * 1024 * 1024)
+/* Give up on a round that makes no progress for this long */
+#define ROUND_TIMEOUT   10
+
+/*
+ * Server CPU per message, text protocol against binary.  The benchmark
+ * starts its own chatsrv with one loop, so that the CPU time it reads
+ * from /proc is the chat work and nothing else, then runs the same load
+ * twice: every client in one room sends a burst of messages per round,
+ * as lines or as one frame of events, and the round ends once everyone
+ * has received everything.  Both protocols go through the same command
+ * handlers; what differs is the parsing on the way in and the framing on
+ * the way out.
+ */
+
+/* Structures */
+struct peer_t {
+    int sock;
+    bool binary;
+    bool joined;
+    unsigned long received;     /* MSG lines or events */
+    unsigned long bytes;
+    line_buffer *in;
+};
+
+/* Globals */
+const char *server = "./chatsrv";
+int port = BENCH_PORT;
+int nclients = 50;
+int nrounds = 200;
+int burst = 16;
+int msgsize = 32;
+int epfd;
+pid_t srvpid;
+
+/* Forward declarations */
+bool run(bool binary);
+peer_t *connect_peer(const string &join, bool binary);
+bool read_peer(peer_t *peer);
+bool wait_for(vector<peer_t *> &peers, unsigned long want);
+double server_cpu(void);
+double now(void);
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:p:c:r:b:s:")) != -1) {
+        switch (opt) {
+        case 'x':
+            server = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'r':
+            nrounds = atoi(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 's':
+            msgsize = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: codecbench [-x chatsrv] [-p port] [-c clients] [-r rounds]\n"
+                            "                  [-b messages per client per round] [-s message bytes]\n");
+            return 1;
+        }
+    }
+    if (nclients < 1 || nrounds < 1 || burst < 1 || msgsize < 1 || msgsize > 1000) {
+        fprintf(stderr, "codecbench: counts must be positive, message size at most 1000\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srvpid = fork();
+    if (srvpid == 0) {
+        string portarg = to_string(port);
+        int null = open("/dev/null", O_WRONLY);
+
+        /* Its counter reports would get in the way of the table */
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, "-t", "1", "-P", portarg.c_str(), (char *) NULL);
+        perror("codecbench: exec");
+        _exit(1);
+    }
+    epfd = epoll_create1(0);
+
+    printf("%d clients in a room, %d rounds of %d messages each, %d bytes of text\n",
+           nclients, nrounds, burst, msgsize);
+    printf("%-8s %10s %12s %10s %12s %12s %12s\n", "protocol", "messages", "deliveries", "cpu s",
+           "us/message", "ns/delivery", "bytes/deliv");
+    if (!run(false) || !run(true)) {
+        kill(srvpid, SIGTERM);
+        return 1;
+    }
+
+    kill(srvpid, SIGTERM);
+    waitpid(srvpid, NULL, 0);
+    return 0;
+}
+
+/* One protocol's run, in a room of its own */
+bool run(bool binary)
+{
+    vector<peer_t *> peers;
+    string room = binary ? "codec-binary" : "codec-text";
+    string text(msgsize, 'x');
+    string burst_out;
+    unsigned long messages;
+    unsigned long deliveries;
+    unsigned long bytes = 0;
+    double cpu;
+    double start;
+    size_t at;
+
+    for (int i = 0; i < nclients; i++) {
+        peer_t *peer = connect_peer("c" + to_string(i) + " " + room, binary);
+
+        if (peer == NULL) {
+            return false;
+        }
+        peers.push_back(peer);
+    }
+    /* Everyone has seen everyone join, so the fan-out is the full room from the first round */
+    if (!wait_for(peers, nclients)) {
+        return false;
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i]->received = 0;
+        peers[i]->bytes = 0;
+    }
+
+    /* The same burst from every client: a run of lines, or a frame of events */
+    if (binary) {
+        string_view field = text;
+
+        at = begin_frame(burst_out);
+        for (int i = 0; i < burst; i++) {
+            append_event(burst_out, ID_MSG, &field, 1);
+        }
+        end_frame(burst_out, at);
+    } else {
+        for (int i = 0; i < burst; i++) {
+            burst_out += "MSG " + text + "\n";
+        }
+    }
+
+    cpu = server_cpu();
+    start = now();
+    for (int r = 0; r < nrounds; r++) {
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (send(peers[i]->sock, burst_out.data(), burst_out.length(), MSG_NOSIGNAL) !=
+                (ssize_t) burst_out.length()) {
+                fprintf(stderr, "codecbench: could not send\n");
+                return false;
+            }
+        }
+        if (!wait_for(peers, (unsigned long) (r + 1) * burst * nclients)) {
+            return false;
+        }
+    }
+    cpu = server_cpu() - cpu;
+
+    messages = (unsigned long) nrounds * burst * nclients;
+    deliveries = messages * nclients;
+    for (size_t i = 0; i < peers.size(); i++) {
+        bytes += peers[i]->bytes;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, peers[i]->sock, NULL);
+        close(peers[i]->sock);
+        delete peers[i]->in;
+        delete peers[i];
+    }
+    printf("%-8s %10lu %12lu %10.2f %12.2f %12.1f %12.1f   (%.1fs wall)\n", binary ? "binary" : "text",
+           messages, deliveries, cpu, cpu * 1e6 / messages, cpu * 1e9 / deliveries,
+           (double) bytes / deliveries, now() - start);
+
+    return true;
+}
+
+/* Connect, retrying while the server starts, and send the JOIN line */
+peer_t *connect_peer(const string &join, bool binary)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    peer_t *peer;
+    string line = "JOIN " + join + (binary ? " BINARY\n" : "\n");
+    int flag = 1;
+    int tries = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    peer = new peer_t;
+    while (1) {
+        peer->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connect(peer->sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(peer->sock);
+        if (++tries == 50) {
+            perror("codecbench: connect");
+            return NULL;
+        }
+        usleep(100000);
+    }
+    setsockopt(peer->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    send(peer->sock, line.data(), line.length(), MSG_NOSIGNAL);
+    fcntl(peer->sock, F_SETFL, O_NONBLOCK);
+    peer->binary = binary;
+    peer->joined = false;
+    peer->received = 0;
+    peer->bytes = 0;
+    peer->in = new line_buffer(MAX_FRAME);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = peer;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, peer->sock, &ev);
+
+    return peer;
+}
+
+/*
+ * Read what a connection has, counting MSG and JOIN lines, or events
+ * once a binary client's frames start.  False on a lost connection or a
+ * refused JOIN.
+ */
+bool read_peer(peer_t *peer)
+{
+    frame_event_t event;
+    const char *p;
+    char *data;
+    size_t len;
+    ssize_t nread;
+    int status;
+    char first;
+
+    /* A binary JOIN is answered by a frame, which starts with a zero byte, or refused by a line */
+    if (!peer->joined && peer->binary && recv(peer->sock, &first, 1, MSG_PEEK) == 1 && first == 0) {
+        peer->joined = true;
+    }
+    while ((nread = peer->in->fill(peer->sock)) > 0) {
+        peer->bytes += nread;
+        while (1) {
+            if (peer->binary && peer->joined) {
+                status = peer->in->next_frame(&data, &len, MAX_FRAME);
+            } else {
+                status = peer->in->next(&data, &len);
+            }
+            if (status <= 0) {
+                if (status < 0) {
+                    fprintf(stderr, "codecbench: oversized input\n");
+                    return false;
+                }
+                break;
+            }
+            if (!peer->joined) {
+                if (peer->binary || strcmp(data, "100 OK") != 0) {
+                    fprintf(stderr, "codecbench: JOIN refused: %s\n", data);
+                    return false;
+                }
+                peer->joined = true;
+                continue;
+            }
+            if (!peer->binary) {
+                if (strncmp(data, "MSG ", 4) == 0 || strncmp(data, "JOIN ", 5) == 0) {
+                    peer->received++;
+                }
+                continue;
+            }
+            p = data;
+            while (next_event(&p, data + len, &event) > 0) {
+                if (event.id == ID_MSG || event.id == ID_JOIN) {
+                    peer->received++;
+                }
+            }
+        }
+    }
+
+    return nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/* Read until every peer has received want lines or events */
+bool wait_for(vector<peer_t *> &peers, unsigned long want)
+{
+    struct epoll_event events[MAX_EVENTS];
+    double last = now();
+    bool done;
+    int nready;
+
+    while (1) {
+        done = true;
+        for (size_t i = 0; i < peers.size() && done; i++) {
+            done = peers[i]->received >= want;
+        }
+        if (done) {
+            return true;
+        }
+
+        nready = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < nready; i++) {
+            peer_t *peer = (peer_t *) events[i].data.ptr;
+
+            if (!read_peer(peer)) {
+                fprintf(stderr, "codecbench: lost a connection\n");
+                return false;
+            }
+        }
+        if (nready > 0) {
+            last = now();
+        } else if (now() - last > ROUND_TIMEOUT) {
+            fprintf(stderr, "codecbench: timed out\n");
+            return false;
+        }
+    }
+}
+
+/* User and system time the server has used, in seconds */
+double server_cpu(void)
+{
+    char path[64];
+    char buf[1024];
+    unsigned long utime;
+    unsigned long stime;
+    char *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) srvpid);
+    f = fopen(path, "r");
+    if (f == NULL || fgets(buf, sizeof(buf), f) == NULL) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 0;
+    }
+    fclose(f);
+    /* Fields 14 and 15, counted after the command name, which may hold spaces */
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,110 @@
+/* command.h */
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+#include <array>
+#include <string_view>
+
+/* Slots in a verb table; a power of two */
+#define VERB_SLOTS      32
+
+/*
+ * A command line split into its verb and up to two operands.  The views
+ * point into the line itself, so parsing copies and allocates nothing;
+ * they are only good while the line is.
+ */
+struct cmd_t {
+    std::string_view command;
+    std::string_view op1;
+    std::string_view op2;
+};
+
+/*
+ * Split at the first two spaces, the rest of the line being op2, exactly
+ * as decodeCommand() did.  The verb keeps its case; verb lookup ignores it.
+ */
+inline cmd_t parse_command(std::string_view line)
+{
+    cmd_t cmd;
+    size_t space;
+
+    space = line.find(' ');
+    cmd.command = line.substr(0, space);
+    if (space == std::string_view::npos) {
+        return cmd;
+    }
+    line.remove_prefix(space + 1);
+    space = line.find(' ');
+    cmd.op1 = line.substr(0, space);
+    if (space != std::string_view::npos) {
+        cmd.op2 = line.substr(space + 1);
+    }
+
+    return cmd;
+}
+
+constexpr char verb_upper(char c)
+{
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+/*
+ * First letter, last letter and length are enough to tell the chat verbs
+ * apart.  build_verb_slots() refuses to compile a table where two verbs
+ * share a slot, so a new verb that collides shows up at build time.
+ */
+constexpr unsigned int verb_hash(std::string_view verb)
+{
+    if (verb.empty()) {
+        return 0;
+    }
+    return (verb_upper(verb[0]) + 3 * verb_upper(verb[verb.size() - 1]) + 2 * verb.size()) & (VERB_SLOTS - 1);
+}
+
+constexpr bool verb_equal(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (verb_upper(a[i]) != verb_upper(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Map each hash slot to its entry's index, or -1; entries need a verb member */
+template <typename E, size_t N>
+constexpr std::array<int, VERB_SLOTS> build_verb_slots(const E (&entries)[N])
+{
+    std::array<int, VERB_SLOTS> slots{};
+
+    for (size_t i = 0; i < VERB_SLOTS; i++) {
+        slots[i] = -1;
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (slots[verb_hash(entries[i].verb)] != -1) {
+            throw "two verbs hash to the same slot";
+        }
+        slots[verb_hash(entries[i].verb)] = i;
+    }
+
+    return slots;
+}
+
+/* One hash, one comparison: the entry for verb, or NULL */
+template <typename E, size_t N>
+inline const E *find_verb(const std::array<int, VERB_SLOTS> &slots, const E (&entries)[N],
+                          std::string_view verb)
+{
+    int index = slots[verb_hash(verb)];
+
+    if (index < 0 || !verb_equal(entries[index].verb, verb)) {
+        return NULL;
+    }
+    return &entries[index];
+}
+
+#endif
@@ -0,0 +1,345 @@
+/* fedbench.cpp */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "linebuf.h"
+
+using namespace std;
+
+/* #define's */
+#define MAX_NODES       16
+#define MAX_EVENTS      256
+#define MAX_LINE_BUFF   1024
+/* Give up on a phase that makes no progress for this long */
+#define PHASE_TIMEOUT   10
+
+/*
+ * Cross-node fan-out latency for a chatsrv cluster.  One sender on the
+ * first node and listeners on every node join the same room; the sender
+ * then sends timestamped messages at a steady pace, and each listener
+ * notes how long each took to reach it.  Listeners on the first node see
+ * plain local fan-out, the others fan-out through the inter-node link,
+ * so the difference between the two is what the link costs.  Everything
+ * runs on one host, so the timestamps share a clock.
+ */
+
+/* Structures */
+struct peer_t {
+    int sock;
+    int node;
+    bool listener;              /* times what it receives; otherwise the sender */
+    bool joined;
+    unsigned long received;     /* MSG lines seen; for the sender, listeners seen to join */
+    line_buffer *in;
+};
+
+/* Globals */
+vector<struct sockaddr_in> nodes;
+int listeners = 20;
+int nmessages = 1000;
+long interval = 1000;           /* microseconds between messages */
+const char *room = "bench";
+int epfd;
+
+/* Forward declarations */
+bool parse_nodes(const char *arg);
+peer_t *connect_peer(int node, const string &join);
+bool read_peer(peer_t *peer, vector<vector<long>> &latency);
+long now_ns(void);
+void report(const char *label, vector<long> &samples);
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit rl;
+    vector<peer_t *> peers;
+    vector<vector<long>> latency;
+    vector<long> remote;
+    peer_t *sender;
+    string line;
+    long next;
+    long last;
+    long wait;
+    int sent;
+    int nready;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:m:i:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            if (!parse_nodes(optarg)) {
+                return 1;
+            }
+            break;
+        case 's':
+            listeners = atoi(optarg);
+            break;
+        case 'm':
+            nmessages = atoi(optarg);
+            break;
+        case 'i':
+            interval = atol(optarg);
+            break;
+        case 'r':
+            room = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: fedbench [-n host:port,... client port of each node] [-s listeners per node]\n"
+                            "                [-m messages] [-i interval us] [-r room]\n");
+            return 1;
+        }
+    }
+    if (nodes.empty() && !parse_nodes("127.0.0.1:5296")) {
+        return 1;
+    }
+    if (listeners < 1 || nmessages < 1 || interval < 0) {
+        fprintf(stderr, "fedbench: counts must be positive\n");
+        return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    epfd = epoll_create1(0);
+    latency.resize(nodes.size());
+
+    /* The sender first, so that it sees every listener's JOIN arrive */
+    sender = connect_peer(0, "JOIN sender" + to_string(getpid()) + " " + room);
+    if (sender == NULL) {
+        return 1;
+    }
+    for (size_t n = 0; n < nodes.size(); n++) {
+        for (int i = 0; i < listeners; i++) {
+            peer_t *peer = connect_peer(n, "JOIN l" + to_string(n) + "_" + to_string(i) + "_" +
+                                           to_string(getpid()) + " " + room);
+            if (peer == NULL) {
+                return 1;
+            }
+            peers.push_back(peer);
+        }
+    }
+
+    /*
+     * Wait until the sender has seen every listener join.  Then its node
+     * knows where the room's members are, and the messages reach them all.
+     */
+    last = now_ns();
+    while (sender->received < peers.size()) {
+        nready = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < nready; i++) {
+            if (!read_peer((peer_t *) events[i].data.ptr, latency)) {
+                fprintf(stderr, "fedbench: lost a connection while joining\n");
+                return 1;
+            }
+        }
+        if (nready > 0) {
+            last = now_ns();
+        } else if (now_ns() - last > PHASE_TIMEOUT * 1000000000L) {
+            fprintf(stderr, "fedbench: %lu of %lu listeners seen to join\n", sender->received, peers.size());
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        peers[i]->received = 0;
+    }
+
+    /* Paced, so that what is measured is delivery rather than a queue building up */
+    sent = 0;
+    next = now_ns();
+    last = next;
+    while (1) {
+        if (sent < nmessages && now_ns() >= next) {
+            line = "MSG ping " + to_string(sent) + " " + to_string(now_ns()) + "\n";
+            if (send(sender->sock, line.data(), line.length(), MSG_NOSIGNAL) != (ssize_t) line.length()) {
+                fprintf(stderr, "fedbench: could not send\n");
+                return 1;
+            }
+            sent++;
+            next += interval * 1000;
+        }
+        if (sent == nmessages) {
+            bool done = true;
+
+            for (size_t i = 0; i < peers.size() && done; i++) {
+                done = peers[i]->received == (unsigned long) nmessages;
+            }
+            if (done) {
+                break;
+            }
+        }
+
+        wait = (sent < nmessages) ? max(0L, (next - now_ns()) / 1000000) : 1000;
+        nready = epoll_wait(epfd, events, MAX_EVENTS, wait);
+        for (int i = 0; i < nready; i++) {
+            if (!read_peer((peer_t *) events[i].data.ptr, latency)) {
+                fprintf(stderr, "fedbench: lost a connection\n");
+                return 1;
+            }
+        }
+        if (nready > 0) {
+            last = now_ns();
+        } else if (now_ns() - last > PHASE_TIMEOUT * 1000000000L) {
+            fprintf(stderr, "fedbench: timed out waiting for messages\n");
+            return 1;
+        }
+    }
+
+    printf("%lu nodes, %d listeners each, %d messages every %ld us; latency in us\n",
+           nodes.size(), listeners, nmessages, interval);
+    printf("%-16s %9s %9s %9s %9s %9s\n", "", "deliveries", "p50", "p90", "p99", "max");
+    report("node 0 (local)", latency[0]);
+    for (size_t n = 1; n < nodes.size(); n++) {
+        char label[32];
+
+        snprintf(label, sizeof(label), "node %lu", n);
+        report(label, latency[n]);
+        remote.insert(remote.end(), latency[n].begin(), latency[n].end());
+    }
+    if (nodes.size() > 1) {
+        report("all remote", remote);
+    }
+
+    return 0;
+}
+
+/* -n: the client address of every node, in node order */
+bool parse_nodes(const char *arg)
+{
+    struct sockaddr_in addr;
+    struct hostent *host;
+    string list = arg;
+    string entry;
+    size_t start = 0;
+    size_t end;
+    size_t colon;
+
+    nodes.clear();
+    while (start <= list.length()) {
+        end = list.find(',', start);
+        if (end == string::npos) {
+            end = list.length();
+        }
+        entry = list.substr(start, end - start);
+        colon = entry.rfind(':');
+        if (colon == string::npos || nodes.size() == MAX_NODES) {
+            fprintf(stderr, "fedbench: nodes are host:port, at most %d of them\n", MAX_NODES);
+            return false;
+        }
+        host = gethostbyname(entry.substr(0, colon).c_str());
+        if (host == NULL) {
+            fprintf(stderr, "fedbench: unknown host %s\n", entry.substr(0, colon).c_str());
+            return false;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(entry.c_str() + colon + 1));
+        memcpy(&addr.sin_addr, host->h_addr_list[0], host->h_length);
+        nodes.push_back(addr);
+        start = end + 1;
+    }
+
+    return true;
+}
+
+/* Connect to a node and send the JOIN line; the reply is picked up later */
+peer_t *connect_peer(int node, const string &join)
+{
+    struct epoll_event ev;
+    peer_t *peer;
+    string line = join + "\n";
+    int flag = 1;
+
+    peer = new peer_t;
+    peer->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connect(peer->sock, (struct sockaddr *) &nodes[node], sizeof(struct sockaddr_in)) < 0) {
+        perror("fedbench");
+        return NULL;
+    }
+    setsockopt(peer->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    send(peer->sock, line.data(), line.length(), MSG_NOSIGNAL);
+    fcntl(peer->sock, F_SETFL, O_NONBLOCK);
+    peer->node = node;
+    peer->listener = join.compare(0, 6, "JOIN l") == 0;
+    peer->joined = false;
+    peer->received = 0;
+    peer->in = new line_buffer(MAX_LINE_BUFF);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = peer;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, peer->sock, &ev);
+
+    return peer;
+}
+
+/*
+ * Read what a connection has.  The sender counts JOIN lines, listeners
+ * time MSG lines by the send time at their end.  False on a lost
+ * connection or a JOIN that was refused.
+ */
+bool read_peer(peer_t *peer, vector<vector<long>> &latency)
+{
+    const char *stamp;
+    char *line;
+    size_t len;
+    ssize_t nread;
+    int status;
+
+    while ((nread = peer->in->fill(peer->sock)) > 0) {
+        while ((status = peer->in->next(&line, &len)) != 0) {
+            if (status < 0) {
+                continue;
+            }
+            if (!peer->joined) {
+                if (strncmp(line, "100 OK", 6) != 0) {
+                    fprintf(stderr, "fedbench: JOIN refused: %s\n", line);
+                    return false;
+                }
+                peer->joined = true;
+            } else if (strncmp(line, "JOIN l", 6) == 0) {
+                peer->received++;
+            } else if (peer->listener && strncmp(line, "MSG ", 4) == 0 && (stamp = strrchr(line, ' ')) != NULL) {
+                latency[peer->node].push_back(now_ns() - atol(stamp + 1));
+                peer->received++;
+            }
+        }
+    }
+
+    return nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void report(const char *label, vector<long> &samples)
+{
+    size_t n = samples.size();
+
+    if (n == 0) {
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    printf("%-16s %9lu %9.1f %9.1f %9.1f %9.1f\n", label, n,
+           samples[n / 2] / 1e3, samples[n * 9 / 10] / 1e3, samples[n * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
@@ -0,0 +1,216 @@
+/* frame.h */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <string_view>
+#include "command.h"
+
+/*
+ * The binary protocol, for clients that ask for it at JOIN.  A frame is
+ * a 4-byte body length and a body of one or more events, so a batch of
+ * events costs one header.  An event is a command id byte, a field count
+ * byte, a 2-byte length for each field, then the fields back to back.
+ * Numbers are big-endian.  Nothing is escaped and nothing is scanned for:
+ * where a field ends is read, not searched for.
+ */
+
+/* Bytes of frame header; the most fields an event has */
+#define FRAME_HEADER        4
+#define FRAME_FIELDS        3
+/* Longest frame body a client may send */
+#define FRAME_MAX_BODY      (64 * 1024)
+/* Ids below this */
+#define FRAME_IDS           16
+
+/* Event ids.  A client's commands use the ids of their verbs */
+#define ID_LINE         0   /* any other line, whole */
+#define ID_JOIN         1
+#define ID_MSG          2
+#define ID_PMSG         3
+#define ID_OP           4
+#define ID_KICK         5
+#define ID_TOPIC        6
+#define ID_QUIT         7
+#define ID_HISTORY      8
+#define ID_REPLY        9   /* a numbered reply such as "100 OK", whole */
+#define ID_STATS        10
+#define ID_NAMES        11  /* a roster snapshot for a BATCH client, names spaced */
+#define ID_OPS          12
+#define ID_PRESENCE     13  /* joins and quits gathered for it, "+nick" and "-nick" spaced */
+
+/* An event taken off a frame; the fields point into the frame */
+struct frame_event_t {
+    int id;
+    int count;
+    std::string_view fields[FRAME_FIELDS];
+};
+
+/* How the server's lines map to events: the verb, its id, and how many fields the rest splits into */
+struct event_verb_t {
+    std::string_view verb;
+    int id;
+    int fields;
+};
+
+constexpr event_verb_t event_verbs[] = {
+    { "JOIN",  ID_JOIN,  1 },
+    { "MSG",   ID_MSG,   2 },
+    { "PMSG",  ID_PMSG,  2 },
+    { "OP",    ID_OP,    1 },
+    { "KICK",  ID_KICK,  2 },
+    { "TOPIC", ID_TOPIC, 2 },
+    { "QUIT",  ID_QUIT,  1 },
+    { "NAMES", ID_NAMES, 1 },
+    { "OPS",   ID_OPS,   1 },
+    { "PRESENCE", ID_PRESENCE, 1 },
+};
+constexpr std::array<int, VERB_SLOTS> event_slots = build_verb_slots(event_verbs);
+
+/* Map each id to its entry's index, or -1; entries need an id member */
+template <typename E, size_t N>
+constexpr std::array<int, FRAME_IDS> build_id_slots(const E (&entries)[N])
+{
+    std::array<int, FRAME_IDS> slots{};
+
+    for (size_t i = 0; i < FRAME_IDS; i++) {
+        slots[i] = -1;
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (entries[i].id < 0 || entries[i].id >= FRAME_IDS || slots[entries[i].id] != -1) {
+            throw "ids must be distinct and below FRAME_IDS";
+        }
+        slots[entries[i].id] = i;
+    }
+
+    return slots;
+}
+
+/* The entry for id, or NULL */
+template <typename E, size_t N>
+inline const E *find_id(const std::array<int, FRAME_IDS> &slots, const E (&entries)[N], int id)
+{
+    if (id < 0 || id >= FRAME_IDS || slots[id] < 0) {
+        return NULL;
+    }
+    return &entries[slots[id]];
+}
+
+inline uint32_t frame_length(const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+
+    return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) | ((uint32_t) u[2] << 8) | u[3];
+}
+
+/* Start a frame at the end of out; returns where, for end_frame() */
+inline size_t begin_frame(std::string &out)
+{
+    size_t at = out.size();
+
+    out.append(FRAME_HEADER, '\0');
+    return at;
+}
+
+/* Fill in the length of the frame begun at at */
+inline void end_frame(std::string &out, size_t at)
+{
+    uint32_t length = out.size() - at - FRAME_HEADER;
+
+    out[at] = length >> 24;
+    out[at + 1] = length >> 16;
+    out[at + 2] = length >> 8;
+    out[at + 3] = length;
+}
+
+/* Append one event; a field over 65535 bytes is cut short */
+inline void append_event(std::string &out, int id, const std::string_view *fields, int count)
+{
+    size_t at = out.size();
+    size_t length;
+    char *p;
+
+    out.resize(at + 2 + 2 * count);
+    p = &out[at];
+    p[0] = id;
+    p[1] = count;
+    for (int i = 0; i < count; i++) {
+        length = std::min(fields[i].length(), (size_t) 0xffff);
+        p[2 + 2 * i] = length >> 8;
+        p[3 + 2 * i] = length;
+    }
+    for (int i = 0; i < count; i++) {
+        out.append(fields[i].data(), std::min(fields[i].length(), (size_t) 0xffff));
+    }
+}
+
+/*
+ * Append a server line, newline removed, as an event: split into its
+ * verb's fields, the last taking the rest of the line, or whole.
+ */
+inline void append_line(std::string &out, std::string_view line)
+{
+    std::string_view fields[FRAME_FIELDS];
+    const event_verb_t *verb;
+    size_t space;
+    int count = 0;
+
+    if (!line.empty() && line[0] >= '0' && line[0] <= '9') {
+        append_event(out, ID_REPLY, &line, 1);
+        return;
+    }
+    space = line.find(' ');
+    verb = find_verb(event_slots, event_verbs, line.substr(0, space));
+    if (verb == NULL || space == std::string_view::npos) {
+        append_event(out, ID_LINE, &line, 1);
+        return;
+    }
+    line.remove_prefix(space + 1);
+    while (count < verb->fields - 1 && (space = line.find(' ')) != std::string_view::npos) {
+        fields[count++] = line.substr(0, space);
+        line.remove_prefix(space + 1);
+    }
+    fields[count++] = line;
+    append_event(out, verb->id, fields, count);
+}
+
+/*
+ * Take the next event off a frame body at *p: 1 with it in *event, 0 at
+ * the end of the body, -1 if the body is malformed.
+ */
+inline int next_event(const char **p, const char *end, frame_event_t *event)
+{
+    const unsigned char *u = (const unsigned char *) *p;
+    const char *data;
+    size_t length;
+
+    if (*p == end) {
+        return 0;
+    }
+    if (end - *p < 2 || u[1] > FRAME_FIELDS || end - *p < 2 + 2 * u[1]) {
+        return -1;
+    }
+    event->id = u[0];
+    event->count = u[1];
+    data = *p + 2 + 2 * event->count;
+    for (int i = 0; i < event->count; i++) {
+        length = (u[2 + 2 * i] << 8) | u[3 + 2 * i];
+        if ((size_t) (end - data) < length) {
+            return -1;
+        }
+        event->fields[i] = std::string_view(data, length);
+        data += length;
+    }
+    for (int i = event->count; i < FRAME_FIELDS; i++) {
+        event->fields[i] = std::string_view();
+    }
+    *p = data;
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,228 @@
+/* linebuf.h */
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Bytes asked of each recv() into a line buffer */
+#define LINEBUF_CHUNK   4096
+
+/*
+ * Find the first '\n' in [p, end), or NULL.  Compares 32 bytes at a time
+ * with AVX2 when built for it (-mavx2 or -march=native), 16 with SSE2
+ * (always available on x86-64), and finishes byte by byte.
+ */
+static inline char *find_newline(char *p, char *end)
+{
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), nl32));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), nl16));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        if (*p == '\n') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * A per-connection receive buffer.  fill() reads whatever the socket has
+ * in one recv() and next() hands back complete lines in place, so a
+ * burst of commands costs one system call rather than two per byte.
+ * Bytes already searched are not searched again when more arrive.
+ *
+ * A line longer than max_line is reported once by next() returning -1;
+ * the rest of it is thrown away as it arrives and reading carries on
+ * with the following line.  Storage is only held while part of a line
+ * is waiting, so idle connections cost nothing.
+ *
+ * A connection that has switched to the binary protocol reads with
+ * next_frame() instead, which needs no search at all: the frame header
+ * says where the frame ends.
+ */
+class line_buffer {
+public:
+    explicit line_buffer(size_t max_line)
+        : buf(NULL), cap(0), start(0), end(0), scan(0), skipping(false), discard(0), max_line(max_line)
+    {
+    }
+
+    ~line_buffer()
+    {
+        free(buf);
+    }
+
+    /* recv() into the free space: bytes read, 0 at EOF, or -1 with errno set */
+    ssize_t fill(int sock)
+    {
+        ssize_t nread;
+
+        if (!reserve()) {
+            errno = ENOMEM;
+            return -1;
+        }
+        nread = recv(sock, buf + end, cap - end, 0);
+        if (nread > 0) {
+            end += nread;
+        }
+        return nread;
+    }
+
+    /*
+     * 1 with a NUL-terminated line (newline removed) in *line and *len,
+     * 0 if no whole line is buffered, -1 if a line over max_line was
+     * dropped.  The line stays valid until the next fill() or clear().
+     */
+    int next(char **line, size_t *len)
+    {
+        char *nl;
+
+        if (skipping) {
+            nl = find_newline(buf + scan, buf + end);
+            if (nl == NULL) {
+                start = end = scan = 0;
+                return 0;
+            }
+            start = scan = nl + 1 - buf;
+            skipping = false;
+        }
+
+        nl = find_newline(buf + scan, buf + end);
+        if (nl == NULL) {
+            scan = end;
+            if (end - start > max_line) {
+                start = end = scan = 0;
+                skipping = true;
+                return -1;
+            }
+            if (start == end) {
+                clear();
+            }
+            return 0;
+        }
+
+        *nl = '\0';
+        *line = buf + start;
+        *len = nl - (buf + start);
+        start = scan = nl + 1 - buf;
+        if (*len > max_line) {
+            return -1;
+        }
+        return 1;
+    }
+
+    /*
+     * 1 with the body of a length-prefixed frame (see frame.h) in *body
+     * and *len, 0 if no whole frame is buffered, -1 if a frame longer
+     * than max_body was dropped; the rest of it is thrown away as it
+     * arrives.  The body stays valid until the next fill() or clear().
+     */
+    int next_frame(char **body, size_t *len, size_t max_body)
+    {
+        const unsigned char *u;
+        size_t length;
+
+        if (discard > 0) {
+            length = (end - start < discard) ? end - start : discard;
+            start += length;
+            discard -= length;
+        }
+        if (end - start < 4) {
+            if (start == end && discard == 0) {
+                clear();
+            }
+            return 0;
+        }
+
+        u = (const unsigned char *) buf + start;
+        length = ((size_t) u[0] << 24) | ((size_t) u[1] << 16) | ((size_t) u[2] << 8) | u[3];
+        if (length > max_body) {
+            discard = 4 + length;
+            length = (end - start < discard) ? end - start : discard;
+            start += length;
+            discard -= length;
+            return -1;
+        }
+        if (end - start < 4 + length) {
+            return 0;
+        }
+
+        *body = buf + start + 4;
+        *len = length;
+        start = scan = start + 4 + length;
+        return 1;
+    }
+
+    /* Forget anything buffered and give the storage back */
+    void clear()
+    {
+        free(buf);
+        buf = NULL;
+        cap = start = end = scan = discard = 0;
+        skipping = false;
+    }
+
+private:
+    /* Make room for at least one more chunk, compacting before growing */
+    bool reserve()
+    {
+        char *newbuf;
+        size_t newcap;
+
+        if (start > 0 && cap - end < LINEBUF_CHUNK) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            scan -= start;
+            start = 0;
+        }
+        if (cap - end >= LINEBUF_CHUNK) {
+            return true;
+        }
+        newcap = (cap == 0) ? LINEBUF_CHUNK : cap * 2;
+        newbuf = (char *) realloc(buf, newcap);
+        if (newbuf == NULL) {
+            return false;
+        }
+        buf = newbuf;
+        cap = newcap;
+        return true;
+    }
+
+    char *buf;
+    size_t cap;
+    size_t start;       /* first byte of the current line */
+    size_t end;         /* end of the data read */
+    size_t scan;        /* bytes before this are known not to be '\n' */
+    bool skipping;      /* discarding the rest of an over-long line */
+    size_t discard;     /* bytes still to throw away of an over-long frame */
+    size_t max_line;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/* metrics.h */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+/* Buckets in a histogram: bucket i holds values in [2^(i-1), 2^i), bucket 0 the zeros */
+#define HIST_BUCKETS    48
+
+inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A histogram of durations or sizes with power-of-two buckets, so a value
+ * is placed with one count-leading-zeros and the percentiles read back are
+ * within a factor of two.  Only one thread ever adds to a histogram, so it
+ * uses plain relaxed loads and stores rather than atomic read-modify-write
+ * and no cache line is fought over; any other thread may read it at any
+ * time, and at worst sees the last few samples missing.
+ */
+class histogram {
+public:
+    void add(uint64_t value)
+    {
+        int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+        if (bucket >= HIST_BUCKETS) {
+            bucket = HIST_BUCKETS - 1;
+        }
+        bump(buckets[bucket], 1);
+        bump(count, 1);
+        bump(sum, value);
+        if (value > max.load(std::memory_order_relaxed)) {
+            max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static void bump(std::atomic<uint64_t> &a, uint64_t n)
+    {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets[HIST_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+    friend struct hist_summary;
+};
+
+/* Histograms of the same thing on several threads, added up for a report */
+struct hist_summary {
+    hist_summary() : buckets(), count(0), sum(0), max(0) {}
+
+    void merge(const histogram &h)
+    {
+        uint64_t m = h.max.load(std::memory_order_relaxed);
+
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+        }
+        count += h.count.load(std::memory_order_relaxed);
+        sum += h.sum.load(std::memory_order_relaxed);
+        if (m > max) {
+            max = m;
+        }
+    }
+
+    /* The top of the bucket the p'th fraction of values falls in, but never more than the largest seen */
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = 0;
+        uint64_t want = (uint64_t) (p * count);
+
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            total += buckets[i];
+            if (total > want) {
+                uint64_t top = (i == 0) ? 0 : (1ULL << i) - 1;
+
+                return (top < max) ? top : max;
+            }
+        }
+        return max;
+    }
+
+    /* One line: count, mean and percentiles, durations given in ns and shown in us */
+    void format(std::string &out, const std::string &prefix, const char *name, bool duration) const
+    {
+        char line[256];
+        double scale = duration ? 1e3 : 1;
+        const char *unit = duration ? "us" : "";
+
+        if (count == 0) {
+            snprintf(line, sizeof(line), "%s%s count 0\n", prefix.c_str(), name);
+        } else {
+            snprintf(line, sizeof(line), "%s%s count %lu mean %.1f%s p50 %.1f%s p90 %.1f%s p99 %.1f%s max %.1f%s\n",
+                     prefix.c_str(), name, (unsigned long) count, (double) sum / count / scale, unit,
+                     percentile(0.5) / scale, unit, percentile(0.9) / scale, unit,
+                     percentile(0.99) / scale, unit, max / scale, unit);
+        }
+        out += line;
+    }
+
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+#endif
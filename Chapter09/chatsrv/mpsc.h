@@ -0,0 +1,70 @@
+/* mpsc.h */
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <atomic>
+
+struct mpsc_node {
+    std::atomic<mpsc_node *> next;
+};
+
+/*
+ * Intrusive multi-producer, single-consumer queue (Vyukov).  push() is one
+ * atomic exchange and never waits for other producers or the consumer.
+ * pop() returns NULL when the queue is empty, and also while a producer
+ * is between its exchange and its link; such a producer always follows
+ * up with a wakeup, so the consumer simply tries again then.
+ */
+class mpsc_queue {
+public:
+    mpsc_queue() : head(&stub), tail(&stub)
+    {
+        stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    void push(mpsc_node *node)
+    {
+        mpsc_node *prev;
+
+        node->next.store(nullptr, std::memory_order_relaxed);
+        prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    mpsc_node *pop()
+    {
+        mpsc_node *node = tail;
+        mpsc_node *next = node->next.load(std::memory_order_acquire);
+
+        if (node == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = next;
+            node = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return node;
+        }
+        if (node != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        /* node is the last one: put the stub behind it so it can be taken */
+        push(&stub);
+        next = node->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return node;
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<mpsc_node *> head;
+    mpsc_node *tail;
+    mpsc_node stub;
+};
+
+#endif
@@ -0,0 +1,289 @@
+/* msglog.h */
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/* A segment holds this many bytes of messages, or this many messages, whichever fills first */
+#define LOG_SEGMENT_BYTES       (1024 * 1024)
+#define LOG_SEGMENT_MESSAGES    16384
+/* Segments kept open per log; replay reaches back no further than these */
+#define LOG_OPEN_SEGMENTS       2
+
+/*
+ * One segment of a log: a data file of framed messages back to back and
+ * an index file holding the end offset of each.  Both are preallocated
+ * and mapped, so an append is two stores into memory, and the data file
+ * stays open for sendfile().  Index entries are written after the data,
+ * and an entry of 0 marks the end.
+ */
+struct log_segment_t {
+    log_segment_t() : fd(-1), ifd(-1), data(NULL), index(NULL), count(0), end(0), synced(0) {}
+
+    ~log_segment_t()
+    {
+        if (data != NULL) {
+            munmap(data, LOG_SEGMENT_BYTES);
+        }
+        if (index != NULL) {
+            munmap(index, LOG_SEGMENT_MESSAGES * sizeof(uint32_t));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ifd >= 0) {
+            close(ifd);
+        }
+    }
+
+    unsigned long seq;
+    int fd;
+    int ifd;
+    char *data;
+    uint32_t *index;
+    size_t count;       /* messages in the segment */
+    size_t end;         /* bytes in the segment */
+    size_t synced;      /* messages handed over to be committed */
+};
+
+/* Messages [from, to) of a segment, waiting to be flushed to disk */
+struct log_sync_t {
+    std::shared_ptr<log_segment_t> segment;
+    size_t from;
+    size_t to;
+};
+
+/* Whole messages as a byte range of one segment file, ready for sendfile() */
+struct log_range_t {
+    std::shared_ptr<log_segment_t> segment;
+    off_t offset;
+    size_t length;
+};
+
+/*
+ * Write a group of appends through to disk: the data first, then the
+ * index entries that point at it, so the index never runs ahead.
+ */
+inline void log_sync(const log_sync_t &sync)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    log_segment_t *seg = sync.segment.get();
+    size_t start;
+    size_t stop;
+
+    start = (sync.from == 0) ? 0 : seg->index[sync.from - 1];
+    stop = seg->index[sync.to - 1];
+    start &= ~(page - 1);
+    msync(seg->data + start, stop - start, MS_SYNC);
+
+    start = (sync.from * sizeof(uint32_t)) & ~(page - 1);
+    stop = sync.to * sizeof(uint32_t);
+    msync((char *) seg->index + start, stop - start, MS_SYNC);
+}
+
+/*
+ * The append-only message log of one room, kept in dir as segments named
+ * after the room in hex (any room name is then a safe file name) and a
+ * sequence number.  Opening the log picks up where the last run left it.
+ * A log is only used by the thread that owns its room.
+ */
+class message_log {
+public:
+    message_log(const std::string &dir, std::string_view name) : next_seq(1)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::vector<unsigned long> seqs;
+        std::string file;
+        struct dirent *entry;
+        unsigned long seq;
+        DIR *d;
+
+        prefix = dir + "/";
+        for (unsigned char c : name) {
+            prefix += hex[c >> 4];
+            prefix += hex[c & 15];
+        }
+        prefix += '.';
+
+        /* Find the existing segments; only the newest are opened */
+        file = prefix.substr(dir.length() + 1);
+        d = opendir(dir.c_str());
+        if (d != NULL) {
+            while ((entry = readdir(d)) != NULL) {
+                if (strncmp(entry->d_name, file.c_str(), file.length()) == 0 &&
+                    sscanf(entry->d_name + file.length(), "%lu.log", &seq) == 1) {
+                    seqs.push_back(seq);
+                }
+            }
+            closedir(d);
+        }
+        sort(seqs.begin(), seqs.end());
+        for (size_t i = (seqs.size() > LOG_OPEN_SEGMENTS) ? seqs.size() - LOG_OPEN_SEGMENTS : 0;
+             i < seqs.size(); i++) {
+            next_seq = seqs[i];
+            open_segment();
+        }
+        if (segments.empty()) {
+            open_segment();
+        }
+    }
+
+    /* Usable: the newest segment could be opened and mapped */
+    bool ok() const
+    {
+        return !segments.empty();
+    }
+
+    /* Append a framed message; false if it could not be stored */
+    bool append(const char *msg, size_t length)
+    {
+        log_segment_t *seg;
+
+        if (segments.empty() || length == 0 || length > LOG_SEGMENT_BYTES) {
+            return false;
+        }
+        seg = segments.back().get();
+        if (seg->count == LOG_SEGMENT_MESSAGES || seg->end + length > LOG_SEGMENT_BYTES) {
+            if (!open_segment()) {
+                return false;
+            }
+            seg = segments.back().get();
+        }
+
+        memcpy(seg->data + seg->end, msg, length);
+        seg->end += length;
+        seg->index[seg->count++] = seg->end;
+        return true;
+    }
+
+    /* Byte ranges covering the last n messages, oldest first; the number of messages found */
+    size_t tail(size_t n, std::vector<log_range_t> &ranges)
+    {
+        size_t found = 0;
+        size_t first = ranges.size();
+        size_t take;
+        size_t start;
+
+        for (size_t i = segments.size(); i > 0 && found < n; i--) {
+            log_segment_t *seg = segments[i - 1].get();
+
+            take = std::min(n - found, seg->count);
+            if (take == 0) {
+                continue;
+            }
+            start = (take == seg->count) ? 0 : seg->index[seg->count - take - 1];
+            ranges.push_back({ segments[i - 1], (off_t) start, seg->end - start });
+            found += take;
+        }
+        reverse(ranges.begin() + first, ranges.end());
+
+        return found;
+    }
+
+    /* Hand over everything appended since the last call, for log_sync() */
+    void unsynced(std::vector<log_sync_t> &syncs)
+    {
+        for (size_t i = 0; i < retired.size(); i++) {
+            syncs.push_back(retired[i]);
+        }
+        retired.clear();
+        for (size_t i = 0; i < segments.size(); i++) {
+            log_segment_t *seg = segments[i].get();
+
+            if (seg->synced < seg->count) {
+                syncs.push_back({ segments[i], seg->synced, seg->count });
+                seg->synced = seg->count;
+            }
+        }
+    }
+
+private:
+    /* Open segment next_seq, creating it if need be, and retire the oldest open one */
+    bool open_segment()
+    {
+        std::shared_ptr<log_segment_t> seg = std::make_shared<log_segment_t>();
+        size_t lo;
+        size_t hi;
+        void *p;
+
+        seg->seq = next_seq;
+        seg->fd = open(segment_name(next_seq, "log").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        seg->ifd = open(segment_name(next_seq, "idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        /* Allocating the blocks now means a full disk fails here, not as SIGBUS on a store */
+        if (seg->fd < 0 || seg->ifd < 0 ||
+            posix_fallocate(seg->fd, 0, LOG_SEGMENT_BYTES) != 0 ||
+            posix_fallocate(seg->ifd, 0, LOG_SEGMENT_MESSAGES * sizeof(uint32_t)) != 0) {
+            return false;
+        }
+        p = mmap(NULL, LOG_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        seg->data = (char *) p;
+        p = mmap(NULL, LOG_SEGMENT_MESSAGES * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, seg->ifd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        seg->index = (uint32_t *) p;
+
+        /* The index is a run of increasing offsets and then zeros: find where it stops */
+        lo = 0;
+        hi = LOG_SEGMENT_MESSAGES;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (seg->index[mid] != 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        /* Entries a crash left without their data end in something other than a newline */
+        while (lo > 0 && (seg->index[lo - 1] > LOG_SEGMENT_BYTES || seg->data[seg->index[lo - 1] - 1] != '\n' ||
+                          (lo > 1 && seg->index[lo - 2] >= seg->index[lo - 1]))) {
+            seg->index[--lo] = 0;
+        }
+        seg->count = seg->synced = lo;
+        seg->end = (lo == 0) ? 0 : seg->index[lo - 1];
+
+        next_seq++;
+        segments.push_back(seg);
+        if (segments.size() > LOG_OPEN_SEGMENTS) {
+            log_segment_t *old = segments.front().get();
+
+            if (old->synced < old->count) {
+                retired.push_back({ segments.front(), old->synced, old->count });
+                old->synced = old->count;
+            }
+            segments.erase(segments.begin());
+        }
+        return true;
+    }
+
+    std::string segment_name(unsigned long seq, const char *ext)
+    {
+        char suffix[32];
+
+        snprintf(suffix, sizeof(suffix), "%08lu.%s", seq, ext);
+        return prefix + suffix;
+    }
+
+    std::string prefix;             /* dir/hexname. */
+    unsigned long next_seq;
+    std::vector<std::shared_ptr<log_segment_t>> segments;  /* open, oldest first */
+    std::vector<log_sync_t> retired;    /* from segments closed before being synced */
+};
+
+#endif
@@ -0,0 +1,199 @@
+/* parsebench.cpp */
+#include <iostream>
+#include <string>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include "command.h"
+#include "frame.h"
+
+using namespace std;
+
+/* #define's */
+#define DEFAULT_ITERATIONS  2000000
+
+/*
+ * Compare the chat server's command dispatch before and after.  Both
+ * split lines with chatsrv's own parse_command().  Before, as with the
+ * old decodeCommand(), the verb and operands were then copied into
+ * strings of their own, the verb upper-cased, and the verb matched by an
+ * if/else chain of string compares; after, the views are used where
+ * they lie and the verb is found in a hash table of chatsrv's verbs.
+ * Both parse the same mix of lines, most of them MSG, and the heap
+ * allocations each one makes are counted by replacing operator new.
+ */
+
+/* Structures */
+struct old_cmd_t {
+    string command;
+    string op1;
+    string op2;
+};
+
+struct verb_t {
+    string_view verb;
+    int id;
+};
+
+/* Globals */
+unsigned long allocations = 0;
+volatile int sink;
+
+const char *lines[] = {
+    "MSG hello there everybody",
+    "MSG short",
+    "msg a somewhat longer message that will not fit in a small string buffer",
+    "PMSG bob are you around?",
+    "MSG another one",
+    "TOPIC the topic of the day",
+    "MSG and another",
+    "QUIT",
+};
+#define NLINES  (sizeof(lines) / sizeof(lines[0]))
+
+/* chatsrv's verbs and ids, without the handlers */
+constexpr verb_t verbs[] = {
+    { "JOIN", ID_JOIN }, { "MSG", ID_MSG }, { "PMSG", ID_PMSG }, { "OP", ID_OP },
+    { "KICK", ID_KICK }, { "TOPIC", ID_TOPIC }, { "QUIT", ID_QUIT },
+    { "HISTORY", ID_HISTORY }, { "STATS", ID_STATS },
+};
+constexpr array<int, VERB_SLOTS> verb_slots = build_verb_slots(verbs);
+
+void *operator new(size_t size)
+{
+    void *p;
+
+    allocations++;
+    p = malloc(size);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+/* A command as decodeCommand() returned it: owned copies, the verb upper-cased */
+old_cmd_t copy_command(const char *line)
+{
+    cmd_t cmd = parse_command(line);
+    old_cmd_t ret_cmd;
+
+    ret_cmd.command = cmd.command;
+    for (size_t i = 0; i < ret_cmd.command.length(); i++) {
+        ret_cmd.command[i] = toupper(ret_cmd.command[i]);
+    }
+    ret_cmd.op1 = cmd.op1;
+    ret_cmd.op2 = cmd.op2;
+
+    return ret_cmd;
+}
+
+/* What a line costs to dispatch, with a result that depends on its verb and text */
+int weigh(int id, string_view op2)
+{
+    return id + (id == ID_MSG || id == ID_PMSG || id == ID_TOPIC ? op2.length() : 0);
+}
+
+int old_dispatch(const char *line)
+{
+    old_cmd_t cmd = copy_command(line);
+
+    if (cmd.command == "JOIN") {
+        return weigh(ID_JOIN, cmd.op2);
+    } else if (cmd.command == "MSG") {
+        return weigh(ID_MSG, cmd.op2);
+    } else if (cmd.command == "PMSG") {
+        return weigh(ID_PMSG, cmd.op2);
+    } else if (cmd.command == "OP") {
+        return weigh(ID_OP, cmd.op2);
+    } else if (cmd.command == "KICK") {
+        return weigh(ID_KICK, cmd.op2);
+    } else if (cmd.command == "TOPIC") {
+        return weigh(ID_TOPIC, cmd.op2);
+    } else if (cmd.command == "QUIT") {
+        return weigh(ID_QUIT, cmd.op2);
+    } else if (cmd.command == "HISTORY") {
+        return weigh(ID_HISTORY, cmd.op2);
+    } else if (cmd.command == "STATS") {
+        return weigh(ID_STATS, cmd.op2);
+    }
+    return 0;
+}
+
+int new_dispatch(const char *line, size_t length)
+{
+    cmd_t cmd = parse_command(string_view(line, length));
+    const verb_t *verb = find_verb(verb_slots, verbs, cmd.command);
+
+    if (verb == NULL) {
+        return 0;
+    }
+    return weigh(verb->id, cmd.op2);
+}
+
+double elapsed(const struct timespec &start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec start;
+    size_t lengths[NLINES];
+    unsigned long iterations;
+    unsigned long before;
+    double old_secs;
+    double new_secs;
+    int check;
+
+    iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+    for (size_t i = 0; i < NLINES; i++) {
+        lengths[i] = strlen(lines[i]);
+        if (old_dispatch(lines[i]) != new_dispatch(lines[i], lengths[i])) {
+            fprintf(stderr, "parsers disagree on \"%s\"\n", lines[i]);
+            return 1;
+        }
+    }
+
+    before = allocations;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check = 0;
+    for (unsigned long n = 0; n < iterations; n++) {
+        check += old_dispatch(lines[n % NLINES]);
+    }
+    old_secs = elapsed(start);
+    sink = check;
+    printf("copied strings %8.1f ns/line  %5.2f allocations/line\n",
+           old_secs * 1e9 / iterations, (double) (allocations - before) / iterations);
+
+    before = allocations;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check = 0;
+    for (unsigned long n = 0; n < iterations; n++) {
+        check += new_dispatch(lines[n % NLINES], lengths[n % NLINES]);
+    }
+    new_secs = elapsed(start);
+    sink = check;
+    printf("string_views   %8.1f ns/line  %5.2f allocations/line\n",
+           new_secs * 1e9 / iterations, (double) (allocations - before) / iterations);
+
+    printf("speedup        %8.1fx\n", old_secs / new_secs);
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* roster.h */
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Slots a table starts with; always a power of two, and at least twice the entries */
+#define NAME_TABLE_MIN  8
+
+/*
+ * A table of names, for a room's nicknames.  Each name is interned once in
+ * a packed array of entries, and its index there is the member's handle
+ * until it leaves.  Names are found through an open-addressing array of
+ * (hash, index) slots, probed linearly: a lookup is one hash, nearly
+ * always one cache line of slots, and a string compare only when the
+ * stored hashes match, where a std::map follows a chain of separately
+ * allocated nodes and compares strings at each one.
+ *
+ * Removing an entry moves the last one into its place, so the entries
+ * stay packed for iteration, and shifts the slots after it back rather
+ * than leaving a tombstone, so probes do not lengthen as names come and
+ * go.  Indices are therefore only good until the next erase().
+ */
+template <typename T>
+class name_table {
+public:
+    struct entry {
+        std::string name;
+        uint32_t hash;
+        T value;
+    };
+
+    name_table() : slots(NAME_TABLE_MIN, slot{ 0, -1 }) {}
+
+    /* The index of name's entry, or -1 */
+    int find(std::string_view name) const
+    {
+        uint32_t hash = hash_name(name);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask; slots[i].index >= 0; i = (i + 1) & mask) {
+            if (slots[i].hash == hash && entries[slots[i].index].name == name) {
+                return slots[i].index;
+            }
+        }
+        return -1;
+    }
+
+    /* Add name, which must not be in the table yet; returns its index */
+    int insert(std::string_view name, const T &value)
+    {
+        uint32_t hash = hash_name(name);
+
+        if ((entries.size() + 1) * 2 > slots.size()) {
+            grow();
+        }
+        entries.push_back(entry{ std::string(name), hash, value });
+        place(hash, entries.size() - 1);
+
+        return entries.size() - 1;
+    }
+
+    /* Remove the entry at index; the last entry takes over that index */
+    void erase(int index)
+    {
+        size_t mask = slots.size() - 1;
+        size_t hole = slot_of(index);
+        size_t home;
+        int last = entries.size() - 1;
+
+        /* Pull back any later slot in the run that may sit in the hole without being passed over */
+        for (size_t i = (hole + 1) & mask; slots[i].index >= 0; i = (i + 1) & mask) {
+            home = slots[i].hash & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                slots[hole] = slots[i];
+                hole = i;
+            }
+        }
+        slots[hole].index = -1;
+
+        if (index != last) {
+            slots[slot_of(last)].index = index;
+            entries[index] = std::move(entries[last]);
+        }
+        entries.pop_back();
+    }
+
+    T &operator[](int index) { return entries[index].value; }
+    const std::string &name(int index) const { return entries[index].name; }
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    /* The entries, packed, in no particular order */
+    typename std::vector<entry>::iterator begin() { return entries.begin(); }
+    typename std::vector<entry>::iterator end() { return entries.end(); }
+
+private:
+    struct slot {
+        uint32_t hash;
+        int32_t index;      /* into entries; -1 if the slot is free */
+    };
+
+    static uint32_t hash_name(std::string_view name)
+    {
+        return std::hash<std::string_view>()(name);
+    }
+
+    /* The slot holding index, which must be in the table */
+    size_t slot_of(int index) const
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = entries[index].hash & mask;
+
+        while (slots[i].index != index) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void place(uint32_t hash, int index)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+
+        while (slots[i].index >= 0) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = slot{ hash, index };
+    }
+
+    void grow()
+    {
+        slots.assign(slots.size() * 2, slot{ 0, -1 });
+        for (size_t i = 0; i < entries.size(); i++) {
+            place(entries[i].hash, i);
+        }
+    }
+
+    std::vector<entry> entries;
+    std::vector<slot> slots;
+};
+
+#endif
@@ -0,0 +1,216 @@
+/* rosterbench.cpp */
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "roster.h"
+
+using namespace std;
+
+/* #define's */
+#define DEFAULT_LOOKUPS     2000000
+/* Leaves and joins timed, at most */
+#define MAX_CHURN           200000
+
+/*
+ * Room roster cost, before and after: a std::map from nickname to client,
+ * as the rooms kept, against name_table.  For each number of simulated
+ * users, all in one room, it times looking a nickname up (nine in ten of
+ * them present, as PMSG, OP and KICK mostly name someone who is there),
+ * a fan-out over everyone, and members leaving and joining.  The fan-out
+ * is timed over the map, over the table's packed entries, and over the
+ * vector of client pointers a room keeps for it; each recipient's record
+ * is touched, as delivering to it would.  After the churn the table is
+ * checked against the map.
+ */
+
+/* Structures */
+
+/* Stands in for a client_t: a record of about the same size, allocated on its own */
+struct sim_client {
+    string nickname;
+    unsigned long queued;
+    char rest[256];
+};
+
+/* Globals */
+volatile unsigned long sink;
+
+double elapsed(const struct timespec &start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+bool run(size_t users, unsigned long lookups, mt19937_64 &rng)
+{
+    map<string, sim_client *, less<>> tree;
+    name_table<sim_client *> table;
+    vector<sim_client *> members;
+    vector<sim_client *> clients;
+    vector<string> queries;
+    struct timespec start;
+    unsigned long check;
+    size_t churn = min(users, (size_t) MAX_CHURN);
+    double tree_secs;
+    double table_secs;
+    double members_secs;
+    int index;
+
+    /* Join order is not allocation order, so neither structure gets its records in a neat row */
+    for (size_t i = 0; i < users; i++) {
+        sim_client *client = new sim_client;
+
+        client->nickname = "user" + to_string(rng() % 100000000) + "_" + to_string(i);
+        client->queued = 0;
+        clients.push_back(client);
+    }
+    shuffle(clients.begin(), clients.end(), rng);
+    for (size_t i = 0; i < users; i++) {
+        tree[clients[i]->nickname] = clients[i];
+        table.insert(clients[i]->nickname, clients[i]);
+        members.push_back(clients[i]);
+    }
+    for (unsigned long n = 0; n < lookups; n++) {
+        if (n % 10 == 9) {
+            queries.push_back("nobody" + to_string(n));
+        } else {
+            queries.push_back(clients[rng() % users]->nickname);
+        }
+    }
+
+    printf("%zu users\n", users);
+
+    check = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long n = 0; n < lookups; n++) {
+        map<string, sim_client *, less<>>::iterator iter = tree.find(queries[n]);
+
+        if (iter != tree.end()) {
+            check += (*iter).second->queued + 1;
+        }
+    }
+    tree_secs = elapsed(start);
+    sink = check;
+
+    check = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long n = 0; n < lookups; n++) {
+        index = table.find(queries[n]);
+        if (index >= 0) {
+            check += table[index]->queued + 1;
+        }
+    }
+    table_secs = elapsed(start);
+    if (check != sink) {
+        fprintf(stderr, "rosterbench: lookups disagree\n");
+        return false;
+    }
+    printf("  lookup     map %8.1f ns   name_table %8.1f ns   %5.1fx\n",
+           tree_secs * 1e9 / lookups, table_secs * 1e9 / lookups, tree_secs / table_secs);
+
+    /* Several fan-outs, so the small rooms are timed over more than a few microseconds */
+    size_t rounds = max((size_t) 1, 2000000 / users);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < rounds; r++) {
+        for (map<string, sim_client *, less<>>::iterator iter = tree.begin(); iter != tree.end(); ++iter) {
+            (*iter).second->queued++;
+        }
+    }
+    tree_secs = elapsed(start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < rounds; r++) {
+        for (name_table<sim_client *>::entry &entry : table) {
+            entry.value->queued++;
+        }
+    }
+    table_secs = elapsed(start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < members.size(); i++) {
+            members[i]->queued++;
+        }
+    }
+    members_secs = elapsed(start);
+    printf("  fan-out    map %8.1f ns   name_table %8.1f ns   members %8.1f ns per recipient\n",
+           tree_secs * 1e9 / rounds / users, table_secs * 1e9 / rounds / users,
+           members_secs * 1e9 / rounds / users);
+
+    /* Leaves and joins: a random member goes, and someone new comes */
+    vector<size_t> leaving(churn);
+    vector<string> joining(churn);
+    vector<string> names(users);
+
+    for (size_t i = 0; i < users; i++) {
+        names[i] = clients[i]->nickname;
+    }
+
+    for (size_t i = 0; i < churn; i++) {
+        leaving[i] = rng() % users;
+        joining[i] = "late" + to_string(i);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < churn; i++) {
+        tree.erase(names[leaving[i]]);
+        tree[joining[i]] = clients[leaving[i]];
+        names[leaving[i]] = joining[i];
+    }
+    tree_secs = elapsed(start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < churn; i++) {
+        sim_client *client = clients[leaving[i]];
+
+        table.erase(table.find(client->nickname));
+        table.insert(joining[i], client);
+        client->nickname = joining[i];
+    }
+    table_secs = elapsed(start);
+    printf("  leave+join map %8.1f ns   name_table %8.1f ns   %5.1fx\n",
+           tree_secs * 1e9 / churn, table_secs * 1e9 / churn, tree_secs / table_secs);
+
+    /* Whatever the timings, the two must still hold the same names */
+    if (table.size() != tree.size()) {
+        fprintf(stderr, "rosterbench: %zu names in the table, %zu in the map\n", table.size(), tree.size());
+        return false;
+    }
+    for (map<string, sim_client *, less<>>::iterator iter = tree.begin(); iter != tree.end(); ++iter) {
+        index = table.find((*iter).first);
+        if (index < 0 || table[index] != (*iter).second || table.name(index) != (*iter).first) {
+            fprintf(stderr, "rosterbench: the table has lost %s\n", (*iter).first.c_str());
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < users; i++) {
+        delete clients[i];
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    mt19937_64 rng(42);
+    unsigned long lookups;
+
+    lookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_LOOKUPS;
+
+    if (!run(10000, lookups, rng) || !run(100000, lookups, rng) || !run(1000000, lookups, rng)) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+/* stormbench.cpp */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "linebuf.h"
+
+using namespace std;
+
+/* #define's */
+#define MAX_EVENTS      256
+/* Room for a NAMES or PRESENCE line, which may be some 4 KB */
+#define MAX_LINE_BUFF   8192
+/* Give up on a phase that makes no progress for this long */
+#define PHASE_TIMEOUT   10
+
+/*
+ * What a JOIN storm costs.  A crowd of clients joins one room all at
+ * once, and each keeps its own idea of who is in the room from what the
+ * server tells it, until everyone sees everyone.  Then half of them drop
+ * their connections and come straight back, as after a network blip,
+ * and the phase ends once the half that stayed has seen each of them
+ * rejoin and the half that came back sees everyone again.  For each
+ * phase it reports how long that took and the bytes and lines the
+ * clients had to read, and with -s the server's CPU time.  Run it once
+ * as it is, for a JOIN and QUIT line per change, and once with -b, for
+ * NAMES snapshots and PRESENCE deltas.
+ */
+
+/* Structures */
+struct bot_t {
+    int index;
+    int sock;
+    bool joined;
+    bool stays;                 /* not one of those that reconnect */
+    vector<char> present;       /* the room's bots, as this one sees them */
+    int npresent;
+    int rejoins;                /* reconnecting bots seen to come back this phase */
+    line_buffer *in;
+};
+
+/* Globals */
+struct sockaddr_in server;
+int nbots = 1000;
+bool batch = false;
+const char *room = "storm";
+int server_pid = 0;
+int epfd;
+int reconnecting;               /* how many bots the second phase has come back */
+unsigned long bytes_in;
+unsigned long lines_in;
+unsigned long refusals;
+
+/* Forward declarations */
+bool parse_server(const char *arg);
+bool connect_bot(bot_t *bot);
+bool send_join(bot_t *bot);
+bool read_bot(bot_t *bot, bool rejoining);
+void apply(bot_t *bot, char change, const char *name, bool rejoining);
+bool settled(vector<bot_t *> &bots, bool rejoining);
+bool run_phase(vector<bot_t *> &bots, const char *label, bool rejoining);
+double server_cpu(void);
+long now_ns(void);
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    vector<bot_t *> bots;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:br:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            if (!parse_server(optarg)) {
+                return 1;
+            }
+            break;
+        case 'c':
+            nbots = atoi(optarg);
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'r':
+            room = optarg;
+            break;
+        case 's':
+            server_pid = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: stormbench [-n host:port] [-c clients] [-b batch] [-r room] [-s server pid]\n");
+            return 1;
+        }
+    }
+    if (server.sin_family == 0 && !parse_server("127.0.0.1:5296")) {
+        return 1;
+    }
+    if (nbots < 2) {
+        fprintf(stderr, "stormbench: at least 2 clients\n");
+        return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    epfd = epoll_create1(0);
+
+    for (int i = 0; i < nbots; i++) {
+        bot_t *bot = new bot_t;
+
+        bot->index = i;
+        bot->stays = (i % 2 == 0);
+        bot->present.assign(nbots, 0);
+        bot->in = new line_buffer(MAX_LINE_BUFF);
+        bots.push_back(bot);
+    }
+
+    printf("%d clients in %s, %s\n", nbots, room, batch ? "BATCH (NAMES and PRESENCE)" : "JOIN and QUIT lines");
+    printf("%-10s %10s %12s %14s %10s %12s\n", "", "ms", "bytes", "bytes/client", "lines", "server cpu ms");
+
+    /* Everyone at once */
+    for (size_t i = 0; i < bots.size(); i++) {
+        if (!connect_bot(bots[i])) {
+            return 1;
+        }
+    }
+    if (!run_phase(bots, "join", false)) {
+        return 1;
+    }
+
+    /* Half drop and come straight back; the other half watch them do it */
+    for (size_t i = 0; i < bots.size(); i++) {
+        bots[i]->rejoins = 0;
+        if (!bots[i]->stays) {
+            close(bots[i]->sock);
+        }
+    }
+    reconnecting = nbots / 2;
+    for (size_t i = 0; i < bots.size(); i++) {
+        if (!bots[i]->stays && !connect_bot(bots[i])) {
+            return 1;
+        }
+    }
+    if (!run_phase(bots, "reconnect", true)) {
+        return 1;
+    }
+    if (refusals > 0) {
+        printf("%lu JOINs refused as the old connection was still there, and sent again\n", refusals);
+    }
+
+    return 0;
+}
+
+/* -n: the server's client address */
+bool parse_server(const char *arg)
+{
+    struct hostent *host;
+    string entry = arg;
+    size_t colon;
+
+    colon = entry.rfind(':');
+    if (colon == string::npos) {
+        fprintf(stderr, "stormbench: the server is host:port\n");
+        return false;
+    }
+    host = gethostbyname(entry.substr(0, colon).c_str());
+    if (host == NULL) {
+        fprintf(stderr, "stormbench: unknown host %s\n", entry.substr(0, colon).c_str());
+        return false;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(entry.c_str() + colon + 1));
+    memcpy(&server.sin_addr, host->h_addr_list[0], host->h_length);
+
+    return true;
+}
+
+/* Connect a bot afresh, knowing nobody, and send its JOIN */
+bool connect_bot(bot_t *bot)
+{
+    struct epoll_event ev;
+    int flag = 1;
+
+    bot->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (bot->sock < 0 || connect(bot->sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        fprintf(stderr, "stormbench: client %d: %s\n", bot->index, strerror(errno));
+        return false;
+    }
+    setsockopt(bot->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+    fcntl(bot->sock, F_SETFL, O_NONBLOCK);
+    bot->joined = false;
+    fill(bot->present.begin(), bot->present.end(), 0);
+    bot->npresent = 0;
+    bot->in->clear();
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = bot;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, bot->sock, &ev);
+
+    return send_join(bot);
+}
+
+bool send_join(bot_t *bot)
+{
+    string line = "JOIN s" + to_string(bot->index) + " " + room + (batch ? " BATCH" : "") + "\n";
+
+    return send(bot->sock, line.data(), line.length(), MSG_NOSIGNAL) == (ssize_t) line.length();
+}
+
+/*
+ * Read what a bot has and follow the room's membership in it.  False on
+ * a lost connection or a JOIN refused for anything but the nickname.
+ */
+bool read_bot(bot_t *bot, bool rejoining)
+{
+    char *line;
+    char *word;
+    char *next;
+    size_t len;
+    ssize_t nread;
+    int status;
+
+    while ((nread = bot->in->fill(bot->sock)) > 0) {
+        bytes_in += nread;
+        while ((status = bot->in->next(&line, &len)) != 0) {
+            if (status < 0) {
+                continue;
+            }
+            lines_in++;
+            if (!bot->joined) {
+                /* Its old connection has not been seen to go yet; ask again */
+                if (strncmp(line, "200 ", 4) == 0) {
+                    refusals++;
+                    if (!send_join(bot)) {
+                        return false;
+                    }
+                    continue;
+                }
+                if (strncmp(line, "100 OK", 6) != 0) {
+                    fprintf(stderr, "stormbench: JOIN refused: %s\n", line);
+                    return false;
+                }
+                bot->joined = true;
+            } else if (strncmp(line, "JOIN ", 5) == 0) {
+                apply(bot, '+', line + 5, rejoining);
+            } else if (strncmp(line, "QUIT ", 5) == 0) {
+                apply(bot, '-', line + 5, rejoining);
+            } else if (strncmp(line, "NAMES ", 6) == 0 || strncmp(line, "PRESENCE ", 9) == 0) {
+                bool names = line[0] == 'N';
+
+                for (word = strchr(line, ' ') + 1; *word != '\0'; word = next) {
+                    next = strchr(word, ' ');
+                    if (next == NULL) {
+                        next = word + strlen(word);
+                    } else {
+                        *next++ = '\0';
+                    }
+                    if (names) {
+                        apply(bot, '+', word, false);
+                    } else {
+                        apply(bot, word[0], word + 1, rejoining);
+                    }
+                }
+            }
+        }
+    }
+
+    return nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/* A bot learns that name has joined (change '+') or left ('-') */
+void apply(bot_t *bot, char change, const char *name, bool rejoining)
+{
+    int who;
+
+    if (name[0] != 's' || (who = atoi(name + 1)) < 0 || who >= nbots) {
+        return;
+    }
+    if (change == '+') {
+        if (!bot->present[who]) {
+            bot->present[who] = 1;
+            bot->npresent++;
+        }
+        /* Those that stayed count the others back in, snapshots aside */
+        if (rejoining && bot->stays && who % 2 == 1) {
+            bot->rejoins++;
+        }
+    } else if (bot->present[who]) {
+        bot->present[who] = 0;
+        bot->npresent--;
+    }
+}
+
+/* Whether every bot sees the whole room, and after a reconnect, saw it happen */
+bool settled(vector<bot_t *> &bots, bool rejoining)
+{
+    for (size_t i = 0; i < bots.size(); i++) {
+        if (!bots[i]->joined || bots[i]->npresent != nbots) {
+            return false;
+        }
+        if (rejoining && bots[i]->stays && bots[i]->rejoins < reconnecting) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_phase(vector<bot_t *> &bots, const char *label, bool rejoining)
+{
+    struct epoll_event events[MAX_EVENTS];
+    unsigned long bytes_before = bytes_in;
+    unsigned long lines_before = lines_in;
+    double cpu_before = server_cpu();
+    long start = now_ns();
+    long last = start;
+    long elapsed;
+    int nready;
+
+    while (!settled(bots, rejoining)) {
+        nready = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < nready; i++) {
+            if (!read_bot((bot_t *) events[i].data.ptr, rejoining)) {
+                fprintf(stderr, "stormbench: lost a connection during %s\n", label);
+                return false;
+            }
+        }
+        if (nready > 0) {
+            last = now_ns();
+        } else if (now_ns() - last > PHASE_TIMEOUT * 1000000000L) {
+            fprintf(stderr, "stormbench: %s did not settle\n", label);
+            return false;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    printf("%-10s %10.1f %12lu %14.1f %10lu", label, elapsed / 1e6, bytes_in - bytes_before,
+           (double) (bytes_in - bytes_before) / nbots, lines_in - lines_before);
+    if (server_pid > 0) {
+        printf(" %12.1f", (server_cpu() - cpu_before) * 1e3);
+    }
+    printf("\n");
+
+    return true;
+}
+
+/* -s: seconds of CPU the server has used, user and system, from /proc */
+double server_cpu(void)
+{
+    char path[64];
+    char stat[1024];
+    unsigned long utime;
+    unsigned long stime;
+    char *p;
+    FILE *file;
+
+    if (server_pid <= 0) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", server_pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fgets(stat, sizeof(stat), file) == NULL) {
+        stat[0] = '\0';
+    }
+    fclose(file);
+    /* The command name may hold spaces, so count fields from its closing parenthesis */
+    p = strrchr(stat, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
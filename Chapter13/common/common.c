@@ -309,11 +309,15 @@ int ssl_read_bytes(SSL *my_ssl,void *buf,unsigned int limit)
 {
     byte_t *my_buf = NULL;                          // Pointer to the buffer we want to write to
     unsigned int x = 0;                             // Counter for iteration over the buffer
+    int ret_val = 0;
     
     my_buf = (byte_t *)buf;                         // Point our pointer at the buffer provided in the arg list
     
-    for(;x<limit;x++) {                             // Walk the entire buffer
-        my_buf[x] = ssl_read_byte(my_ssl);          //  read a byte at a time
+    while(x < limit) {                              // Fill the entire buffer
+        ret_val = SSL_read(my_ssl,my_buf + x,limit - x);
+        if(ret_val <= 0)                            // The connection failed or closed before we had it all
+            return -1;                              //  so report an error
+        x += ret_val;
     }
 
     return 0;                                       //   and 0 on success
@@ -379,6 +383,90 @@ const char *network_get_ip_address(SSL *my_ssl)
     return(const char *) inet_ntoa(addr.sin_addr);  // Retrieve the IP as a string from the addr structure
 }
 
+/**
+* Pass an open file descriptor to another process over a UNIX domain
+*  socket using SCM_RIGHTS.  The receiver gets its own descriptor for
+*  the same connection, so the sender may close its copy afterwards.
+*
+*	@param chan The UNIX domain socket to send over
+*	@param fd The file descriptor to pass
+*	@return 0 on success, -1 on error
+*/
+int network_send_fd(int chan, int fd)
+{
+    struct msghdr msg;                  // The message, which carries the descriptor as ancillary data
+    struct iovec iov;                   // One byte of real data has to go along with it
+    struct cmsghdr *cmsg;               // The control message header holding the descriptor
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;           // Keeps buf aligned for a cmsghdr
+    } control;
+    char data = 0;
+
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);         // Fill in the single control message
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(chan, &msg, MSG_NOSIGNAL) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+* Receive a file descriptor sent with network_send_fd().
+*
+*	@param chan The UNIX domain socket to receive from
+*	@return The new file descriptor, or -1 if the other end closed chan or on error
+*/
+int network_recv_fd(int chan)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char data;
+    int fd = -1;
+
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(chan, &msg, 0) <= 0)    // EOF means the sender has gone away
+        return -1;
+
+    if (msg.msg_flags & MSG_CTRUNC)     // A descriptor that did not fit was discarded by the kernel
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);         // Make sure a whole descriptor actually came with the byte
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
+
 /**
 * Create a new RSA key for PKI signing and verification.
 * All keys are created with 2048 bit public modulus and 
@@ -527,7 +615,7 @@ void key_net_write_pub(RSA *this_key,SSL *my_ssl)
 /**
 * Read a public key written by key_net_write_pub().
 *   @param my_ssl The ssl connection to read the key from
-*   @param len The length in bytes to expect
+*   @return The key, or NULL if the length was out of range or the read failed
 */
 RSA *key_net_read_pub(SSL *my_ssl)
 {
@@ -536,8 +624,13 @@ RSA *key_net_read_pub(SSL *my_ssl)
     unsigned char *temp = NULL,*buff;           // The buffer to hold the DER encoded key
 
     len = ssl_read_uint(my_ssl);                // First find out how many bytes in the encoded key
+    if(len == 0 || len > MAX_NET_BYTES)         // Don't let the other end pick how much we allocate
+        return NULL;
     buff = temp = (unsigned char *)w_malloc(len); // Create a buffer for it
-    ssl_read_bytes(my_ssl,temp,len);            // Read the encoded key
+    if(ssl_read_bytes(my_ssl,temp,len) != 0) {  // Read the encoded key
+        w_free(buff);
+        return NULL;
+    }
     this_key = d2i_RSAPublicKey(NULL,&temp,len);// Decode the key 
     w_free(buff);                               // Free our buffer
     return this_key;                            // and return the key
@@ -36,6 +36,7 @@
 #define SERVER_AUTH_SUCCESS         1                   // Server message tells the client that authentication was successful
 #define SERVER_AUTH_FAILURE         2                   // Server message tells the client that authentication failed
 #define SSL_ERROR                   0                   // If ssl_read_uint returns 0 it is an error
+#define MAX_NET_BYTES               16384               // The largest signature or key length we accept from the other end
 
 // Report an error, then exit the thread/program                
 void report_error_q(const char *msg, const char *file, int line_no, int use_perror);
@@ -90,6 +91,10 @@ void ssl_write_bytes(SSL *my_ssl, void *message, unsigned int length);
 
 // A Network management wrapper allows us to get the IP address of a client
 const char *network_get_ip_address(SSL *my_ssl);
+// Pass an open file descriptor to another process over a UNIX domain socket
+int network_send_fd(int chan, int fd);
+// Receive a file descriptor passed with network_send_fd
+int network_recv_fd(int chan);
 
 // Create a new RSA Key
 RSA * key_create_key(void); 
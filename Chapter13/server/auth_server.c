@@ -8,6 +8,9 @@
 #include "common.h"
 #include "auth_server.h"
 
+worker_t workers[MAX_WORKERS];                  // The pre-spawned workers in handoff mode
+int num_workers = 0;
+
 /**
 * Authenticate a given username and password against the systems PAM interface.
 * Null username and/or passwords will fail.  The pam service name in the cache
@@ -90,20 +93,16 @@ int auth_conv(int num_msg,const struct pam_message **msg, struct pam_response **
   return PAM_SUCCESS;                                                   // Tell PAM we are done
 }
 
-/** The first time this function is called it sets up a listening BIO
- *   on the given port.  Every following call returns the next incoming
- *   connectin, or blocks until one is available. When called with a NULL 
- *   argument the listening BIO is closed and resources freed.
+/** Returns the SSL context every server connection uses, creating it on the
+ *   first call.  The certificate and private key are read from server.pem
+ *   in the current directory.
  */
-SSL *get_connection(char *port) {
-    SSL *my_ssl = NULL;                         // The next connection
-    static SSL_CTX *my_ssl_ctx = NULL;          // We use static here so we can use them on subsequent calls
-    static SSL_METHOD *my_ssl_method = NULL;   
-    static BIO *server_bio = NULL;
-    BIO *client_bio = NULL;
+SSL_CTX *get_server_context(void) {
+    static SSL_CTX *my_ssl_ctx = NULL;          // Created once, then shared by every connection
+    static SSL_METHOD *my_ssl_method = NULL;
 
-    if (port && !server_bio) {                   // If the port is set, but we dont have a BIO
-        my_ssl_method = TLSv1_server_method();  //  then we need to setup a new connection
+    if (my_ssl_ctx == NULL) {
+        my_ssl_method = TLSv1_server_method();
 
         if ((my_ssl_ctx = SSL_CTX_new(my_ssl_method)) == NULL) { // Setup a context
             report_error_q("Unable to setup context.",__FILE__,__LINE__,0);
@@ -117,6 +116,24 @@ SSL *get_connection(char *port) {
         if (!SSL_CTX_check_private_key(my_ssl_ctx)) {    // Verify the certificate
             report_error_q("Private key does not match certificate",__FILE__,__LINE__,0);
         }
+    }
+
+    return my_ssl_ctx;
+}
+
+/** The first time this function is called it sets up a listening BIO
+ *   on the given port.  Every following call returns the next incoming
+ *   connectin, or blocks until one is available. When called with a NULL 
+ *   argument the listening BIO is closed and resources freed.
+ */
+SSL *get_connection(char *port) {
+    SSL *my_ssl = NULL;                         // The next connection
+    static SSL_CTX *my_ssl_ctx = NULL;          // We use static here so we can use them on subsequent calls
+    static BIO *server_bio = NULL;
+    BIO *client_bio = NULL;
+
+    if (port && !server_bio) {                   // If the port is set, but we dont have a BIO
+        my_ssl_ctx = get_server_context();      //  then we need to setup a new connection
 
         // Setup for accepting and get our BIO
         if ((server_bio = BIO_new_accept(port)) == NULL) {
@@ -153,11 +170,44 @@ SSL *get_connection(char *port) {
                                     //   how we were called
 }
 
+/**
+ * Wraps a connection that a worker received from the master in an SSL session
+ *   and negotiates with the client.  A failed handshake is reported and NULL
+ *   returned, so the worker can go on to its next connection.
+ */
+SSL *get_connection_fd(int client_fd) {
+    SSL *my_ssl = NULL;
+
+    if ((my_ssl = SSL_new(get_server_context())) == NULL) {
+        report_error(ERR_error_string(ERR_get_error(),NULL),__FILE__,__LINE__,0);
+        return NULL;
+    }
+
+    SSL_set_fd(my_ssl,client_fd);                   // The socket is not closed by SSL_free(), the worker does that
+
+    if (SSL_accept(my_ssl) <= 0) {                  // Negotiate a connection with the client
+        report_error(ERR_error_string(ERR_get_error(),NULL),__FILE__,__LINE__,0);
+        SSL_free(my_ssl);
+        return NULL;
+    }
+
+    return my_ssl;
+}
+
 /** 
  * This is called as the starting point for each new process, once we are here we have 
  *   a connection, and we just need to exit() with EXIT_SUCCESS when we are done.
  */
 void child_process(SSL *my_ssl) {
+    serve_client(my_ssl);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Handles a single authentication request on a connected SSL session, then shuts the
+ *   session down.  Used by both the forked children and the pre-spawned workers.
+ */
+void serve_client(SSL *my_ssl) {
     char *username = NULL, *password = NULL,*key_file = NULL;
     RSA *users_key = NULL;
     int authenticated = 0;
@@ -169,7 +219,7 @@ void child_process(SSL *my_ssl) {
 
     switch (ssl_read_uint(my_ssl)) {
     case SSL_ERROR:
-        report_error_q(ERR_error_string(ERR_get_error(),NULL),__FILE__,__LINE__,0); // Report any problems and quit
+        report_error(ERR_error_string(ERR_get_error(),NULL),__FILE__,__LINE__,0); // Report any problems
         break;
     case REQUEST_KEY_AUTH:
         // Key Authentication
@@ -180,9 +230,15 @@ void child_process(SSL *my_ssl) {
         users_key = key_read_pub(key_file);
         w_free(key_file);
         signed_size = ssl_read_uint(my_ssl);
+        if(signed_size == 0 || signed_size > MAX_NET_BYTES) {   // Don't let the client pick how much we allocate
+            report_error("Bad signed data size from client",__FILE__,__LINE__,0);
+            break;
+        }
         signed_buffer = (byte_t *)w_malloc(signed_size);
-        if(ssl_read_bytes(my_ssl,signed_buffer,signed_size) != 0)
-            report_error_q("Error reading signed data from client",__FILE__,__LINE__,0);
+        if(ssl_read_bytes(my_ssl,signed_buffer,signed_size) != 0) {
+            report_error("Error reading signed data from client",__FILE__,__LINE__,0);   // Only this client is lost,
+            break;                                                                      //  a worker goes on to the next
+        }
 
         if(key_verify_signature(users_key,signed_buffer,signed_size,username,strlen(username)) == 0) {
             ssl_write_uint(my_ssl,SERVER_AUTH_SUCCESS);
@@ -200,7 +256,10 @@ void child_process(SSL *my_ssl) {
         printf("(%s) User %s %s via PAM\n",network_get_ip_address(my_ssl),username,authenticated ? "authenticated" : "failed");
         if(authenticated) {
             ssl_write_uint(my_ssl,SERVER_AUTH_SUCCESS);
-            users_key = key_net_read_pub(my_ssl);
+            if((users_key = key_net_read_pub(my_ssl)) == NULL) {
+                report_error("Error reading public key from client",__FILE__,__LINE__,0);
+                break;
+            }
             string_size = strlen(username) + strlen(network_get_ip_address(my_ssl)) + 10;
             key_file = w_malloc(string_size);
             snprintf(key_file,string_size,"%s.%s.pub",username,network_get_ip_address(my_ssl));
@@ -215,19 +274,194 @@ void child_process(SSL *my_ssl) {
 	if(users_key) {
 		key_destroy_key(users_key);
 	}
+    w_free(signed_buffer);                                      // Release this request's memory, w_free() ignores NULL
+    w_free(password);
+    w_free(username);
 
     SSL_shutdown(my_ssl);
     SSL_free(my_ssl);
+}
+
+/**
+ * Opens a plain listening socket on port for the handoff mode, where the master
+ *   accepts connections itself and leaves the SSL negotiation to the workers.
+ */
+int open_listener(char *port) {
+    struct sockaddr_in addr;
+    int listen_fd = -1;
+    int val = 1;
+
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        report_error_q("Unable to create socket",__FILE__,__LINE__,1);
+    }
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        report_error_q("Unable to bind listening socket",__FILE__,__LINE__,1);
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        report_error_q("Unable to listen",__FILE__,__LINE__,1);
+    }
+
+    return listen_fd;
+}
+
+/**
+ * Forks worker number x with a new UNIX domain socket pair as its channel to the
+ *   master.  The master end is kept in workers[x].chan.
+ */
+int spawn_worker(int x, int listen_fd) {
+    int sv[2];
+    int y;
+
+    workers[x].chan = -1;
+    workers[x].handed = 0;
+    workers[x].completed = 0;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        report_error("Unable to create worker channel",__FILE__,__LINE__,1);
+        return -1;
+    }
+
+    fflush(stdout);                                     // Don't let the worker inherit buffered output
+    if ((workers[x].pid = fork()) < 0) {
+        report_error("Unable to fork worker",__FILE__,__LINE__,1);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (workers[x].pid == 0) {                          // In the worker, keep only our end of our channel
+        close(listen_fd);
+        close(sv[0]);
+        for (y = 0; y < num_workers; y++) {
+            if (y != x && workers[y].chan >= 0)
+                close(workers[y].chan);
+        }
+        worker_process(sv[1]);
+    }
+
+    close(sv[1]);
+    workers[x].chan = sv[0];
+    return 0;
+}
+
+/**
+ * The main loop of a pre-spawned worker.  Each connection passed from the master
+ *   is served to completion, then the worker reports how many it has finished so
+ *   the master can keep track of its load.  Returns when the master goes away.
+ */
+void worker_process(int chan) {
+    SSL *my_ssl = NULL;
+    unsigned long completed = 0;                        // Our load report, a running count of finished connections
+    int client_fd = -1;
+
+    signal(SIGCHLD, SIG_DFL);
+    w_memory_init();
+
+    while ((client_fd = network_recv_fd(chan)) >= 0) {
+        if ((my_ssl = get_connection_fd(client_fd)) != NULL) {
+            serve_client(my_ssl);
+        }
+        close(client_fd);
+        w_free_all();                                   // Release what this client's request allocated
+        completed++;
+        send(chan, &completed, sizeof(completed), MSG_NOSIGNAL);
+    }
+
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * The master side of the handoff mode.  The master only accepts connections and
+ *   passes each one over SCM_RIGHTS to the worker with the fewest connections in
+ *   hand, so no fork() sits between accept() and the SSL handshake while every
+ *   client is still served in a process of its own.  Workers that die are replaced.
+ */
+void handoff_loop(int listen_fd) {
+    struct pollfd fds[MAX_WORKERS + 1];
+    unsigned long report = 0;
+    unsigned long load = 0, best_load = 0;
+    unsigned int next = 0;                              // Rotates the starting point so ties are spread out
+    int client_fd = -1;
+    int best = -1;
+    int x, n;
+
+    get_server_context();                               // Load the certificate once, before the workers fork
+
+    for (x = 0; x < num_workers; x++) {
+        if (spawn_worker(x, listen_fd) < 0)
+            report_error_q("Unable to start workers",__FILE__,__LINE__,0);
+    }
+
+    for (;;) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (x = 0; x < num_workers; x++) {
+            fds[x + 1].fd = workers[x].chan;
+            fds[x + 1].events = POLLIN;
+        }
+        if (poll(fds, num_workers + 1, -1) <= 0)
+            continue;
+
+        for (x = 0; x < num_workers; x++) {             // Collect load reports before choosing a worker
+            if (fds[x + 1].revents == 0)
+                continue;
+            n = recv(workers[x].chan, &report, sizeof(report), MSG_DONTWAIT);
+            if (n == sizeof(report)) {
+                workers[x].completed = report;
+            } else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                printf("Worker %d died, respawning\n", workers[x].pid);
+                close(workers[x].chan);
+                spawn_worker(x, listen_fd);
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        if ((client_fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+
+        best = -1;                                      // Find the least loaded worker
+        for (x = 0; x < num_workers; x++) {
+            n = (next + x) % num_workers;
+            if (workers[n].chan < 0)
+                continue;
+            load = workers[n].handed - workers[n].completed;
+            if (best < 0 || load < best_load) {
+                best = n;
+                best_load = load;
+            }
+        }
+        next++;
+
+        if (best >= 0 && network_send_fd(workers[best].chan, client_fd) == 0)
+            workers[best].handed++;
+        close(client_fd);                               // The worker has its own copy now
+    }
+}
+
+/**
+ * Reaps exited workers in handoff mode; their death is noticed on their channel.
+ */
+void sigchld_handler(int signo) {
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+}
+
 int main(int argc, char *argv[]) {
     char *port = NULL;                                          // The port we should listen on
     SSL *my_ssl = NULL;
     int my_pid = 0;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port\n",argv[0]);            // We should report the problem in a nicer way than report_error
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s port [workers]\n",argv[0]);  // We should report the problem in a nicer way than report_error
         exit(EXIT_FAILURE);                                     // Exit with an error
     }
 
@@ -238,6 +472,16 @@ int main(int argc, char *argv[]) {
     /*chdir("/etc/auth_server");                                // To have the server truly daemonize and chroot to /etc/auth_server,  
     chroot("/etc/auth_server");								   	//   uncomment these lines, and ensure the cert server.pem is in 
     daemon(0,0); */												//   /etc/auth_server before running.
+
+    if (argc == 3) {                                            // With a worker count, hand connections to pre-spawned workers
+        num_workers = atoi(argv[2]);
+        if (num_workers < 1 || num_workers > MAX_WORKERS) {
+            fprintf(stderr, "%s: workers must be 1 to %d\n",argv[0],MAX_WORKERS);
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGCHLD, sigchld_handler);
+        handoff_loop(open_listener(port));
+    }
     
     for (;;) {                                                   // This is our infinite server loop
         my_ssl = get_connection(port);                           // Get the next connection
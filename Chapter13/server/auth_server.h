@@ -10,14 +10,38 @@
 
 #include <security/pam_appl.h> // Include for PAM
 
+#include <errno.h>      // Includes for the handoff mode
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#define MAX_WORKERS 256 // Largest number of pre-spawned workers in handoff mode
+
 // Setup/Get connections
 SSL *get_connection(char *port);
 // Authenticate a username/password via PAM
 int pam_authenticate_user(const char *,const char *);
 // Our PAM Conversation function
 int auth_conv(int, const struct pam_message **, struct pam_response **, void *);
+// Get the shared SSL context, loading server.pem on the first call
+SSL_CTX *get_server_context(void);
+// Negotiate SSL on a connection passed in from the master
+SSL *get_connection_fd(int client_fd);
 // The child processes 'main'
 void child_process(SSL *my_ssl);
+// Handle one authentication request on a connection
+void serve_client(SSL *my_ssl);
+// Open the plain listening socket used in handoff mode
+int open_listener(char *port);
+// Fork worker number x with a channel back to the master
+int spawn_worker(int x, int listen_fd);
+// The pre-spawned workers 'main'
+void worker_process(int chan);
+// Accept connections and pass each to the least loaded worker
+void handoff_loop(int listen_fd);
+// Reap exited workers
+void sigchld_handler(int signo);
 // The PAM conversation function
 int auth_conv(int num_msg,const struct pam_message **msg, struct pam_response **response, void *appdata_ptr);
 
@@ -31,4 +55,18 @@ typedef struct auth_struct
 } auth_struct;
 
 
+// A pre-spawned worker as the master sees it, handed - completed is its load
+typedef struct worker_t
+{
+  // The workers process id
+  pid_t pid;
+  // The masters end of the UNIX domain socket pair to the worker
+  int chan;
+  // Connections passed to the worker
+  unsigned long handed;
+  // Connections the worker has reported finished
+  unsigned long completed;
+} worker_t;
+
+
 #endif   